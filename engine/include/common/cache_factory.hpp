@@ -1,11 +1,22 @@
 #ifndef CACHE_FACTORY_HPP
 #define CACHE_FACTORY_HPP
 
+#include <cstddef>
+#include <functional>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include "tracy/Tracy.hpp"
 
 namespace vme {
-template <typename Derived, typename Key, typename Value> class CacheFactory {
+// Mixes hash of value into seed, for hashing keys by content
+template <typename T> void hashCombine(size_t &seed, const T &value) noexcept {
+  seed ^= std::hash<T>{}(value) + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+}
+
+template <typename Derived, typename Key, typename Value, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>>
+class CacheFactory {
 public:
   CacheFactory() = default;
   CacheFactory(const CacheFactory &) = delete;
@@ -22,10 +33,26 @@ public:
     //std::lock_guard lock(mutex_);
     return cache_.insert({key, static_cast<Derived *>(this)->create(key)}).first->second;
   }
+  // Looks up by a non-owning key with transparent Hash and KeyEqual, owning key is only built on
+  // a miss
+  template <typename LookupKey>
+    requires(!std::is_same_v<LookupKey, Key> && requires { typename Hash::is_transparent; })
+  Value &get(const LookupKey &key) {
+    if (auto it = cache_.find(key); it != cache_.end())
+      return it->second;
+    Key owned(key);
+    auto value = static_cast<Derived *>(this)->create(owned);
+    return cache_.emplace(std::move(owned), std::move(value)).first->second;
+  }
+  // Nullptr when key was never requested
+  Value *find(const Key &key) {
+    auto it = cache_.find(key);
+    return it != cache_.end() ? &it->second : nullptr;
+  }
   void reset() { cache_.clear(); }
 
 private:
-  std::unordered_map<Key, Value> cache_;
+  std::unordered_map<Key, Value, Hash, KeyEqual> cache_;
   //std::shared_mutex mutex_;
   //TracySharedLockable(std::shared_mutex, mutex_);
 };
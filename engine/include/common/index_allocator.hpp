@@ -0,0 +1,141 @@
+#ifndef INDEX_ALLOCATOR_HPP
+#define INDEX_ALLOCATOR_HPP
+
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+
+namespace vme {
+// Lock-free allocator of indices below capacity. Never-used indices come from a high-water mark,
+// recycled ones from a two-level bitset, lowest recycled index first to keep used range compact.
+// Bitsets are sized for capacity up front, growing them would need a lock, but at a bit per index
+// they stay small.
+class IndexAllocator {
+public:
+  static constexpr uint32_t invalid_index = UINT32_MAX;
+
+  IndexAllocator() = default;
+  explicit IndexAllocator(uint32_t capacity)
+      : capacity_(capacity), word_count_(getWordCount(capacity)),
+        summary_count_(getWordCount(word_count_)),
+        free_bits_(std::make_unique<std::atomic<uint64_t>[]>(word_count_)),
+        summary_(std::make_unique<std::atomic<uint64_t>[]>(summary_count_)) {}
+  // Moves are not thread-safe
+  IndexAllocator(IndexAllocator &&rhs) noexcept { *this = std::move(rhs); }
+  IndexAllocator &operator=(IndexAllocator &&rhs) noexcept {
+    capacity_ = rhs.capacity_;
+    word_count_ = rhs.word_count_;
+    summary_count_ = rhs.summary_count_;
+    high_water_mark_.store(rhs.high_water_mark_.load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+    recycled_count_.store(rhs.recycled_count_.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+    free_bits_ = std::move(rhs.free_bits_);
+    summary_ = std::move(rhs.summary_);
+    return *this;
+  }
+
+  uint32_t getCapacity() const noexcept { return capacity_; }
+  uint32_t getHighWaterMark() const noexcept {
+    return high_water_mark_.load(std::memory_order_relaxed);
+  }
+  // Approximate while other threads allocate or free
+  uint32_t getFreeCount() const noexcept {
+    const auto recycled = recycled_count_.load(std::memory_order_relaxed);
+    return capacity_ - getHighWaterMark() + static_cast<uint32_t>(recycled > 0 ? recycled : 0);
+  }
+
+  // Returns invalid_index when all indices are in use
+  uint32_t allocate() noexcept {
+    // Counter only avoids scanning when nothing was freed, bitset is authoritative
+    if (recycled_count_.load(std::memory_order_relaxed) > 0)
+      if (auto index = allocateRecycled(); index != invalid_index)
+        return index;
+    auto index = high_water_mark_.load(std::memory_order_relaxed);
+    while (index < capacity_)
+      if (high_water_mark_.compare_exchange_weak(index, index + 1, std::memory_order_relaxed))
+        return index;
+    // Other threads may have freed indices since the first attempt
+    return allocateRecycled();
+  }
+
+  void free(uint32_t index) noexcept {
+    assert(index < getHighWaterMark());
+    const auto word_index = index / bits_per_word;
+    const auto bit = uint64_t{1} << (index % bits_per_word);
+    [[maybe_unused]] const auto bits =
+        free_bits_[word_index].fetch_or(bit, std::memory_order_release);
+    assert(!(bits & bit));
+    summary_[word_index / bits_per_word].fetch_or(getSummaryBit(word_index),
+                                                  std::memory_order_acq_rel);
+    recycled_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Not thread-safe
+  void reset() noexcept {
+    high_water_mark_.store(0, std::memory_order_relaxed);
+    recycled_count_.store(0, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < word_count_; ++i)
+      free_bits_[i].store(0, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < summary_count_; ++i)
+      summary_[i].store(0, std::memory_order_relaxed);
+  }
+
+private:
+  static constexpr uint32_t bits_per_word = 64;
+
+  uint32_t capacity_ = 0;
+  uint32_t word_count_ = 0;
+  uint32_t summary_count_ = 0;
+  std::atomic<uint32_t> high_water_mark_ = 0;
+  // Transiently negative when an index is taken before its free is counted
+  std::atomic<int32_t> recycled_count_ = 0;
+  // Bit per index, set when index is free
+  std::unique_ptr<std::atomic<uint64_t>[]> free_bits_;
+  // Bit per free_bits_ word, set when word may have a free index
+  std::unique_ptr<std::atomic<uint64_t>[]> summary_;
+
+  static constexpr uint32_t getWordCount(uint32_t bit_count) noexcept {
+    return (bit_count + bits_per_word - 1) / bits_per_word;
+  }
+  static constexpr uint64_t getSummaryBit(uint32_t word_index) noexcept {
+    return uint64_t{1} << (word_index % bits_per_word);
+  }
+
+  uint32_t allocateRecycled() noexcept {
+    for (uint32_t i = 0; i < summary_count_; ++i) {
+      for (auto summary = summary_[i].load(std::memory_order_acquire); summary;
+           summary &= summary - 1) {
+        const auto word_index = i * bits_per_word + std::countr_zero(summary);
+        auto &word = free_bits_[word_index];
+        auto bits = word.load(std::memory_order_relaxed);
+        while (bits) {
+          const auto bit = bits & (~bits + 1);
+          if (word.compare_exchange_weak(bits, bits & ~bit, std::memory_order_acquire,
+                                         std::memory_order_relaxed)) {
+            recycled_count_.fetch_sub(1, std::memory_order_relaxed);
+            if (bits == bit)
+              clearSummaryBit(word_index);
+            return word_index * bits_per_word + std::countr_zero(bit);
+          }
+        }
+        // Word was drained by other threads
+        clearSummaryBit(word_index);
+      }
+    }
+    return invalid_index;
+  }
+
+  void clearSummaryBit(uint32_t word_index) noexcept {
+    auto &summary = summary_[word_index / bits_per_word];
+    summary.fetch_and(~getSummaryBit(word_index), std::memory_order_acq_rel);
+    // Concurrent free may have refilled the word before its summary bit was cleared
+    if (free_bits_[word_index].load(std::memory_order_acquire))
+      summary.fetch_or(getSummaryBit(word_index), std::memory_order_acq_rel);
+  }
+};
+} // namespace vme
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef JOB_SYSTEM_HPP
+#define JOB_SYSTEM_HPP
+
+#include <tracy/Tracy.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace vme {
+class JobSystem final {
+public:
+  JobSystem() : JobSystem(std::max(std::thread::hardware_concurrency(), 2u) - 1) {}
+  explicit JobSystem(unsigned num_workers) {
+    workers_.reserve(num_workers);
+    for (unsigned i = 0; i < num_workers; ++i)
+      workers_.emplace_back([this, i] { work(i); });
+  }
+  JobSystem(const JobSystem &) = delete;
+  JobSystem(JobSystem &&) = delete;
+  JobSystem &operator=(const JobSystem &) = delete;
+  JobSystem &operator=(JobSystem &&) = delete;
+  ~JobSystem() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    condition_.notify_all();
+    for (auto &worker : workers_)
+      worker.join();
+  }
+
+  unsigned getNumWorkers() const noexcept { return static_cast<unsigned>(workers_.size()); }
+  bool isWorkerThread() const noexcept { return current_ == this; }
+
+  template <typename Func> auto submit(Func &&func) -> std::future<std::invoke_result_t<Func>> {
+    using Result = std::invoke_result_t<Func>;
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Func>(func));
+    auto future = task->get_future();
+    {
+      std::lock_guard lock(mutex_);
+      jobs_.emplace([task]() { (*task)(); });
+    }
+    condition_.notify_one();
+    return future;
+  }
+
+  // Calls func(i) for every i in [0, count), calling thread takes part in the work. Called from a
+  // job it runs inline, as waiting on queued jobs could block every worker
+  template <typename Func> void parallelFor(size_t count, Func &&func) {
+    if (isWorkerThread()) {
+      for (size_t i = 0; i < count; ++i)
+        func(i);
+      return;
+    }
+    std::vector<std::future<void>> futures;
+    futures.reserve(count);
+    for (size_t i = 1; i < count; ++i)
+      futures.push_back(submit([&func, i]() { func(i); }));
+    // Jobs reference func, so all of them have to finish before an exception propagates
+    std::exception_ptr exception;
+    try {
+      if (count)
+        func(size_t{0});
+    } catch (...) {
+      exception = std::current_exception();
+    }
+    for (auto &future : futures)
+      future.wait();
+    if (exception)
+      std::rethrow_exception(exception);
+    for (auto &future : futures)
+      future.get();
+  }
+
+private:
+  std::vector<std::thread> workers_;
+  std::queue<std::function<void()>> jobs_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stop_ = false;
+  // Job system the current thread works for
+  static inline thread_local const JobSystem *current_ = nullptr;
+
+  void work(unsigned index) {
+    const std::string name = "Worker " + std::to_string(index);
+    tracy::SetThreadName(name.c_str());
+    current_ = this;
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock lock(mutex_);
+        condition_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        if (stop_ && jobs_.empty())
+          return;
+        job = std::move(jobs_.front());
+        jobs_.pop();
+      }
+      job();
+    }
+  }
+};
+} // namespace vme
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef STREAM_COPY_HPP
+#define STREAM_COPY_HPP
+
+#include "job_system.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) ||                                 \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define VME_STREAM_COPY_SIMD 1
+#endif
+
+namespace vme {
+// Copies memory with non-temporal stores, bypassing caches. Meant for destinations that are
+// write-combined (e.g. host-visible GPU memory) or too big to benefit from being cached.
+inline void streamCopy(void *dst, const void *src, size_t size) noexcept {
+#ifdef VME_STREAM_COPY_SIMD
+#ifdef __AVX2__
+  using Vector = __m256i;
+#else
+  using Vector = __m128i;
+#endif
+  constexpr size_t alignment = sizeof(Vector);
+  auto *d = static_cast<std::byte *>(dst);
+  const auto *s = static_cast<const std::byte *>(src);
+  // Copy unaligned head with regular stores
+  const size_t head =
+      std::min(size, (alignment - reinterpret_cast<uintptr_t>(d) % alignment) % alignment);
+  std::memcpy(d, s, head);
+  d += head;
+  s += head;
+  size -= head;
+  // Destination is aligned now, source may still be unaligned
+  constexpr size_t unroll = 4;
+  for (; size >= alignment * unroll; size -= alignment * unroll) {
+#ifdef __AVX2__
+    const Vector v0 = _mm256_loadu_si256(reinterpret_cast<const Vector *>(s) + 0);
+    const Vector v1 = _mm256_loadu_si256(reinterpret_cast<const Vector *>(s) + 1);
+    const Vector v2 = _mm256_loadu_si256(reinterpret_cast<const Vector *>(s) + 2);
+    const Vector v3 = _mm256_loadu_si256(reinterpret_cast<const Vector *>(s) + 3);
+    _mm256_stream_si256(reinterpret_cast<Vector *>(d) + 0, v0);
+    _mm256_stream_si256(reinterpret_cast<Vector *>(d) + 1, v1);
+    _mm256_stream_si256(reinterpret_cast<Vector *>(d) + 2, v2);
+    _mm256_stream_si256(reinterpret_cast<Vector *>(d) + 3, v3);
+#else
+    const Vector v0 = _mm_loadu_si128(reinterpret_cast<const Vector *>(s) + 0);
+    const Vector v1 = _mm_loadu_si128(reinterpret_cast<const Vector *>(s) + 1);
+    const Vector v2 = _mm_loadu_si128(reinterpret_cast<const Vector *>(s) + 2);
+    const Vector v3 = _mm_loadu_si128(reinterpret_cast<const Vector *>(s) + 3);
+    _mm_stream_si128(reinterpret_cast<Vector *>(d) + 0, v0);
+    _mm_stream_si128(reinterpret_cast<Vector *>(d) + 1, v1);
+    _mm_stream_si128(reinterpret_cast<Vector *>(d) + 2, v2);
+    _mm_stream_si128(reinterpret_cast<Vector *>(d) + 3, v3);
+#endif
+    d += alignment * unroll;
+    s += alignment * unroll;
+  }
+  // Make streaming stores globally visible before the tail and any subsequent submit
+  _mm_sfence();
+  std::memcpy(d, s, size);
+#else
+  std::memcpy(dst, src, size);
+#endif
+}
+
+// Splits big copies between job system workers, each of them streaming its own range
+inline void parallelStreamCopy(JobSystem &job_system, void *dst, const void *src, size_t size,
+                               size_t min_job_size = 1024 * 1024) {
+  const size_t num_jobs =
+      std::clamp<size_t>(size / min_job_size, 1, job_system.getNumWorkers() + 1);
+  if (num_jobs == 1) {
+    streamCopy(dst, src, size);
+    return;
+  }
+  // Split points are cache line aligned in dst, so workers never share a write-combining buffer.
+  // First job also copies the unaligned head
+  constexpr size_t cache_line = 64;
+  const size_t head = (cache_line - reinterpret_cast<uintptr_t>(dst) % cache_line) % cache_line;
+  const size_t job_size =
+      ((size - head + num_jobs - 1) / num_jobs + cache_line - 1) / cache_line * cache_line;
+  job_system.parallelFor(num_jobs, [&](size_t i) {
+    ZoneScopedN("Stream copy");
+    const size_t begin = i ? head + i * job_size : 0;
+    const size_t end = std::min(head + (i + 1) * job_size, size);
+    if (begin >= end)
+      return;
+    streamCopy(static_cast<std::byte *>(dst) + begin, static_cast<const std::byte *>(src) + begin,
+               end - begin);
+  });
+}
+} // namespace vme
+
+#endif
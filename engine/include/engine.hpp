@@ -13,6 +13,9 @@ struct Version {
 
 class Application {
 public:
+  // With VME_ALLOCATION_TRACKING, heap allocations in Render zone are flagged after warmup
+  static constexpr unsigned allocation_check_warmup_frames = 64;
+
   Application(const std::string &name, const Version &version);
 
   const std::string &getName() const noexcept { return name_; }
@@ -5,12 +5,16 @@
 
 #include "scene/scene.hpp"
 #include "services/gfx/allocator.hpp"
+#include "services/gfx/mega_buffer.hpp"
 #include "services/gfx/pipelines.hpp"
 
 namespace rg {
 class ForwardPass final : public Pass {
 public:
   ForwardPass(const vme::Scene &scene);
+  ForwardPass(const ForwardPass &) = delete;
+  ForwardPass &operator=(const ForwardPass &) = delete;
+  ~ForwardPass();
 
   void onSwapchainResize(vk::Extent2D extent);
 
@@ -32,11 +36,15 @@ private:
   vma::UniqueImage depth_image_;
   vk::UniqueImageView depth_image_view_;
 
-  gfx::Pipeline pipeline_;
+  // Draws are skipped until pipeline is compiled
+  gfx::AsyncPipeline pipeline_;
 
-  vma::UniqueBuffer materials_;
-  vma::UniqueBuffer transforms_;
-  vk::DescriptorSet descriptor_set_;
+  gfx::MegaBuffer::Allocation materials_;
+  gfx::MegaBuffer::Allocation transforms_;
+  bool push_descriptors_ = false;
+
+  // Transient set, so that it always references current geometry buffer
+  void bindDescriptorSet(gfx::Frame &frame, const gfx::Pipeline &pipeline);
 };
 } // namespace rg
 
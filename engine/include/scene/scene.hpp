@@ -33,8 +33,8 @@ public:
     Texture albedo, metallic_roughness, emmisive, ao, normal;
   };
 
+  // Offset into geometry buffer of the context
   struct BufferView {
-    vk::Buffer buffer;
     vk::DeviceSize offset;
   };
   struct Primitive {
@@ -50,13 +50,20 @@ public:
 
   Scene() = default;
   Scene(gfx::Context &context, const tinygltf::Model &model);
+  Scene(const Scene &) = delete;
+  Scene(Scene &&) = delete;
+  Scene &operator=(const Scene &) = delete;
+  Scene &operator=(Scene &&) = delete;
+  ~Scene();
 
   const std::vector<glm::mat4> &getTransforms() const noexcept { return transforms_; }
   const std::vector<Material> &getMaterials() const noexcept { return materials_; }
   const std::vector<Mesh> &getMeshes() const noexcept { return meshes_; }
 
 private:
-  std::vector<vma::UniqueBuffer> buffers_;
+  gfx::Context *context_ = nullptr;
+
+  std::vector<gfx::MegaBuffer::Allocation> buffers_;
   std::vector<std::pair<gfx::Image, uint32_t>> images_;
   std::vector<std::pair<gfx::Sampler, uint32_t>> samplers_;
 
@@ -4,6 +4,9 @@
 #include <vk_mem_alloc.h>
 #include <vulkan/vulkan.hpp>
 
+#include <functional>
+#include <string>
+
 namespace vma {
 
 template <typename OwnerType> class ObjectDestroy {
@@ -81,6 +84,13 @@ private:
 using AllocationCreateInfo = VmaAllocationCreateInfo;
 using PoolCreateInfo = VmaPoolCreateInfo;
 using AllocatorCreateInfo = VmaAllocatorCreateInfo;
+using DefragmentationInfo = VmaDefragmentationInfo;
+using DefragmentationPassMoveInfo = VmaDefragmentationPassMoveInfo;
+using DefragmentationStats = VmaDefragmentationStats;
+using DefragmentationContext = VmaDefragmentationContext;
+using VirtualBlockCreateInfo = VmaVirtualBlockCreateInfo;
+using VirtualAllocationCreateInfo = VmaVirtualAllocationCreateInfo;
+using VirtualAllocation = VmaVirtualAllocation;
 
 class Allocator;
 
@@ -207,6 +217,54 @@ private:
 
 using UniquePool = UniqueHandle<Pool, Allocator>;
 
+// VmaVirtualBlock wrapper
+class VirtualBlock {
+public:
+  using CType = VmaVirtualBlock;
+  using NativeType = VmaVirtualBlock;
+
+  VirtualBlock() = default;
+  VirtualBlock(std::nullptr_t) noexcept {}
+  VirtualBlock(VmaVirtualBlock virtual_block) noexcept : virtual_block_(virtual_block) {}
+
+  VirtualBlock &operator=(VmaVirtualBlock virtual_block) noexcept {
+    virtual_block_ = virtual_block;
+    return *this;
+  }
+
+  VirtualBlock &operator=(std::nullptr_t) noexcept {
+    virtual_block_ = {};
+    return *this;
+  }
+
+  operator VmaVirtualBlock() const noexcept { return virtual_block_; }
+  explicit operator bool() const noexcept { return virtual_block_ != VK_NULL_HANDLE; }
+  bool operator!() const noexcept { return virtual_block_ == VK_NULL_HANDLE; }
+  bool operator==(const VirtualBlock &rhs) const noexcept {
+    return virtual_block_ == rhs.virtual_block_;
+  }
+  bool operator!=(const VirtualBlock &rhs) const noexcept {
+    return virtual_block_ != rhs.virtual_block_;
+  }
+
+  // Returns null allocation if block has no free range of requested size
+  VirtualAllocation allocate(const VirtualAllocationCreateInfo &alloc_info,
+                             vk::DeviceSize &offset) noexcept;
+  void free(VirtualAllocation allocation) noexcept;
+  bool isEmpty() const noexcept;
+  VmaStatistics getStatistics() const noexcept;
+
+  void destroy() noexcept;
+
+private:
+  VmaVirtualBlock virtual_block_ = {};
+};
+
+using UniqueVirtualBlock = UniqueHandle<VirtualBlock>;
+
+VirtualBlock createVirtualBlock(const VirtualBlockCreateInfo &create_info);
+UniqueVirtualBlock createVirtualBlockUnique(const VirtualBlockCreateInfo &create_info);
+
 // VmaAllocator wrapper
 class Allocator {
 public:
@@ -232,14 +290,26 @@ public:
   bool operator!() const noexcept { return allocator_ == VK_NULL_HANDLE; }
 
   VmaAllocatorInfo getInfo() const noexcept;
+  const VkPhysicalDeviceMemoryProperties &getMemoryProperties() const noexcept;
   void setCurrentFrameIndex(uint32_t index) noexcept;
+  // budgets must point to an array with one element per memory heap
+  void getHeapBudgets(VmaBudget *budgets) const noexcept;
+  VmaTotalStatistics calculateStatistics() const noexcept;
   uint32_t findMemoryTypeIndex(uint32_t memory_type_bits, const AllocationCreateInfo &alloc_info);
+  uint32_t findMemoryTypeIndexForBufferInfo(const vk::BufferCreateInfo &buffer_info,
+                                            const AllocationCreateInfo &alloc_info);
+  uint32_t findMemoryTypeIndexForImageInfo(const vk::ImageCreateInfo &image_info,
+                                           const AllocationCreateInfo &alloc_info);
 
+  // Allocations can be named for debugging, name is copied by VMA
   Allocation createAllocation(const vk::MemoryRequirements &memory_requirements,
-                              const AllocationCreateInfo &alloc_info);
+                              const AllocationCreateInfo &alloc_info, const char *name = nullptr);
   UniqueAllocation createAllocationUnique(const vk::MemoryRequirements &memory_requirements,
-                                          const AllocationCreateInfo &alloc_info);
+                                          const AllocationCreateInfo &alloc_info,
+                                          const char *name = nullptr);
   VmaAllocationInfo getAllocationInfo(Allocation allocation) const noexcept;
+  void setAllocationName(Allocation allocation, const char *name) noexcept;
+  void setAllocationUserData(Allocation allocation, void *user_data) noexcept;
   void bindBufferMemory(Allocation allocation, vk::Buffer buffer);
   void bindImageMemory(Allocation allocation, vk::Image image);
   void *mapMemory(Allocation allocation);
@@ -247,18 +317,20 @@ public:
   void destroy(Allocation allocation) noexcept;
 
   Buffer createBuffer(const vk::BufferCreateInfo &buffer_info,
-                      const AllocationCreateInfo &alloc_info);
+                      const AllocationCreateInfo &alloc_info, const char *name = nullptr);
   UniqueBuffer createBufferUnique(const vk::BufferCreateInfo &buffer_info,
-                                  const AllocationCreateInfo &alloc_info);
+                                  const AllocationCreateInfo &alloc_info,
+                                  const char *name = nullptr);
   void destroy(Buffer buffer) noexcept;
 
   vk::Buffer createAliasingBuffer(Allocation allocation, const vk::BufferCreateInfo &buffer_info);
   vk::UniqueBuffer createAliasingBufferUnique(Allocation allocation,
                                               const vk::BufferCreateInfo &buffer_info);
 
-  Image createImage(const vk::ImageCreateInfo &image_info, const AllocationCreateInfo &alloc_info);
+  Image createImage(const vk::ImageCreateInfo &image_info, const AllocationCreateInfo &alloc_info,
+                    const char *name = nullptr);
   UniqueImage createImageUnique(const vk::ImageCreateInfo &image_info,
-                                const AllocationCreateInfo &alloc_info);
+                                const AllocationCreateInfo &alloc_info, const char *name = nullptr);
   void destroy(Image image) noexcept;
 
   vk::Image createAliasingImage(Allocation allocation, const vk::ImageCreateInfo &image_info);
@@ -267,8 +339,23 @@ public:
 
   Pool createPool(const PoolCreateInfo &pool_info);
   UniquePool createPoolUnique(const PoolCreateInfo &pool_info);
+  void setPoolName(Pool pool, const char *name) noexcept;
+  VmaStatistics getPoolStatistics(Pool pool) const noexcept;
+  VmaDetailedStatistics calculatePoolStatistics(Pool pool) const noexcept;
   void destroy(Pool pool) noexcept;
 
+  DefragmentationContext beginDefragmentation(const DefragmentationInfo &defragmentation_info);
+  DefragmentationStats endDefragmentation(DefragmentationContext context) noexcept;
+  // Returns false if there is nothing left to move
+  bool beginDefragmentationPass(DefragmentationContext context,
+                                DefragmentationPassMoveInfo &pass_info);
+  // Returns false if defragmentation is complete
+  bool endDefragmentationPass(DefragmentationContext context,
+                              DefragmentationPassMoveInfo &pass_info);
+
+  // JSON compatible with VMA visualizer
+  std::string buildStatsString(bool detailed_map) const;
+
   void destroy() noexcept;
 
 private:
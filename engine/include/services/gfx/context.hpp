@@ -1,27 +1,48 @@
 #ifndef CONTEXT_HPP
 #define CONTEXT_HPP
 
+#include "defragmenter.hpp"
 #include "frame.hpp"
+#include "mega_buffer.hpp"
+#include "memory_pools.hpp"
+#include "memory_tags.hpp"
+#include "memory_telemetry.hpp"
 #include "pipelines.hpp"
 #include "resources.hpp"
+#include "shader_reloader.hpp"
 #include "shaders.hpp"
 #include "staging_buffer.hpp"
 #include "swapchain.hpp"
 
 #include <vulkan/vulkan.hpp>
 
+#include <filesystem>
 #include <string_view>
 
 namespace wsi {
 class Window;
 }
 
+namespace vme {
+class JobSystem;
+}
+
 namespace gfx {
+// Requested bindless heap sizes, clamped to update-after-bind device limits
+struct DescriptorHeapSizes {
+  uint32_t storage_buffers = 64 * 1024;
+  uint32_t storage_images = 64 * 1024;
+  uint32_t sampled_images = 256 * 1024;
+  uint32_t samplers = 4 * 1024;
+};
+
 class Context final {
 public:
   static constexpr unsigned frames_in_flight = 3;
 
-  Context(const wsi::Window &window);
+  Context(const wsi::Window &window, vme::JobSystem &job_system,
+          const DescriptorHeapSizes &heap_sizes = {},
+          const std::filesystem::path &pipeline_cache_dir = "pipeline_cache");
 
   vk::PhysicalDevice getPhysicalDevice() const noexcept { return physical_device_; }
   bool isExtensionEnabled(std::string_view name) const noexcept;
@@ -29,6 +50,17 @@ public:
   vk::SurfaceKHR getSurface() const noexcept { return *surface_; }
 
   vk::Device getDevice() const noexcept { return *device_; }
+  // Descriptor heaps and sets live in descriptor buffers instead of pools
+  bool usesDescriptorBuffers() const noexcept {
+    return isExtensionEnabled(VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME);
+  }
+  bool supportsPushDescriptors() const noexcept {
+    return isExtensionEnabled(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+  }
+  // Graphics pipelines are fast-linked from cached libraries
+  bool supportsGraphicsPipelineLibrary() const noexcept {
+    return isExtensionEnabled(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+  }
 
   Swapchain &getSwapchain() noexcept { return swapchain_; }
 
@@ -36,6 +68,9 @@ public:
     return descriptor_set_layout_cache_;
   }
   ShaderModuleCache &getShaderModuleCache() noexcept { return shader_module_cache_; }
+  ShaderPermutationCache &getShaderPermutationCache() noexcept {
+    return shader_permutation_cache_;
+  }
   PipelineLayoutCache &getPipelineLayoutCache() noexcept { return pipeline_layout_cache_; }
   PipelineCache &getPipelineCache() noexcept { return pipeline_cache_; }
 
@@ -49,15 +84,28 @@ public:
     return sampled_image_descriptor_heap_;
   }
   SamplerDescriptorHeap &getSamplerDescriptorHeap() noexcept { return sampler_descriptor_heap_; }
+  // Heap of given descriptor type, throws when there is none
+  const ResourceDescriptorHeap &getResourceDescriptorHeap(vk::DescriptorType type) const;
 
+  // Sets living as long as context, transient sets come from Frame
   DescriptorSetAllocator &getDescriptorSetAllocator() noexcept { return descriptor_set_allocator_; }
 
   vma::Allocator getAllocator() const noexcept { return *allocator_; }
+  MemoryTelemetry &getMemoryTelemetry() noexcept { return memory_telemetry_; }
+  MemoryPools &getMemoryPools() noexcept { return memory_pools_; }
+  Defragmenter &getDefragmenter() noexcept { return defragmenter_; }
 
   StagingBuffer &getStagingBuffer() noexcept { return staging_buffer_; }
+  // Shared vertex, index and per-draw data buffer
+  MegaBuffer &getGeometryBuffer() noexcept { return geometry_buffer_; }
 
   Frame &getCurrentFrame() noexcept { return frames_[current_frame_ % frames_in_flight]; }
-  void nextFrame() noexcept { allocator_->setCurrentFrameIndex(++current_frame_); }
+  void nextFrame();
+
+  // Reconstructs pipeline recorded in pipeline database
+  RecordedPipeline loadPipeline(const nlohmann::json &description);
+  // Compiles pipelines recorded in pipeline database on job system workers, returns their count
+  size_t prewarmPipelines();
 
   void waitIdle() const noexcept { device_->waitIdle(); }
 
@@ -75,11 +123,16 @@ private:
 
   vk::UniqueDevice device_ = {};
   uint32_t queue_family_index_ = -1u;
+  vme::JobSystem *job_system_ = nullptr;
 
   Swapchain swapchain_;
 
+  vma::UniqueAllocator allocator_ = {};
+  DescriptorBuffers descriptor_buffers_;
+
   DescriptorSetLayoutCache descriptor_set_layout_cache_;
   ShaderModuleCache shader_module_cache_;
+  ShaderPermutationCache shader_permutation_cache_;
   PipelineLayoutCache pipeline_layout_cache_;
   PipelineCache pipeline_cache_;
 
@@ -90,12 +143,20 @@ private:
 
   DescriptorSetAllocator descriptor_set_allocator_;
 
-  vma::UniqueAllocator allocator_ = {};
+  MemoryTelemetry memory_telemetry_;
+  MemoryPools memory_pools_;
+  Defragmenter defragmenter_;
 
   StagingBuffer staging_buffer_ = {};
+  MegaBuffer geometry_buffer_;
 
   uint32_t current_frame_ = 0;
   std::array<Frame, frames_in_flight> frames_;
+
+  // Destroyed first, its jobs use the caches
+  ShaderReloader shader_reloader_;
+
+  void flushDescriptorHeaps();
 };
 } // namespace gfx
 
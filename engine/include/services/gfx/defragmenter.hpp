@@ -0,0 +1,84 @@
+#ifndef DEFRAGMENTER_HPP
+#define DEFRAGMENTER_HPP
+
+#include "allocator.hpp"
+
+#include <chrono>
+#include <functional>
+#include <deque>
+#include <unordered_map>
+#include <variant>
+
+namespace gfx {
+// Moves registered buffers and images to compact VMA blocks. Allocations that weren't
+// registered are never moved.
+class Defragmenter final {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr vk::DeviceSize default_max_bytes_per_pass = 64 * 1024 * 1024;
+  static constexpr std::chrono::microseconds default_time_budget{2000};
+
+  // Called with the new handle after resource has been moved, old handle is destroyed afterwards
+  using BufferCallback = std::function<void(vk::Buffer buffer)>;
+  using ImageCallback = std::function<void(vk::Image image)>;
+
+  Defragmenter() = default;
+  Defragmenter(vk::Device device, uint32_t queue_family_index, uint32_t queue_index,
+               vma::Allocator allocator);
+  Defragmenter(const Defragmenter &) = delete;
+  Defragmenter(Defragmenter &&) = delete;
+  Defragmenter &operator=(const Defragmenter &) = delete;
+  Defragmenter &operator=(Defragmenter &&rhs) noexcept;
+  ~Defragmenter() { end(); }
+
+  void registerBuffer(vma::Allocation allocation, vk::Buffer buffer,
+                      const vk::BufferCreateInfo &create_info, BufferCallback callback);
+  void registerImage(vma::Allocation allocation, vk::Image image,
+                     const vk::ImageCreateInfo &create_info, vk::ImageLayout layout,
+                     ImageCallback callback);
+  void unregister(vma::Allocation allocation) noexcept { resources_.erase(allocation); }
+
+  bool isRunning() const noexcept { return context_ != nullptr; }
+  // Queues defragmentation of custom pool, or of default pools if pool is null
+  void begin(vma::Pool pool = nullptr,
+             vk::DeviceSize max_bytes_per_pass = default_max_bytes_per_pass);
+  // Stops defragmentation of all pools, allocations moved so far stay at their new place
+  void end() noexcept;
+  // Runs defragmentation passes until time budget is exhausted, meant to be called between frames
+  void update(std::chrono::microseconds time_budget = default_time_budget);
+
+private:
+  struct BufferResource {
+    vk::Buffer buffer;
+    vk::BufferCreateInfo create_info;
+    BufferCallback callback;
+  };
+
+  struct ImageResource {
+    vk::Image image;
+    vk::ImageCreateInfo create_info;
+    vk::ImageLayout layout;
+    ImageCallback callback;
+  };
+
+  using Resource = std::variant<BufferResource, ImageResource>;
+
+  vk::Device device_ = {};
+  vk::Queue queue_ = {};
+  vk::UniqueFence pass_fence_ = {};
+  vk::UniqueCommandPool command_pool_ = {};
+  vk::UniqueCommandBuffer command_buffer_ = {};
+  vma::Allocator allocator_ = {};
+  vma::DefragmentationContext context_ = {};
+  std::deque<vma::DefragmentationInfo> pending_;
+
+  std::unordered_map<VmaAllocation, Resource> resources_;
+
+  // Finishes current defragmentation and starts the next pending one
+  void next();
+  void executePass(vma::DefragmentationPassMoveInfo &pass_info);
+};
+} // namespace gfx
+
+#endif
@@ -2,27 +2,163 @@
 #define DESCRIPTORS_HPP
 
 #include "common/cache_factory.hpp"
+#include "common/small_vector.hpp"
+
+#include "allocator.hpp"
 
 #include <vulkan/vulkan.hpp>
 #include <vulkan/vulkan_hash.hpp>
 
 #include <algorithm>
+#include <array>
+#include <cstddef>
+#include <span>
+#include <unordered_map>
 #include <vector>
 
 namespace gfx {
+// Classic descriptor set or, with descriptor buffers, offset into one of the bound buffers
+struct DescriptorSet {
+  vk::DescriptorSet set = {};
+  uint32_t buffer_index = 0;
+  vk::DeviceSize offset = 0;
+};
 
-class DescriptorSetLayoutCache final
-    : public vme::CacheFactory<DescriptorSetLayoutCache, vk::DescriptorSetLayoutCreateInfo,
-                               vk::UniqueDescriptorSetLayout> {
+// Element of update template data, descriptors of all bindings are packed in binding order
+struct DescriptorData {
+  union {
+    vk::DescriptorImageInfo image;
+    vk::DescriptorBufferInfo buffer;
+  };
+
+  DescriptorData(const vk::DescriptorImageInfo &image_info) : image(image_info) {}
+  DescriptorData(const vk::DescriptorBufferInfo &buffer_info) : buffer(buffer_info) {}
+};
+
+// Resource and sampler buffers of VK_EXT_descriptor_buffer. Descriptors are written straight into
+// mapped memory, ranges stay reserved for the lifetime of the buffers.
+class DescriptorBuffers final {
 public:
-  DescriptorSetLayoutCache(vk::Device device = {}) : device_(device) {}
+  static constexpr uint32_t resource_buffer_index = 0;
+  static constexpr uint32_t sampler_buffer_index = 1;
 
-  vk::UniqueDescriptorSetLayout create(const vk::DescriptorSetLayoutCreateInfo &create_info) {
-    return device_.createDescriptorSetLayoutUnique(create_info);
+  struct Range {
+    uint32_t buffer_index = 0;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    std::byte *data = nullptr;
+  };
+
+  DescriptorBuffers() = default;
+  // Buffers hold given descriptor counts plus each of extra ranges, that are reserved separately
+  DescriptorBuffers(vk::PhysicalDevice physical_device, vk::Device device,
+                    vma::Allocator allocator,
+                    const vk::ArrayProxy<const vk::DescriptorPoolSize> &descriptor_counts,
+                    const vk::ArrayProxy<const vk::DeviceSize> &resource_ranges,
+                    const vk::ArrayProxy<const vk::DeviceSize> &sampler_ranges);
+
+  static bool isSamplerType(vk::DescriptorType type) noexcept {
+    return type == vk::DescriptorType::eSampler ||
+           type == vk::DescriptorType::eCombinedImageSampler;
+  }
+
+  vk::DeviceSize getOffsetAlignment() const noexcept {
+    return properties_.descriptorBufferOffsetAlignment;
+  }
+  size_t getDescriptorSize(vk::DescriptorType type) const noexcept;
+  vk::DeviceSize getLayoutSize(vk::DescriptorSetLayout layout) const {
+    return device_.getDescriptorSetLayoutSizeEXT(layout);
   }
+  vk::DeviceSize getBindingOffset(vk::DescriptorSetLayout layout, uint32_t binding) const {
+    return device_.getDescriptorSetLayoutBindingOffsetEXT(layout, binding);
+  }
+
+  Range reserve(vk::DeviceSize size, bool samplers);
+  // Buffer descriptors need an explicit range
+  void write(std::byte *dst, vk::DescriptorType type, const vk::DescriptorImageInfo *image_info,
+             const vk::DescriptorBufferInfo *buffer_info) const;
+  void bind(vk::CommandBuffer cmd_buf) const;
+
+private:
+  struct Storage {
+    vma::UniqueBuffer buffer;
+    vk::DeviceAddress address = 0;
+    std::byte *data = nullptr;
+    vk::DeviceSize size = 0;
+    vk::DeviceSize used = 0;
+  };
+
+  vk::Device device_ = {};
+  vk::PhysicalDeviceDescriptorBufferPropertiesEXT properties_ = {};
+  std::array<Storage, 2> storages_;
+};
+
+// Looks layouts up without copying bindings, which have to be sorted by binding number
+struct DescriptorSetLayoutKeyView {
+  vk::DescriptorSetLayoutCreateFlags flags;
+  std::span<const vk::DescriptorSetLayoutBinding> bindings;
+};
+
+// Owns its bindings, so that layouts are cached by content rather than by pointers into the
+// builder that asked for them
+struct DescriptorSetLayoutKey {
+  struct Hash {
+    using is_transparent = void;
+
+    size_t operator()(const DescriptorSetLayoutKey &key) const noexcept;
+    size_t operator()(const DescriptorSetLayoutKeyView &key) const noexcept;
+  };
+  struct Equal {
+    using is_transparent = void;
+
+    bool operator()(const DescriptorSetLayoutKey &lhs,
+                    const DescriptorSetLayoutKey &rhs) const noexcept {
+      return lhs == rhs;
+    }
+    bool operator()(const DescriptorSetLayoutKey &lhs,
+                    const DescriptorSetLayoutKeyView &rhs) const noexcept;
+    bool operator()(const DescriptorSetLayoutKeyView &lhs,
+                    const DescriptorSetLayoutKey &rhs) const noexcept {
+      return (*this)(rhs, lhs);
+    }
+  };
+
+  DescriptorSetLayoutKey(vk::DescriptorSetLayoutCreateFlags flags,
+                         const vk::ArrayProxy<const vk::DescriptorSetLayoutBinding> &bindings);
+  explicit DescriptorSetLayoutKey(const DescriptorSetLayoutKeyView &view)
+      : DescriptorSetLayoutKey(view.flags, {static_cast<uint32_t>(view.bindings.size()),
+                                            view.bindings.data()}) {}
+
+  bool operator==(const DescriptorSetLayoutKey &) const = default;
+
+  vk::DescriptorSetLayoutCreateFlags flags;
+  // Sorted by binding number, with immutable sampler pointers cleared
+  std::vector<vk::DescriptorSetLayoutBinding> bindings;
+  // Indices of bindings with immutable samplers and their samplers in binding order
+  std::vector<uint32_t> immutable_sampler_bindings;
+  std::vector<vk::Sampler> immutable_samplers;
+};
+
+class DescriptorSetLayoutCache final
+    : public vme::CacheFactory<DescriptorSetLayoutCache, DescriptorSetLayoutKey,
+                               vk::UniqueDescriptorSetLayout, DescriptorSetLayoutKey::Hash,
+                               DescriptorSetLayoutKey::Equal> {
+public:
+  DescriptorSetLayoutCache(vk::Device device = {}, bool descriptor_buffers = false)
+      : device_(device), descriptor_buffers_(descriptor_buffers) {}
+
+  vk::UniqueDescriptorSetLayout create(const DescriptorSetLayoutKey &key);
+
+  // Created on first use, bindings have to be sorted and match the layout
+  vk::DescriptorUpdateTemplate
+  getUpdateTemplate(vk::DescriptorSetLayout layout,
+                    const vk::ArrayProxy<const vk::DescriptorSetLayoutBinding> &bindings);
 
 private:
   vk::Device device_;
+  bool descriptor_buffers_ = false;
+  std::unordered_map<vk::DescriptorSetLayout, vk::UniqueDescriptorUpdateTemplate>
+      update_templates_;
 };
 
 class DescriptorSetLayoutBuilder {
@@ -46,33 +182,57 @@ public:
     return *this;
   }
 
-  vk::DescriptorSetLayout build() {
+  vk::DescriptorSetLayout build(vk::DescriptorSetLayoutCreateFlags flags = {}) {
     std::sort(bindings_.begin(), bindings_.end());
-    return *descriptor_set_layout_cache_->get({{}, bindings_});
+    return *descriptor_set_layout_cache_->get(
+        DescriptorSetLayoutKeyView{flags, {bindings_.data(), bindings_.size()}});
+  }
+  // Layout has to be built from current bindings
+  vk::DescriptorUpdateTemplate buildUpdateTemplate(vk::DescriptorSetLayout layout) {
+    return descriptor_set_layout_cache_->getUpdateTemplate(
+        layout, {static_cast<uint32_t>(bindings_.size()), bindings_.data()});
   }
 
 private:
   DescriptorSetLayoutCache *descriptor_set_layout_cache_{nullptr};
 
-  std::vector<vk::DescriptorSetLayoutBinding> bindings_;
+  vme::SmallVector<vk::DescriptorSetLayoutBinding, 8> bindings_;
 };
 
+// Sets are freed all at once by reset, allocator is used by a single thread at a time
 class DescriptorSetAllocator final {
 public:
+  // Default ranges of resource and sampler descriptor buffers reserved for sets, sets rarely hold
+  // many samplers
+  static constexpr vk::DeviceSize descriptor_buffer_range = 1024 * 1024;
+  static constexpr vk::DeviceSize sampler_descriptor_buffer_range = 64 * 1024;
+
   DescriptorSetAllocator() = default;
   DescriptorSetAllocator(vk::Device device) noexcept : device_(device) {}
+  DescriptorSetAllocator(vk::Device device, DescriptorBuffers &descriptor_buffers,
+                         vk::DeviceSize range = descriptor_buffer_range,
+                         vk::DeviceSize sampler_range = sampler_descriptor_buffer_range);
+
+  bool usesDescriptorBuffers() const noexcept { return descriptor_buffers_; }
 
-  vk::DescriptorSet allocate(const vk::DescriptorSetLayout &descriptor_layout,
-                             const vk::ArrayProxy<const vk::WriteDescriptorSet> &bindings);
+  DescriptorSet allocate(const vk::DescriptorSetLayout &descriptor_layout,
+                         const vk::ArrayProxy<const vk::WriteDescriptorSet> &bindings);
+  // Data is laid out as described by template, not available with descriptor buffers
+  DescriptorSet allocate(const vk::DescriptorSetLayout &descriptor_layout,
+                         vk::DescriptorUpdateTemplate update_template, const void *data);
   void reset();
 
 private:
   vk::Device device_{};
+  DescriptorBuffers *descriptor_buffers_{nullptr};
+  std::array<DescriptorBuffers::Range, 2> ranges_{};
+  std::array<vk::DeviceSize, 2> used_{};
   vk::DescriptorPool current_pool_{};
   std::vector<vk::UniqueDescriptorPool> used_pools_;
   std::vector<vk::UniqueDescriptorPool> free_pools_;
 
   vk::DescriptorPool getPool(unsigned size = 1024);
+  vk::DescriptorSet allocateSet(vk::DescriptorSetLayout descriptor_layout);
 };
 
 class DescriptorSetBuilder final : public DescriptorSetLayoutBuilder {
@@ -82,6 +242,7 @@ public:
       : DescriptorSetLayoutBuilder(descriptor_layout_cache),
         descriptor_allocator_(&descriptor_allocator){};
 
+  // Ranges have to be explicit when descriptor buffers are used
   DescriptorSetBuilder &
   bindBuffer(uint32_t binding, vk::DescriptorType type,
              const vk::ArrayProxyNoTemporaries<const vk::DescriptorBufferInfo> &buffer_info,
@@ -92,23 +253,58 @@ public:
       return *this;
     }
   }
+  // Whole range is resolved against buffer size
+  DescriptorSetBuilder &
+  bindBuffer(uint32_t binding, vk::DescriptorType type, vk::Buffer buffer,
+             vk::DeviceSize buffer_size, vk::DeviceSize offset = 0,
+             vk::DeviceSize range = VK_WHOLE_SIZE,
+             vk::ShaderStageFlags stage_flags = vk::ShaderStageFlagBits::eAll) {
+    DescriptorSetLayoutBuilder::binding(binding, type, 1, stage_flags);
+    // Pointer is resolved on build, buffer infos may still move
+    bindings_.emplace_back(nullptr, binding, 0, 1, type);
+    buffer_infos_.emplace_back(buffer, offset,
+                               range == VK_WHOLE_SIZE ? buffer_size - offset : range);
+    buffer_info_bindings_.push_back(binding);
+    return *this;
+  }
   DescriptorSetBuilder &
   bindImage(uint32_t binding, vk::DescriptorType type,
             const vk::ArrayProxyNoTemporaries<const vk::DescriptorImageInfo> &image_info,
             const vk::ArrayProxyNoTemporaries<const vk::Sampler> &immutable_samplers = {},
             vk::ShaderStageFlags stage_flags = vk::ShaderStageFlagBits::eAll) {
     assert(immutable_samplers.empty() || image_info.size() == immutable_samplers.size());
-    DescriptorSetLayoutBuilder::binding(binding, type, immutable_samplers, stage_flags);
+    if (immutable_samplers.empty())
+      DescriptorSetLayoutBuilder::binding(binding, type, image_info.size(), stage_flags);
+    else
+      DescriptorSetLayoutBuilder::binding(binding, type, immutable_samplers, stage_flags);
     bindings_.emplace_back(nullptr, binding, 0, type, image_info, nullptr);
     return *this;
   }
 
-  vk::DescriptorSet build();
+  DescriptorSet build();
+  // Records descriptors into command buffer without allocating a set, layout of set in pipeline
+  // layout has to be created with push descriptor flag
+  void push(vk::CommandBuffer cmd_buf, vk::PipelineBindPoint bind_point,
+            vk::PipelineLayout pipeline_layout, uint32_t set) {
+    resolveBufferInfos();
+    cmd_buf.pushDescriptorSetKHR(bind_point, pipeline_layout, set,
+                                 {static_cast<uint32_t>(bindings_.size()), bindings_.data()});
+  }
 
 private:
   DescriptorSetAllocator *descriptor_allocator_{nullptr};
 
-  std::vector<vk::WriteDescriptorSet> bindings_;
+  vme::SmallVector<vk::WriteDescriptorSet, 8> bindings_;
+  // Buffer infos resolved against buffer size and binding numbers of their writes
+  vme::SmallVector<vk::DescriptorBufferInfo, 4> buffer_infos_;
+  vme::SmallVector<uint32_t, 4> buffer_info_bindings_;
+
+  void resolveBufferInfos() noexcept {
+    for (size_t i = 0; i < buffer_infos_.size(); ++i)
+      for (auto &write : bindings_)
+        if (write.dstBinding == buffer_info_bindings_[i])
+          write.pBufferInfo = &buffer_infos_[i];
+  }
 };
 } // namespace gfx
 
@@ -73,9 +73,14 @@ private:
 
 class Frame final {
 public:
+  // Ranges of resource and sampler descriptor buffers reserved for transient sets
+  static constexpr vk::DeviceSize descriptor_buffer_range = 64 * 1024;
+  static constexpr vk::DeviceSize sampler_descriptor_buffer_range = 4 * 1024;
+
   Frame() = default;
   Frame(vk::PhysicalDevice physical_device, vk::Device device, uint32_t queue_family_index,
-        uint32_t queue_index, vma::Allocator allocator);
+        uint32_t queue_index, vma::Allocator allocator,
+        DescriptorBuffers *descriptor_buffers = nullptr);
 
   vk::Semaphore getImageAvailableSemaphore() const noexcept { return *image_available_; }
   vk::Semaphore getRenderFinishedSemaphore() const noexcept { return *render_finished_; }
@@ -83,6 +88,8 @@ public:
   vk::CommandBuffer getCommandBuffer() const noexcept { return *command_buffer_; }
   TracyVkCtx getTracyVkCtx() const noexcept { return *tracy_vk_ctx_; }
   TransientAllocator &getAllocator() noexcept { return transient_allocator_; }
+  // Sets live until frame is reset, used by the render thread only
+  DescriptorSetAllocator &getDescriptorSetAllocator() noexcept { return descriptor_set_allocator_; }
 
   void submit() const;
   void reset();
@@ -96,6 +103,7 @@ private:
   vk::UniqueCommandBuffer command_buffer_ = {};
   UniqueTracyVkCtx tracy_vk_ctx_ = {};
   TransientAllocator transient_allocator_;
+  DescriptorSetAllocator descriptor_set_allocator_;
 };
 } // namespace gfx
 
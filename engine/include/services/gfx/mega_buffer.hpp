@@ -0,0 +1,93 @@
+#ifndef MEGA_BUFFER_HPP
+#define MEGA_BUFFER_HPP
+
+#include "allocator.hpp"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace gfx {
+class StagingBuffer;
+
+// Single device-local buffer suballocated with VMA virtual blocks. Offsets stay valid when buffer
+// grows: contents are copied to a bigger buffer and new range is covered by an extra virtual block.
+class MegaBuffer final {
+public:
+  static constexpr vk::DeviceSize default_size = 64 * 1024 * 1024;
+
+  struct Allocation {
+    uint32_t block = UINT32_MAX;
+    vma::VirtualAllocation allocation = {};
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+
+    explicit operator bool() const noexcept { return block != UINT32_MAX; }
+  };
+
+  MegaBuffer() = default;
+  // Pending uploads of staging buffer are flushed before buffer grows
+  // Storage alignment is used for ranges that are bound as storage buffer descriptors
+  MegaBuffer(vk::Device device, uint32_t queue_family_index, uint32_t queue_index,
+             vma::Allocator allocator, StagingBuffer &staging_buffer, vk::BufferUsageFlags usage,
+             const vma::AllocationCreateInfo &alloc_info, const char *name,
+             vk::DeviceSize storage_alignment, vk::DeviceSize size = default_size);
+  MegaBuffer(const MegaBuffer &) = delete;
+  MegaBuffer(MegaBuffer &&) = delete;
+  MegaBuffer &operator=(const MegaBuffer &) = delete;
+  MegaBuffer &operator=(MegaBuffer &&rhs) noexcept;
+  ~MegaBuffer();
+
+  // Buffer handle and device address change when buffer grows
+  vk::Buffer getBuffer() const noexcept { return buffer_->getBuffer(); }
+  vk::DeviceAddress getDeviceAddress() const noexcept { return device_address_; }
+  vk::DeviceAddress getDeviceAddress(const Allocation &allocation) const noexcept {
+    return device_address_ + allocation.offset;
+  }
+  vk::DeviceSize getSize() const noexcept { return size_; }
+  // Incremented every time buffer is reallocated, users can compare it to refresh descriptors
+  uint32_t getGeneration() const noexcept { return generation_; }
+  VmaStatistics getStatistics() const noexcept;
+
+  Allocation allocate(vk::DeviceSize size, vk::DeviceSize alignment = 16);
+  Allocation allocateStorage(vk::DeviceSize size) { return allocate(size, storage_alignment_); }
+  // Range is reused only after frames that could read it have completed
+  void free(const Allocation &allocation) noexcept;
+
+  // Releases buffers replaced by growth and freed ranges once frames that could reference them
+  // have completed
+  void nextFrame(uint32_t frame, uint32_t completed_frames) noexcept;
+
+private:
+  vk::Device device_ = {};
+  vk::Queue queue_ = {};
+  vk::UniqueCommandPool command_pool_ = {};
+  vk::UniqueCommandBuffer command_buffer_ = {};
+  // Signaled when the last growth copy has finished, guards reuse of command buffer
+  vk::UniqueFence fence_ = {};
+  vma::Allocator allocator_ = {};
+  StagingBuffer *staging_buffer_ = nullptr;
+
+  vk::BufferUsageFlags usage_ = {};
+  vma::AllocationCreateInfo alloc_info_ = {};
+  std::string name_;
+  vk::DeviceSize storage_alignment_ = 16;
+
+  vma::UniqueBuffer buffer_;
+  vk::DeviceAddress device_address_ = 0;
+  vk::DeviceSize size_ = 0;
+  uint32_t generation_ = 0;
+  uint32_t current_frame_ = 0;
+  std::deque<std::pair<uint32_t, vma::UniqueBuffer>> retired_;
+  std::deque<std::pair<uint32_t, Allocation>> freed_;
+  // Each virtual block covers the range added by one growth step
+  std::vector<std::pair<vk::DeviceSize, vma::UniqueVirtualBlock>> blocks_;
+
+  vma::UniqueBuffer createBuffer(vk::DeviceSize size);
+  void addBlock(vk::DeviceSize offset, vk::DeviceSize size);
+  void grow(vk::DeviceSize min_size);
+  void releaseFreed(uint32_t completed_frames) noexcept;
+};
+} // namespace gfx
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef MEMORY_POOLS_HPP
+#define MEMORY_POOLS_HPP
+
+#include "allocator.hpp"
+
+#include <array>
+#include <string>
+
+namespace gfx {
+enum class ResourceClass : uint32_t { eDepthTarget, eTexture };
+
+// Dedicated VMA pool per resource class, so that classes don't fragment each other's blocks
+class MemoryPools final {
+public:
+  static constexpr size_t class_count = 2;
+
+  MemoryPools() = default;
+  MemoryPools(vma::Allocator allocator);
+
+  static const char *getName(ResourceClass resource_class) noexcept;
+
+  vma::Pool getPool(ResourceClass resource_class) const noexcept {
+    return *pools_[static_cast<size_t>(resource_class)];
+  }
+  // Allocation create info routed to the pool of resource class
+  vma::AllocationCreateInfo getAllocationCreateInfo(ResourceClass resource_class) const noexcept;
+  // Routed to default pools instead when memory type of the class pool can't hold the image
+  vma::AllocationCreateInfo getAllocationCreateInfo(ResourceClass resource_class,
+                                                    const vk::ImageCreateInfo &image_info) const;
+  // Cheap statistics, suitable for per-frame queries
+  VmaStatistics getStatistics(ResourceClass resource_class) const noexcept {
+    return allocator_.getPoolStatistics(getPool(resource_class));
+  }
+  // Detailed statistics, traverses all allocations of the pool
+  VmaDetailedStatistics calculateStatistics(ResourceClass resource_class) const noexcept {
+    return allocator_.calculatePoolStatistics(getPool(resource_class));
+  }
+
+  // Plots per-pool usage
+  void update();
+
+private:
+  vma::Allocator allocator_ = {};
+  vk::Device device_ = {};
+  std::array<vma::UniquePool, class_count> pools_;
+  std::array<uint32_t, class_count> memory_type_indices_ = {};
+  std::array<vma::AllocationCreateInfo, class_count> alloc_infos_ = {};
+  // Tracy identifies plots by name pointer, so names have to outlive the pool updates
+  std::array<std::string, class_count> usage_plot_names_, block_plot_names_;
+};
+} // namespace gfx
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef MEMORY_TAGS_HPP
+#define MEMORY_TAGS_HPP
+
+#include "allocator.hpp"
+
+#include <cstdint>
+
+namespace gfx {
+// Subsystem owning an allocation, stored in allocation user data
+enum class Subsystem : uint32_t { eUnknown, eStaging, eFrame, eScene, eRenderer, eImGui, eTools };
+
+inline const char *getSubsystemName(Subsystem subsystem) noexcept {
+  switch (subsystem) {
+  case Subsystem::eStaging:
+    return "staging";
+  case Subsystem::eFrame:
+    return "frame";
+  case Subsystem::eScene:
+    return "scene";
+  case Subsystem::eRenderer:
+    return "renderer";
+  case Subsystem::eImGui:
+    return "imgui";
+  case Subsystem::eTools:
+    return "tools";
+  default:
+    return "unknown";
+  }
+}
+
+inline vma::AllocationCreateInfo tagAllocation(vma::AllocationCreateInfo alloc_info,
+                                               Subsystem subsystem) noexcept {
+  alloc_info.pUserData = reinterpret_cast<void *>(static_cast<uintptr_t>(subsystem));
+  return alloc_info;
+}
+
+inline Subsystem getSubsystem(const VmaAllocationInfo &allocation_info) noexcept {
+  return static_cast<Subsystem>(reinterpret_cast<uintptr_t>(allocation_info.pUserData));
+}
+} // namespace gfx
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef MEMORY_TELEMETRY_HPP
+#define MEMORY_TELEMETRY_HPP
+
+#include "allocator.hpp"
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace gfx {
+class MemoryTelemetry final {
+public:
+  // Called when heap usage crosses ratio * budget, exceeded tells the direction of crossing
+  using Callback =
+      std::function<void(uint32_t heap_index, const VmaBudget &budget, bool exceeded)>;
+
+  MemoryTelemetry() = default;
+  MemoryTelemetry(vma::Allocator allocator);
+
+  const std::vector<VmaBudget> &getHeapBudgets() const noexcept { return budgets_; }
+  VmaTotalStatistics calculateStatistics() const noexcept {
+    return allocator_.calculateStatistics();
+  }
+  bool isDeviceLocal(uint32_t heap_index) const noexcept;
+
+  void addThreshold(float ratio, Callback callback);
+  void update();
+
+  // Writes VMA JSON stats to path and allocation usage aggregated by subsystem and name next to it
+  void dumpStatistics(const std::filesystem::path &path) const;
+
+private:
+  struct Threshold {
+    float ratio;
+    Callback callback;
+    std::vector<bool> exceeded;
+  };
+
+  vma::Allocator allocator_ = {};
+  std::vector<VmaBudget> budgets_;
+  std::vector<Threshold> thresholds_;
+  // Tracy identifies plots by name pointer, so names have to outlive the telemetry updates
+  std::vector<std::string> usage_plot_names_, budget_plot_names_;
+};
+} // namespace gfx
+
+#endif
@@ -2,6 +2,7 @@
 #define PIPELINES_HPP
 
 #include "common/cache_factory.hpp"
+#include "common/job_system.hpp"
 #include "descriptors.hpp"
 #include "resources.hpp"
 #include "shaders.hpp"
@@ -9,26 +10,65 @@
 #include <vulkan/vulkan.hpp>
 #include <vulkan/vulkan_hash.hpp>
 
+#include <nlohmann/json_fwd.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <variant>
 #include <vector>
 
 namespace gfx {
 
+// Owning value of a pipeline layout create info, cached by content
+struct PipelineLayoutKey {
+  struct Hash {
+    size_t operator()(const PipelineLayoutKey &key) const noexcept {
+      size_t seed = 0;
+      vme::hashCombine(seed, key.flags);
+      for (auto set_layout : key.set_layouts)
+        vme::hashCombine(seed, set_layout);
+      for (const auto &push_constant_range : key.push_constant_ranges)
+        vme::hashCombine(seed, push_constant_range);
+      return seed;
+    }
+  };
+
+  bool operator==(const PipelineLayoutKey &) const = default;
+
+  vk::PipelineLayoutCreateFlags flags;
+  std::vector<vk::DescriptorSetLayout> set_layouts;
+  // Sorted, so that order of shader stages doesn't matter
+  std::vector<vk::PushConstantRange> push_constant_ranges;
+};
+
 class PipelineLayoutCache final
-    : public vme::CacheFactory<PipelineLayoutCache, vk::PipelineLayoutCreateInfo,
-                               vk::UniquePipelineLayout> {
+    : public vme::CacheFactory<PipelineLayoutCache, PipelineLayoutKey, vk::UniquePipelineLayout,
+                               PipelineLayoutKey::Hash> {
 public:
   PipelineLayoutCache(vk::Device device = {}) : device_(device) {}
 
-  vk::UniquePipelineLayout create(const vk::PipelineLayoutCreateInfo &create_info) {
-    return device_.createPipelineLayoutUnique(create_info);
+  vk::UniquePipelineLayout create(const PipelineLayoutKey &key) {
+    return device_.createPipelineLayoutUnique(
+        {key.flags, key.set_layouts, key.push_constant_ranges});
   }
 
 private:
   vk::Device device_;
 };
 
+// Resolves heap a recorded pipeline was built with by its descriptor type
+using ResourceDescriptorHeapLookup =
+    std::function<const ResourceDescriptorHeap &(vk::DescriptorType type)>;
+
 class PipelineLayoutBuilder {
 public:
   PipelineLayoutBuilder(PipelineLayoutCache &pipeline_layout_cache,
@@ -41,30 +81,151 @@ public:
     resource_descriptor_heap_layouts_.emplace(id, layout);
     return *this;
   }
+  // Set is written with DescriptorSetBuilder::push() instead of being bound
+  PipelineLayoutBuilder &pushDescriptorSet(uint32_t id) {
+    push_descriptor_sets_.insert(id);
+    return *this;
+  }
   vk::PipelineLayout build();
 
+protected:
+  // Shaders are recorded by cache name, heaps by type
+  std::vector<std::string> shader_names_;
+  std::unordered_map<uint32_t, vk::DescriptorType> resource_descriptor_heap_types_;
+  // Cleared by shaders built from code and specialization infos, which aren't recorded
+  bool recordable_ = true;
+
+  nlohmann::json describeLayout() const;
+  // Hash of what describeLayout() records, without building the description
+  size_t hashLayout() const;
+
 private:
   PipelineLayoutCache *pipeline_layout_cache_{nullptr};
   DescriptorSetLayoutCache *descriptor_set_layout_cache_{nullptr};
 
   std::unordered_map<uint32_t, DescriptorSetLayoutBindings> descriptor_set_layouts_;
   std::unordered_map<uint32_t, vk::DescriptorSetLayout> resource_descriptor_heap_layouts_;
+  std::unordered_set<uint32_t> push_descriptor_sets_;
   std::vector<vk::PushConstantRange> push_constant_ranges_;
 };
 
+// Descriptions of every pipeline built so far, kept across runs so that they can be compiled
+// before the first frame. Unlike the pipeline cache it doesn't depend on device or driver
+class PipelineDatabase final {
+public:
+  PipelineDatabase() = default;
+  explicit PipelineDatabase(const std::filesystem::path &path);
+
+  const std::filesystem::path &getPath() const noexcept { return path_; }
+  std::vector<nlohmann::json> getDescriptions() const;
+  bool isDirty() const noexcept { return dirty_->load(std::memory_order_relaxed); }
+
+  // Thread-safe, descriptions that are already recorded are ignored
+  void record(const nlohmann::json &description);
+  // Serialized database, clears dirty flag
+  std::string dump();
+  void save() { save(path_, dump()); }
+  static void save(const std::filesystem::path &path, const std::string &data);
+
+private:
+  std::filesystem::path path_;
+  std::unique_ptr<std::mutex> mutex_ = std::make_unique<std::mutex>();
+  std::unordered_set<std::string> descriptions_;
+  std::unique_ptr<std::atomic<bool>> dirty_ = std::make_unique<std::atomic<bool>>(false);
+};
+
 class PipelineCache final {
 public:
-  PipelineCache() = default;
-  PipelineCache(vk::Device device);
+  // Replaced in place when shaders are reloaded
+  using SharedPipeline = std::shared_ptr<vk::UniquePipeline>;
 
-  void save() const;
+  struct SharedPipelineInfo {
+    std::string description;
+    vk::PipelineLayout layout;
+    SharedPipeline pipeline;
+  };
+
+  struct Statistics {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
 
-  vk::UniquePipeline create(const vk::ComputePipelineCreateInfo &create_info) const;
-  vk::UniquePipeline create(const vk::GraphicsPipelineCreateInfo &create_info) const;
+  // New pipelines that trigger save, and interval at which any new pipeline is saved
+  static constexpr uint32_t save_burst_size = 16;
+  static constexpr std::chrono::seconds save_interval{30};
+
+  PipelineCache() = default;
+  // Cache file in directory is keyed by device and driver, data of other drivers is never loaded
+  PipelineCache(vk::PhysicalDevice physical_device, vk::Device device,
+                const std::filesystem::path &directory,
+                const DescriptorBuffers *descriptor_buffers = nullptr, bool use_libraries = false);
+  PipelineCache(PipelineCache &&) = default;
+  PipelineCache &operator=(PipelineCache &&) = default;
+  ~PipelineCache();
+
+  // Set when pipelines are created for descriptor buffers
+  const DescriptorBuffers *getDescriptorBuffers() const noexcept { return descriptor_buffers_; }
+  // Set when graphics pipelines are linked from VK_EXT_graphics_pipeline_library libraries
+  bool usesLibraries() const noexcept { return use_libraries_; }
+  const std::filesystem::path &getPath() const noexcept { return path_; }
+  PipelineDatabase &getDatabase() noexcept { return database_; }
+
+  // Saves on a worker when enough pipelines were created or save interval has passed
+  void update(vme::JobSystem &job_system);
+  // Blocking save, skipped when no pipelines were created since last one. Pipeline database
+  // is saved along with the cache
+  void save();
+
+  // Create infos are patched for descriptor buffers
+  vk::UniquePipeline create(vk::ComputePipelineCreateInfo create_info) const;
+  vk::UniquePipeline create(vk::GraphicsPipelineCreateInfo create_info) const;
+
+  // Pipeline library of given state, created on first use. Thread-safe
+  SharedPipeline getLibrary(const std::string &key,
+                            const std::function<vk::UniquePipeline()> &create_library);
+  // Nullptr when library wasn't created yet. Thread-safe
+  SharedPipeline findLibrary(const std::string &key);
+  // Libraries built from any of given shaders are created again on next use
+  void dropLibraries(const std::unordered_set<std::string> &shader_names);
+
+  // Pipeline shared by all builders with equal state hash, destroyed with its last user. Create
+  // returns the pipeline along with its serialized description. Thread-safe
+  SharedPipeline getShared(
+      size_t key, vk::PipelineLayout layout,
+      const std::function<std::pair<vk::UniquePipeline, std::string>()> &create_pipeline);
+  // Live shared pipelines built from any of given shaders
+  std::vector<SharedPipelineInfo>
+  getSharedPipelines(const std::unordered_set<std::string> &shader_names);
+  Statistics getStatistics() const noexcept {
+    return {hits_->load(std::memory_order_relaxed), misses_->load(std::memory_order_relaxed)};
+  }
 
 private:
   vk::Device device_ = {};
+  const DescriptorBuffers *descriptor_buffers_ = nullptr;
+  bool use_libraries_ = false;
+  std::filesystem::path path_;
   vk::UniquePipelineCache pipeline_cache_;
+  PipelineDatabase database_;
+  // Incremented by compilation jobs
+  std::unique_ptr<std::atomic<uint32_t>> created_count_ =
+      std::make_unique<std::atomic<uint32_t>>(0);
+  std::chrono::steady_clock::time_point last_save_ = std::chrono::steady_clock::now();
+  std::future<void> save_future_;
+  // Guards libraries and shared pipelines
+  std::unique_ptr<std::mutex> mutex_ = std::make_unique<std::mutex>();
+  // Links in progress hold the libraries they use
+  std::unordered_map<std::string, SharedPipeline> libraries_;
+  struct SharedPipelineEntry {
+    std::weak_ptr<vk::UniquePipeline> pipeline;
+    vk::PipelineLayout layout;
+    // Kept for shader reloads, which rebuild pipelines from descriptions
+    std::string description;
+  };
+  // Keyed by builder state hash, expired entries are pruned on misses
+  std::unordered_map<size_t, SharedPipelineEntry> shared_pipelines_;
+  std::unique_ptr<std::atomic<uint64_t>> hits_ = std::make_unique<std::atomic<uint64_t>>(0);
+  std::unique_ptr<std::atomic<uint64_t>> misses_ = std::make_unique<std::atomic<uint64_t>>(0);
 };
 
 class Pipeline final {
@@ -72,12 +233,21 @@ public:
   Pipeline() = default;
   Pipeline(vk::UniquePipeline &&pipeline, vk::PipelineLayout layout,
            vk::PipelineBindPoint bind_point,
-           std::vector<std::pair<const uint32_t, vk::DescriptorSet>> &&resource_descriptor_heaps)
+           std::vector<std::pair<const uint32_t, DescriptorSet>> &&resource_descriptor_heaps,
+           const DescriptorBuffers *descriptor_buffers = nullptr)
+      : Pipeline(std::make_shared<vk::UniquePipeline>(std::move(pipeline)), layout,
+                 bind_point, std::move(resource_descriptor_heaps), descriptor_buffers) {}
+  Pipeline(PipelineCache::SharedPipeline &&pipeline, vk::PipelineLayout layout,
+           vk::PipelineBindPoint bind_point,
+           std::vector<std::pair<const uint32_t, DescriptorSet>> &&resource_descriptor_heaps,
+           const DescriptorBuffers *descriptor_buffers = nullptr)
       : pipeline_(std::move(pipeline)), layout_(layout), bind_point_(bind_point),
-        resource_descriptor_heaps_(resource_descriptor_heaps) {}
+        resource_descriptor_heaps_(resource_descriptor_heaps),
+        descriptor_buffers_(descriptor_buffers) {}
 
-  vk::Pipeline get() const noexcept { return *pipeline_; }
+  vk::Pipeline get() const noexcept { return pipeline_ ? **pipeline_ : vk::Pipeline{}; }
   vk::PipelineLayout getLayout() const noexcept { return layout_; }
+  vk::PipelineBindPoint getBindPoint() const noexcept { return bind_point_; }
   void reset() noexcept {
     pipeline_.reset();
     layout_ = nullptr;
@@ -85,11 +255,22 @@ public:
   }
 
   void bind(vk::CommandBuffer cmd_buf) const {
-    cmd_buf.bindPipeline(bind_point_, *pipeline_);
+    cmd_buf.bindPipeline(bind_point_, get());
+    if (descriptor_buffers_)
+      descriptor_buffers_->bind(cmd_buf);
     for (const auto &[id, descriptor_set] : resource_descriptor_heaps_)
-      cmd_buf.bindDescriptorSets(bind_point_, layout_, id, descriptor_set, {});
+      bindDescriptorSet(cmd_buf, id, descriptor_set);
   };
 
+  void bindDescriptorSet(vk::CommandBuffer cmd_buf, uint32_t id,
+                         const DescriptorSet &descriptor_set) const {
+    if (descriptor_set.set)
+      cmd_buf.bindDescriptorSets(bind_point_, layout_, id, descriptor_set.set, {});
+    else
+      cmd_buf.setDescriptorBufferOffsetsEXT(bind_point_, layout_, id, descriptor_set.buffer_index,
+                                            descriptor_set.offset);
+  }
+
   void bindDesriptorSets(vk::CommandBuffer cmd_buf, uint32_t id,
                          const vk::ArrayProxy<const vk::DescriptorSet> &descriptor_sets,
                          const vk::ArrayProxy<const uint32_t> &dynamic_offsets = {}) const {
@@ -103,11 +284,67 @@ public:
   };
 
 private:
-  vk::UniquePipeline pipeline_ = {};
+  // Shared with other pipelines built from equal builders, read when bound
+  PipelineCache::SharedPipeline pipeline_;
   vk::PipelineLayout layout_ = {};
   vk::PipelineBindPoint bind_point_ = {};
 
-  std::vector<std::pair<const uint32_t, vk::DescriptorSet>> resource_descriptor_heaps_;
+  std::vector<std::pair<const uint32_t, DescriptorSet>> resource_descriptor_heaps_;
+  const DescriptorBuffers *descriptor_buffers_ = nullptr;
+};
+
+// Pipeline compiled by a job system worker, polled by the pass that uses it. Fast-linked pipeline
+// is used until the optimized one is compiled
+class AsyncPipeline final {
+public:
+  AsyncPipeline() = default;
+  AsyncPipeline(std::future<Pipeline> &&future, Pipeline &&fast_linked = {})
+      : future_(std::move(future)), pipeline_(std::move(fast_linked)) {}
+  AsyncPipeline(const AsyncPipeline &) = delete;
+  AsyncPipeline(AsyncPipeline &&) = default;
+  AsyncPipeline &operator=(const AsyncPipeline &) = delete;
+  AsyncPipeline &operator=(AsyncPipeline &&rhs) noexcept {
+    finish();
+    future_ = std::move(rhs.future_);
+    pipeline_ = std::move(rhs.pipeline_);
+    fast_linked_ = std::move(rhs.fast_linked_);
+    return *this;
+  }
+  // Compilation job references pipeline cache and device, so it has to finish first
+  ~AsyncPipeline() { finish(); }
+
+  // Also true while fast-linked pipeline is in use
+  bool isReady() {
+    if (future_.valid() &&
+        future_.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+      swap();
+    return pipeline_.get();
+  }
+  // Nullptr while compiling
+  const Pipeline *get() { return isReady() ? &pipeline_ : nullptr; }
+  const Pipeline &getOr(const Pipeline &fallback) { return isReady() ? pipeline_ : fallback; }
+
+  // Blocks until compiled, rethrows compilation errors
+  const Pipeline &wait() {
+    if (future_.valid())
+      swap();
+    return pipeline_;
+  }
+
+private:
+  std::future<Pipeline> future_;
+  Pipeline pipeline_;
+  // Frames in flight may still use fast-linked pipeline, it's kept as long as optimized one
+  Pipeline fast_linked_;
+
+  void swap() {
+    auto pipeline = future_.get();
+    if (pipeline_.get())
+      fast_linked_ = std::move(pipeline_);
+    pipeline_ = std::move(pipeline);
+  }
+  // Waits for pending compilation without rethrowing, its result is discarded
+  void finish() noexcept;
 };
 
 template <typename Derived> class PipelineBuilder : public PipelineLayoutBuilder {
@@ -124,29 +361,67 @@ public:
     shader_stages_.emplace(
         stage, vk::PipelineShaderStageCreateInfo{
                    {}, stage, shader_module.get(), shader_module.getName(), specialization_info});
+    shader_modules_.push_back(shader_module);
     PipelineLayoutBuilder::shaderStage(shader_module);
+    if (specialization_info)
+      recordable_ = false;
     return static_cast<Derived &>(*this);
   }
 
   Derived &resourceDescriptorHeap(uint32_t id, const ResourceDescriptorHeap &heap) {
     resource_descriptor_heaps_.emplace(id, heap.get());
+    resource_descriptor_heap_types_.emplace(id, heap.getType());
     PipelineLayoutBuilder::resourceDescriptorHeap(id, heap.getLayout());
     return static_cast<Derived &>(*this);
   }
 
+  Derived &pushDescriptorSet(uint32_t id) {
+    PipelineLayoutBuilder::pushDescriptorSet(id);
+    return static_cast<Derived &>(*this);
+  }
+
   Pipeline build() {
     std::vector resource_descriptor_heaps(resource_descriptor_heaps_.begin(),
                                           resource_descriptor_heaps_.end());
     auto layout = PipelineLayoutBuilder::build();
-    return Pipeline(static_cast<Derived *>(this)->create(layout), layout, Derived::bind_point,
-                    std::move(resource_descriptor_heaps));
+    return Pipeline(static_cast<Derived *>(this)->createShared(layout), layout, Derived::bind_point,
+                    std::move(resource_descriptor_heaps), pipeline_cache_->getDescriptorBuffers());
+  }
+
+  // Layout is built on calling thread, pipeline is compiled by a worker, drivers synchronize
+  // pipeline cache access internally. Builder state is moved into the job, so specialization
+  // infos have to outlive compilation. Pipelines that can be fast-linked from already compiled
+  // libraries are usable right away, missing libraries are compiled by the job
+  AsyncPipeline buildAsync(vme::JobSystem &job_system) {
+    std::vector resource_descriptor_heaps(resource_descriptor_heaps_.begin(),
+                                          resource_descriptor_heaps_.end());
+    auto layout = PipelineLayoutBuilder::build();
+    const auto *descriptor_buffers = pipeline_cache_->getDescriptorBuffers();
+    Pipeline fast_linked;
+    if (auto pipeline = static_cast<Derived *>(this)->createFastLinked(layout)) {
+      auto heaps = resource_descriptor_heaps;
+      fast_linked = Pipeline(std::move(pipeline), layout, Derived::bind_point, std::move(heaps),
+                             descriptor_buffers);
+    }
+    auto builder = std::make_shared<Derived>(std::move(static_cast<Derived &>(*this)));
+    return AsyncPipeline(
+        job_system.submit([builder, layout, descriptor_buffers,
+                           resource_descriptor_heaps = std::move(resource_descriptor_heaps)]() {
+          ZoneScopedN("Compile pipeline");
+          auto heaps = resource_descriptor_heaps;
+          return Pipeline(builder->createShared(layout), layout, Derived::bind_point,
+                          std::move(heaps), descriptor_buffers);
+        }),
+        std::move(fast_linked));
   }
 
 protected:
   PipelineCache *pipeline_cache_{nullptr};
 
   std::unordered_map<vk::ShaderStageFlagBits, vk::PipelineShaderStageCreateInfo> shader_stages_;
-  std::unordered_map<uint32_t, vk::DescriptorSet> resource_descriptor_heaps_;
+  // Keeps modules referenced by stages alive, builders are moved into compilation jobs
+  std::vector<ShaderModule> shader_modules_;
+  std::unordered_map<uint32_t, DescriptorSet> resource_descriptor_heaps_;
 };
 
 class ComputePipelineBuilder final : public PipelineBuilder<ComputePipelineBuilder> {
@@ -159,6 +434,18 @@ public:
       : PipelineBuilder(pipeline_cache, pipeline_layout_cache, descriptor_set_layout_cache) {}
 
   vk::UniquePipeline create(vk::PipelineLayout pipeline_layout);
+  PipelineCache::SharedPipeline createShared(vk::PipelineLayout pipeline_layout);
+  // Compute pipelines have no libraries
+  vk::UniquePipeline createFastLinked(vk::PipelineLayout) { return {}; }
+
+  nlohmann::json describe() const;
+  ComputePipelineBuilder &load(const nlohmann::json &description,
+                               ShaderModuleCache &shader_module_cache,
+                               const ResourceDescriptorHeapLookup &get_heap);
+
+private:
+  vk::UniquePipeline create(vk::PipelineLayout pipeline_layout, const nlohmann::json &description);
+  size_t hashState() const;
 };
 
 class GraphicsPipelineBuilder final : public PipelineBuilder<GraphicsPipelineBuilder> {
@@ -170,7 +457,18 @@ public:
                           DescriptorSetLayoutCache &descriptor_set_layout_cache)
       : PipelineBuilder(pipeline_cache, pipeline_layout_cache, descriptor_set_layout_cache) {}
 
+  // Linked with link-time optimization when pipeline libraries are used
   vk::UniquePipeline create(vk::PipelineLayout pipeline_layout);
+  PipelineCache::SharedPipeline createShared(vk::PipelineLayout pipeline_layout);
+  // Null when pipeline libraries aren't used or some of them aren't compiled yet, libraries are
+  // never compiled on the calling thread
+  vk::UniquePipeline createFastLinked(vk::PipelineLayout pipeline_layout);
+
+  // Everything that create() consumes, viewports and scissors only when they aren't dynamic
+  nlohmann::json describe() const;
+  GraphicsPipelineBuilder &load(const nlohmann::json &description,
+                                ShaderModuleCache &shader_module_cache,
+                                const ResourceDescriptorHeapLookup &get_heap);
 
   GraphicsPipelineBuilder &vertexBinding(const vk::VertexInputBindingDescription &binding) {
     vertex_bindings_.push_back(binding);
@@ -211,6 +509,8 @@ public:
   GraphicsPipelineBuilder &
   multisample(const vk::PipelineMultisampleStateCreateInfo &multisample_state) {
     multisample_state_ = multisample_state;
+    if (multisample_state.pSampleMask)
+      recordable_ = false;
     return *this;
   }
 
@@ -274,6 +574,38 @@ private:
   std::vector<vk::Format> color_attachments_;
   vk::Format depth_attachment_ = vk::Format::eUndefined;
   vk::Format stencil_attachment_ = vk::Format::eUndefined;
+
+  // Libraries are keyed by description, so only recordable pipelines can use them
+  bool usesLibraries() const noexcept { return recordable_ && pipeline_cache_->usesLibraries(); }
+  vk::UniquePipeline create(vk::PipelineLayout pipeline_layout, const nlohmann::json &description);
+  // Hash of everything describe() records
+  size_t hashState() const;
+  // Whole pipeline, or single library when library flags are set
+  vk::UniquePipeline createPipeline(vk::PipelineLayout pipeline_layout,
+                                    vk::GraphicsPipelineLibraryFlagsEXT library = {});
+  // Optimized link compiles missing libraries, fast link returns null when any is missing
+  vk::UniquePipeline link(vk::PipelineLayout pipeline_layout, const nlohmann::json &description,
+                          bool optimize);
+};
+
+// Builder reconstructed from a pipeline database description. Layout is built on the calling
+// thread, pipeline may then be created on any thread
+class RecordedPipeline final {
+public:
+  RecordedPipeline(const nlohmann::json &description, PipelineCache &pipeline_cache,
+                   PipelineLayoutCache &pipeline_layout_cache,
+                   DescriptorSetLayoutCache &descriptor_set_layout_cache,
+                   ShaderModuleCache &shader_module_cache,
+                   const ResourceDescriptorHeapLookup &get_heap);
+
+  vk::PipelineLayout getLayout() const noexcept { return layout_; }
+  vk::UniquePipeline create() {
+    return std::visit([this](auto &builder) { return builder.create(layout_); }, builder_);
+  }
+
+private:
+  std::variant<ComputePipelineBuilder, GraphicsPipelineBuilder> builder_;
+  vk::PipelineLayout layout_;
 };
 } // namespace gfx
 
@@ -1,11 +1,16 @@
 #ifndef RESOURCES_HPP
 #define RESOURCES_HPP
 
+#include "common/index_allocator.hpp"
 #include "common/small_vector.hpp"
 
 #include "allocator.hpp"
+#include "descriptors.hpp"
 #include "staging_buffer.hpp"
 
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <variant>
 #include <vector>
 
@@ -52,20 +57,32 @@ public:
   ResourceDescriptorHeap() = default;
   ResourceDescriptorHeap(vk::Device device, vk::DescriptorType type, uint32_t size,
                          uint32_t binding = 0);
+  // Descriptors are written straight into descriptor buffer, flush has nothing to apply
+  ResourceDescriptorHeap(vk::Device device, DescriptorBuffers &descriptor_buffers,
+                         vk::DescriptorType type, uint32_t size, uint32_t binding = 0);
 
-  vk::DescriptorSet get() const noexcept { return descriptor_set_; }
+  DescriptorSet get() const noexcept {
+    return {descriptor_set_, range_.buffer_index, range_.offset};
+  }
   vk::DescriptorSetLayout getLayout() const noexcept { return *descriptor_set_layout_; }
+  vk::DescriptorType getType() const noexcept { return type_; }
+  uint32_t getSize() const noexcept { return size_; }
 
-  void free(uint32_t id) noexcept { free_list_.push_back(id); }
+  // Allocation, updates and free are thread-safe. Freed index is recycled only after frames that
+  // could still reference it have completed
+  void free(uint32_t id) noexcept;
 
+  // Applies pending writes, called from the render thread
   void flush();
   void reset();
+  // Frames below completed_frames are finished on GPU, their freed indices become reusable
+  void nextFrame(uint32_t frame, uint32_t completed_frames) noexcept;
 
 protected:
   using DescriptorInfo = std::variant<vk::DescriptorBufferInfo, vk::DescriptorImageInfo>;
-  std::vector<std::pair<uint32_t, DescriptorInfo>> descriptors_;
 
   uint32_t allocate();
+  void write(uint32_t id, const DescriptorInfo &descriptor_info);
 
 private:
   vk::Device device_;
@@ -77,7 +94,21 @@ private:
   vk::UniqueDescriptorSetLayout descriptor_set_layout_;
   vk::DescriptorSet descriptor_set_;
 
-  std::vector<uint32_t> free_list_;
+  DescriptorBuffers *descriptor_buffers_ = nullptr;
+  DescriptorBuffers::Range range_;
+  vk::DeviceSize descriptor_offset_ = 0;
+  size_t descriptor_size_ = 0;
+
+  vme::IndexAllocator indices_;
+
+  // Guards pending writes and retired indices, heap stays movable
+  std::unique_ptr<std::mutex> mutex_ = std::make_unique<std::mutex>();
+  std::vector<std::pair<uint32_t, DescriptorInfo>> descriptors_;
+  // Writes being flushed, kept to reuse their storage
+  std::vector<std::pair<uint32_t, DescriptorInfo>> flushed_descriptors_;
+  uint32_t current_frame_ = 0;
+  // Freed indices with frame they were freed in, in frame order
+  std::deque<std::pair<uint32_t, uint32_t>> retired_;
 };
 
 class BufferDescriptorHeap final : public ResourceDescriptorHeap {
@@ -86,17 +117,24 @@ public:
   BufferDescriptorHeap(vk::Device device, vk::DescriptorType type, uint32_t size,
                        uint32_t binding = 0)
       : ResourceDescriptorHeap(device, type, size, binding){};
+  BufferDescriptorHeap(vk::Device device, DescriptorBuffers &descriptor_buffers,
+                       vk::DescriptorType type, uint32_t size, uint32_t binding = 0)
+      : ResourceDescriptorHeap(device, descriptor_buffers, type, size, binding){};
 
   uint32_t allocate(vk::Buffer buffer, vk::DeviceSize offset = 0,
                     vk::DeviceSize range = VK_WHOLE_SIZE) {
     auto id = ResourceDescriptorHeap::allocate();
-    descriptors_.emplace_back(id, vk::DescriptorBufferInfo{buffer, offset, range});
+    write(id, vk::DescriptorBufferInfo{buffer, offset, range});
     return id;
   }
   UniqueHandle allocateUnique(vk::Buffer buffer, vk::DeviceSize offset = 0,
                               vk::DeviceSize range = VK_WHOLE_SIZE) {
     return UniqueHandle(*this, allocate(buffer, offset, range));
   }
+  void update(uint32_t id, vk::Buffer buffer, vk::DeviceSize offset = 0,
+              vk::DeviceSize range = VK_WHOLE_SIZE) {
+    write(id, vk::DescriptorBufferInfo{buffer, offset, range});
+  }
 };
 
 class ImageDescriptorHeap final : public ResourceDescriptorHeap {
@@ -105,15 +143,21 @@ public:
   ImageDescriptorHeap(vk::Device device, vk::DescriptorType type, uint32_t size,
                       uint32_t binding = 0)
       : ResourceDescriptorHeap(device, type, size, binding){};
+  ImageDescriptorHeap(vk::Device device, DescriptorBuffers &descriptor_buffers,
+                      vk::DescriptorType type, uint32_t size, uint32_t binding = 0)
+      : ResourceDescriptorHeap(device, descriptor_buffers, type, size, binding){};
 
   uint32_t allocate(vk::ImageView image_view, vk::ImageLayout image_layout) {
     auto id = ResourceDescriptorHeap::allocate();
-    descriptors_.emplace_back(id, vk::DescriptorImageInfo{{}, image_view, image_layout});
+    write(id, vk::DescriptorImageInfo{{}, image_view, image_layout});
     return id;
   }
   UniqueHandle allocateUnique(vk::ImageView image_view, vk::ImageLayout image_layout) {
     return UniqueHandle(*this, allocate(image_view, image_layout));
   }
+  void update(uint32_t id, vk::ImageView image_view, vk::ImageLayout image_layout) {
+    write(id, vk::DescriptorImageInfo{{}, image_view, image_layout});
+  }
 };
 
 class SamplerDescriptorHeap final : public ResourceDescriptorHeap {
@@ -122,10 +166,13 @@ public:
   SamplerDescriptorHeap(vk::Device device, vk::DescriptorType type, uint32_t size,
                         uint32_t binding = 0)
       : ResourceDescriptorHeap(device, type, size, binding){};
+  SamplerDescriptorHeap(vk::Device device, DescriptorBuffers &descriptor_buffers,
+                        vk::DescriptorType type, uint32_t size, uint32_t binding = 0)
+      : ResourceDescriptorHeap(device, descriptor_buffers, type, size, binding){};
 
   uint32_t allocate(vk::Sampler sampler) {
     auto id = ResourceDescriptorHeap::allocate();
-    descriptors_.emplace_back(id, vk::DescriptorImageInfo{sampler});
+    write(id, vk::DescriptorImageInfo{sampler});
     return id;
   }
   UniqueHandle allocateUnique(vk::Sampler sampler) {
@@ -141,12 +188,18 @@ struct BufferView {
 class Buffer final {
 public:
   Buffer() = default;
-  Buffer(vma::Allocator allocator, const vk::BufferCreateInfo &buffer_info)
-      : buffer_(allocator.createBufferUnique(buffer_info, {{}, VMA_MEMORY_USAGE_AUTO})) {}
+  Buffer(vma::Allocator allocator, const vk::BufferCreateInfo &buffer_info,
+         const vma::AllocationCreateInfo &alloc_info = {{}, VMA_MEMORY_USAGE_AUTO},
+         const char *name = nullptr)
+      : buffer_(allocator.createBufferUnique(withDeviceAddress(buffer_info), alloc_info, name)),
+        size_(buffer_info.size) {}
 
   vk::Buffer get() { return buffer_->getBuffer(); }
+  vma::Allocation getAllocation() const noexcept { return buffer_->getAllocation(); }
 
   uint32_t allocate(BufferDescriptorHeap &heap, const BufferView &view);
+  // Replaces buffer bound to the same allocation and rewrites its descriptors
+  void rebind(vk::Buffer buffer);
 
   template <typename T>
   void upload(StagingBuffer &staging_buffer, const StagingBuffer::Data<T> &data,
@@ -155,8 +208,21 @@ public:
   }
 
 private:
+  struct Handle {
+    BufferDescriptorHeap *heap;
+    BufferView view;
+    ResourceDescriptorHeap::UniqueHandle handle;
+  };
+
   vma::UniqueBuffer buffer_;
-  vme::SmallVector<ResourceDescriptorHeap::UniqueHandle, 1> handles_;
+  vk::DeviceSize size_ = 0;
+  vme::SmallVector<Handle, 1> handles_;
+
+  // Descriptor buffers address buffer descriptors by device address
+  static vk::BufferCreateInfo withDeviceAddress(vk::BufferCreateInfo buffer_info) noexcept {
+    buffer_info.usage |= vk::BufferUsageFlagBits::eShaderDeviceAddress;
+    return buffer_info;
+  }
 };
 
 struct ImageView {
@@ -169,23 +235,41 @@ struct ImageView {
 class Image final {
 public:
   Image() = default;
-  Image(vma::Allocator allocator, const vk::ImageCreateInfo &image_info)
-      : image_(allocator.createImageUnique(image_info, {{}, VMA_MEMORY_USAGE_AUTO})) {}
+  Image(vma::Allocator allocator, const vk::ImageCreateInfo &image_info,
+        const vma::AllocationCreateInfo &alloc_info = {{}, VMA_MEMORY_USAGE_AUTO},
+        const char *name = nullptr)
+      : image_(allocator.createImageUnique(image_info, alloc_info, name)) {}
 
   vk::Image get() { return image_->getImage(); }
+  vma::Allocation getAllocation() const noexcept { return image_->getAllocation(); }
 
   uint32_t allocate(ImageDescriptorHeap &heap, const ImageView &view, vk::ImageLayout layout);
+  // Replaces image bound to the same allocation, recreates its views and rewrites descriptors
+  void rebind(vk::Image image);
 
   template <typename T>
   void upload(StagingBuffer &staging_buffer, vk::ImageLayout old_layout, vk::ImageLayout new_layout,
               vk::ImageSubresourceRange subresource, const StagingBuffer::Data<T> &data,
-              const vk::ArrayProxy<const vk::BufferImageCopy2> &regions) {
-    staging_buffer.uploadImage(get(), old_layout, new_layout, subresource, data, regions);
+              const vk::ArrayProxy<const vk::BufferImageCopy2> &regions,
+              vk::PipelineStageFlags2 dst_stage = vk::PipelineStageFlagBits2::eFragmentShader,
+              vk::AccessFlags2 dst_access = vk::AccessFlagBits2::eShaderSampledRead) {
+    staging_buffer.uploadImage(get(), old_layout, new_layout, subresource, data, regions,
+                               dst_stage, dst_access);
   }
 
 private:
+  struct Handle {
+    ImageDescriptorHeap *heap;
+    ImageView view;
+    vk::ImageLayout layout;
+    vk::UniqueImageView image_view;
+    ResourceDescriptorHeap::UniqueHandle handle;
+  };
+
   vma::UniqueImage image_;
-  vme::SmallVector<std::pair<vk::UniqueImageView, ResourceDescriptorHeap::UniqueHandle>, 1> handles_;
+  vme::SmallVector<Handle, 1> handles_;
+
+  vk::UniqueImageView createImageView(const ImageView &view);
 };
 
 class Sampler final {
@@ -0,0 +1,80 @@
+#ifndef SHADER_ARCHIVE_HPP
+#define SHADER_ARCHIVE_HPP
+
+#include <vulkan/vulkan.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Reflection and archive code only depends on Vulkan headers and spirv-reflect, so that tools can
+// pack shaders without linking the engine
+namespace gfx {
+using DescriptorSetLayoutBindings = std::vector<vk::DescriptorSetLayoutBinding>;
+
+// Interface of a shader module, extracted from SPIR-V once or read from a shader archive
+struct ShaderReflection {
+  std::string entry_point;
+  vk::ShaderStageFlagBits stage = vk::ShaderStageFlagBits::eVertex;
+  std::vector<std::pair<uint32_t, DescriptorSetLayoutBindings>> descriptor_set_layouts;
+  std::optional<vk::PushConstantRange> push_constant_range;
+  // Locations and formats of vertex shader inputs, sorted by location
+  std::vector<std::pair<uint32_t, vk::Format>> vertex_inputs;
+  // Constant ids by name
+  std::unordered_map<std::string, uint32_t> specialization_constants;
+
+  ShaderReflection() = default;
+  // Runs spirv-reflect
+  explicit ShaderReflection(std::span<const uint32_t> code);
+};
+
+// Throws when file doesn't hold SPIR-V
+std::vector<uint32_t> loadSpirv(const std::filesystem::path &path);
+
+// Compiled shaders with their reflection packed into one file, which is mapped into memory.
+// Modules are created straight from the mapping, without running spirv-reflect
+class ShaderArchive final {
+public:
+  ShaderArchive() = default;
+  // Throws when file isn't a valid archive
+  explicit ShaderArchive(const std::filesystem::path &path);
+  ShaderArchive(const ShaderArchive &) = delete;
+  ShaderArchive(ShaderArchive &&rhs) noexcept { *this = std::move(rhs); }
+  ShaderArchive &operator=(const ShaderArchive &) = delete;
+  ShaderArchive &operator=(ShaderArchive &&rhs) noexcept;
+  ~ShaderArchive();
+
+  explicit operator bool() const noexcept { return words_ != nullptr; }
+  size_t getShaderCount() const noexcept { return entries_.size(); }
+
+  // Code points into the archive, empty when archive doesn't contain the shader
+  std::optional<std::pair<std::span<const uint32_t>, ShaderReflection>>
+  find(const std::string &name) const;
+
+  // Shaders are stored under their file names. Archive is written to a temporary file and renamed,
+  // so that mappings of the previous archive keep their contents
+  static void pack(const std::filesystem::path &path,
+                   const std::vector<std::filesystem::path> &spirv_paths);
+
+private:
+  struct Entry {
+    std::span<const uint32_t> code;
+    uint32_t reflection_offset;
+  };
+
+  const uint32_t *words_ = nullptr;
+  size_t word_count_ = 0;
+  // Archive contents when file can't be mapped
+  std::vector<uint32_t> contents_;
+  std::unordered_map<std::string, Entry> entries_;
+
+  void unmap() noexcept;
+};
+} // namespace gfx
+
+#endif
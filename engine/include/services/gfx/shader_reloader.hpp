@@ -0,0 +1,75 @@
+#ifndef SHADER_RELOADER_HPP
+#define SHADER_RELOADER_HPP
+
+#include "pipelines.hpp"
+#include "shaders.hpp"
+
+#include <vulkan/vulkan.hpp>
+
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace vme {
+class JobSystem;
+}
+
+namespace gfx {
+class Context;
+
+// Watches compiled shaders, and with a configured compiler the source directory tree, for changes.
+// Loaded modules whose sources or includes changed are compiled again. Changed modules and shared
+// pipelines built from them are recreated on job system workers and swapped in by update() at a
+// frame boundary. Replaced objects outlive frames in flight. Pipelines that aren't shared through
+// the pipeline cache keep using old shaders. Directories created after startup aren't watched
+class ShaderReloader final {
+public:
+  ShaderReloader() = default;
+  ShaderReloader(Context &context, vme::JobSystem &job_system);
+  ShaderReloader(const ShaderReloader &) = delete;
+  ShaderReloader(ShaderReloader &&rhs) noexcept { *this = std::move(rhs); }
+  ShaderReloader &operator=(const ShaderReloader &) = delete;
+  ShaderReloader &operator=(ShaderReloader &&rhs) noexcept;
+  ~ShaderReloader();
+
+  bool isWatching() const noexcept { return watch_fd_ != -1; }
+
+  // Called from the render thread between frames
+  void update(uint32_t frame, uint32_t completed_frames);
+
+private:
+  struct PipelineRebuild {
+    PipelineCache::SharedPipeline pipeline;
+    std::future<vk::UniquePipeline> future;
+  };
+
+  Context *context_ = nullptr;
+  vme::JobSystem *job_system_ = nullptr;
+  int watch_fd_ = -1;
+  std::unordered_map<int, std::filesystem::path> watched_directories_;
+
+  std::vector<std::future<void>> compilations_;
+  std::vector<std::pair<std::string, std::future<ShaderModule>>> modules_;
+  std::vector<PipelineRebuild> pipelines_;
+  // Replaced pipelines with frame they were replaced in. Replaced modules aren't retired, builders
+  // still compiling with them share their ownership
+  std::deque<std::pair<uint32_t, vk::UniquePipeline>> retired_;
+  uint32_t current_frame_ = 0;
+
+  void watch(const std::filesystem::path &directory);
+  std::vector<std::filesystem::path> pollChanges();
+  void onChanged(const std::filesystem::path &path);
+  // Compiles loaded modules whose sources include any of changed files
+  void compileDependents(const std::vector<std::filesystem::path> &changes);
+  void swapModules();
+  void swapPipelines();
+  void wait() noexcept;
+};
+} // namespace gfx
+
+#endif
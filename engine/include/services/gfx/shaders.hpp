@@ -3,48 +3,152 @@
 
 #include "common/cache_factory.hpp"
 
-#include <spirv_reflect.h>
+#include "shader_archive.hpp"
+
 #include <vulkan/vulkan.hpp>
 #include <vulkan/vulkan_hash.hpp>
 
+#include <filesystem>
+#include <memory>
 #include <optional>
+#include <span>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace gfx {
-using DescriptorSetLayoutBindings = std::vector<vk::DescriptorSetLayoutBinding>;
-
+// Copies share the module, so that builders keep it alive while their pipelines compile, even
+// after hot-reload replaced it in shader module cache
 class ShaderModule final {
 public:
   using Code = std::vector<uint32_t>;
 
   ShaderModule() = default;
-  ShaderModule(vk::Device device, const Code &code);
+  ShaderModule(vk::Device device, std::span<const uint32_t> code,
+               const std::string &source_name = {});
+  ShaderModule(vk::Device device, std::span<const uint32_t> code, ShaderReflection &&reflection,
+               const std::string &source_name = {});
 
-  vk::ShaderModule get() const noexcept { return *shader_module_; }
+  vk::ShaderModule get() const noexcept { return shader_module_ ? **shader_module_ : nullptr; }
 
-  const char *getName() const noexcept { return reflection_.GetEntryPointName(); };
-  vk::ShaderStageFlagBits getStage() const noexcept {
-    return static_cast<vk::ShaderStageFlagBits>(reflection_.GetShaderStage());
-  };
+  // Reflection is kept on heap, so the name stays valid when module is moved or copied
+  const char *getName() const noexcept { return reflection_->entry_point.c_str(); };
+  // Name the module was loaded by from shader module cache, empty for modules built from code
+  const std::string &getSourceName() const noexcept { return source_name_; }
+  vk::ShaderStageFlagBits getStage() const noexcept { return reflection_->stage; };
 
-  std::vector<std::pair<uint32_t, DescriptorSetLayoutBindings>> getDescriptorSetLayouts() const;
-  std::optional<vk::PushConstantRange> getPushConstantRange() const;
+  const std::vector<std::pair<uint32_t, DescriptorSetLayoutBindings>> &
+  getDescriptorSetLayouts() const noexcept {
+    return reflection_->descriptor_set_layouts;
+  }
+  const std::optional<vk::PushConstantRange> &getPushConstantRange() const noexcept {
+    return reflection_->push_constant_range;
+  }
+  const std::vector<std::pair<uint32_t, vk::Format>> &getVertexInputs() const noexcept {
+    return reflection_->vertex_inputs;
+  }
+  const std::unordered_map<std::string, uint32_t> &getSpecializationConstants() const noexcept {
+    return reflection_->specialization_constants;
+  }
 
 private:
-  vk::UniqueShaderModule shader_module_;
-  spv_reflect::ShaderModule reflection_;
+  std::shared_ptr<const vk::UniqueShaderModule> shader_module_;
+  std::shared_ptr<const ShaderReflection> reflection_;
+  std::string source_name_;
 };
 
 class ShaderModuleCache final
     : public vme::CacheFactory<ShaderModuleCache, std::string, ShaderModule> {
 public:
-  ShaderModuleCache(vk::Device device = {}) : device_(device) {}
+  // Shader archive is opened from shader directory when device is given
+  ShaderModuleCache(vk::Device device = {});
+
+  // Directory compiled shaders are loaded from
+  static const std::filesystem::path &getDirectory() noexcept;
 
-  ShaderModule create(const std::string &name);
+  // Doesn't touch the cache, so modules may be loaded on any thread
+  ShaderModule create(const std::string &name) const;
+  // Loads module from its own file, bypassing shader archive
+  ShaderModule load(const std::string &name) const;
 
 private:
   vk::Device device_;
+  ShaderArchive archive_;
+  std::filesystem::file_time_type archive_time_;
+};
+
+// Variant of a shader source, compiled at runtime
+struct ShaderPermutationKey {
+  // Path of source relative to shader source directory, stage is taken from its extension
+  std::string source;
+  // Sorted by name
+  std::vector<std::pair<std::string, std::string>> defines;
+  // Values by specialization constant name, sorted by name. Values are 32 bit, floats are
+  // passed bit-cast
+  std::vector<std::pair<std::string, uint32_t>> specialization_constants;
+
+  ShaderPermutationKey() = default;
+  ShaderPermutationKey(std::string source,
+                       std::vector<std::pair<std::string, std::string>> defines = {},
+                       std::vector<std::pair<std::string, uint32_t>> specialization_constants = {});
+
+  bool operator==(const ShaderPermutationKey &) const = default;
+
+  struct Hash {
+    size_t operator()(const ShaderPermutationKey &key) const noexcept;
+  };
+};
+
+class ShaderPermutation final {
+public:
+  ShaderPermutation() = default;
+  // Specialization constants are matched to constant ids by reflection of module
+  ShaderPermutation(ShaderModule &&shader_module,
+                    const std::vector<std::pair<std::string, uint32_t>> &specialization_constants);
+  ShaderPermutation(const ShaderPermutation &) = delete;
+  ShaderPermutation(ShaderPermutation &&rhs) noexcept { *this = std::move(rhs); }
+  ShaderPermutation &operator=(const ShaderPermutation &) = delete;
+  ShaderPermutation &operator=(ShaderPermutation &&rhs) noexcept;
+
+  const ShaderModule &getModule() const noexcept { return shader_module_; }
+  // To be passed to shaderStage() of pipeline builders, nullptr without specialization constants
+  const vk::SpecializationInfo *getSpecializationInfo() const noexcept {
+    return map_entries_.empty() ? nullptr : &specialization_info_;
+  }
+
+private:
+  ShaderModule shader_module_;
+  std::vector<vk::SpecializationMapEntry> map_entries_;
+  std::vector<uint32_t> data_;
+  vk::SpecializationInfo specialization_info_;
+};
+
+// Compiles permutations with glslangValidator when the engine is configured with it. Sources are
+// preprocessed for #include and defines, and compiled SPIR-V is kept in cache directory by hash
+// of preprocessed source, so permutations are only compiled again when their sources change
+class ShaderPermutationCache final
+    : public vme::CacheFactory<ShaderPermutationCache, ShaderPermutationKey, ShaderPermutation,
+                               ShaderPermutationKey::Hash> {
+public:
+  ShaderPermutationCache(vk::Device device = {}, const std::filesystem::path &cache_dir = {})
+      : device_(device), cache_dir_(cache_dir) {}
+
+  static bool isAvailable() noexcept;
+  // Directory shader sources and their includes are looked up in
+  static const std::filesystem::path &getSourceDirectory() noexcept;
+  // Canonical paths of source and every file it includes, resolved like permutation includes
+  static std::unordered_set<std::string> getDependencies(const std::filesystem::path &path);
+
+  // Doesn't touch the cache, so permutations may be compiled on any thread
+  ShaderPermutation create(const ShaderPermutationKey &key) const;
+
+private:
+  vk::Device device_;
+  std::filesystem::path cache_dir_;
+
+  ShaderModule::Code compile(const std::string &source, const std::string &extension) const;
 };
 } // namespace gfx
 
@@ -3,6 +3,9 @@
 
 #include "allocator.hpp"
 
+#include "common/job_system.hpp"
+
+#include <chrono>
 #include <variant>
 #include <vector>
 
@@ -10,13 +13,21 @@ namespace gfx {
 
 class StagingBuffer {
 public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr size_t default_chunk_size = 16 * 1024 * 1024;
   static constexpr size_t max_size = 128 * 1024 * 1024;
+  static constexpr std::chrono::milliseconds default_release_delay{5000};
+  // Copies below this size are done on the calling thread
+  static constexpr size_t parallel_copy_threshold = 4 * 1024 * 1024;
 
   template <typename T> using Data = vk::ArrayProxy<const T>;
 
   StagingBuffer() = default;
   StagingBuffer(vk::Device device, uint32_t queue_family_index, uint32_t queue_index,
-                vma::Allocator allocator);
+                vma::Allocator allocator, vme::JobSystem *job_system = nullptr,
+                size_t chunk_size = default_chunk_size,
+                std::chrono::milliseconds release_delay = default_release_delay);
   StagingBuffer(const StagingBuffer &) = delete;
   StagingBuffer(StagingBuffer &&) = delete;
   StagingBuffer &operator=(const StagingBuffer &) = delete;
@@ -25,25 +36,41 @@ public:
   template <typename T>
   void uploadBuffer(vk::Buffer buffer, const Data<T> &data,
                     const vk::ArrayProxy<const vk::BufferCopy2> &regions) {
-    auto offset = copyData(reinterpret_cast<const void *>(data.data()), data.size() * sizeof(T));
+    auto [src_buffer, offset] =
+        copyData(reinterpret_cast<const void *>(data.data()), data.size() * sizeof(T));
     std::vector<vk::BufferCopy2> copies(regions.begin(), regions.end());
     for (auto &copy : copies)
       copy.srcOffset += offset;
-    copies_.push_back(BufferCopy{buffer, std::move(copies)});
+    copies_.push_back(BufferCopy{src_buffer, buffer, std::move(copies)});
   }
 
+  // dst_stage and dst_access describe the first consumer of the image after upload
   template <typename T>
   void uploadImage(vk::Image image, vk::ImageLayout old_layout, vk::ImageLayout new_layout,
                    vk::ImageSubresourceRange subresource, const Data<T> &data,
-                   const vk::ArrayProxy<const vk::BufferImageCopy2> &regions) {
-    auto offset = copyData(reinterpret_cast<const void *>(data.data()), data.size() * sizeof(T));
+                   const vk::ArrayProxy<const vk::BufferImageCopy2> &regions,
+                   vk::PipelineStageFlags2 dst_stage = vk::PipelineStageFlagBits2::eFragmentShader,
+                   vk::AccessFlags2 dst_access = vk::AccessFlagBits2::eShaderSampledRead) {
+    auto [src_buffer, offset] =
+        copyData(reinterpret_cast<const void *>(data.data()), data.size() * sizeof(T));
     std::vector<vk::BufferImageCopy2> copies(regions.begin(), regions.end());
     for (auto &copy : copies)
       copy.bufferOffset += offset;
-    copies_.push_back(ImageCopy{image, old_layout, new_layout, subresource, std::move(copies)});
+    copies_.push_back(ImageCopy{src_buffer, image, old_layout, new_layout, subresource,
+                                std::move(copies), dst_stage, dst_access});
+  }
+
+  size_t getResidentSize() const noexcept { return resident_size_; }
+  size_t getHighWaterMark() const noexcept { return high_water_mark_; }
+
+  std::chrono::milliseconds getReleaseDelay() const noexcept { return release_delay_; }
+  void setReleaseDelay(std::chrono::milliseconds release_delay) noexcept {
+    release_delay_ = release_delay;
   }
 
   void flush();
+  // Releases chunks that were not used for longer than release delay
+  void trim() noexcept;
 
 private:
   vk::Device device_ = {};
@@ -51,21 +78,38 @@ private:
   vk::UniqueFence upload_fence_ = {};
   vk::UniqueCommandPool command_pool_ = {};
   vk::UniqueCommandBuffer command_buffer_ = {};
-  vma::UniqueBuffer staging_buffer_ = {};
+  vma::Allocator allocator_ = {};
+  vme::JobSystem *job_system_ = nullptr;
+
+  struct Chunk {
+    vma::UniqueBuffer buffer;
+    void *mapped_data;
+    size_t size;
+    Clock::time_point last_used;
+  };
 
-  void *mapped_data_ = nullptr;
+  size_t chunk_size_ = default_chunk_size;
+  std::chrono::milliseconds release_delay_ = default_release_delay;
+  std::vector<Chunk> chunks_;
+  size_t current_chunk_ = 0;
   size_t offset_ = 0;
+  size_t resident_size_ = 0;
+  size_t high_water_mark_ = 0;
 
   struct BufferCopy {
+    vk::Buffer src_buffer;
     vk::Buffer buffer;
     std::vector<vk::BufferCopy2> regions;
   };
 
   struct ImageCopy {
+    vk::Buffer src_buffer;
     vk::Image image;
     vk::ImageLayout old_layout, new_layout;
     vk::ImageSubresourceRange subresource;
     std::vector<vk::BufferImageCopy2> regions;
+    vk::PipelineStageFlags2 dst_stage;
+    vk::AccessFlags2 dst_access;
   };
 
   using Copy = std::variant<BufferCopy, ImageCopy>;
@@ -73,7 +117,10 @@ private:
 
   friend class CmdBufGenerator;
 
-  size_t copyData(const void *data, size_t size);
+  Chunk *findChunk(size_t size) noexcept;
+  Chunk &createChunk(size_t size);
+  Chunk &getChunk(size_t size);
+  std::pair<vk::Buffer, size_t> copyData(const void *data, size_t size);
 };
 } // namespace gfx
 
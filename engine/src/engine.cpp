@@ -1,5 +1,6 @@
 #include "engine.hpp"
 
+#include "common/job_system.hpp"
 #include "services/gfx/context.hpp"
 #include "services/wsi/input.hpp"
 #include "services/wsi/window.hpp"
@@ -11,8 +12,120 @@
 
 #include <stdexcept>
 
+#ifdef VME_ALLOCATION_TRACKING
+#include <cstdlib>
+#include <new>
+
+namespace {
+constexpr int allocation_callstack_depth = 16;
+// Set while rendering steady-state frames, heap allocations on the render thread are flagged
+thread_local bool check_allocations = false;
+thread_local size_t flagged_allocation_count = 0;
+
+// Alignment of 0 means the default new alignment, which malloc satisfies
+void *trackedAllocate(std::size_t size, std::size_t alignment = 0) noexcept {
+  size = size ? size : 1;
+  void *ptr;
+  if (!alignment)
+    ptr = std::malloc(size);
+  else
+#ifdef _WIN32
+    ptr = _aligned_malloc(size, alignment);
+#else
+    // aligned_alloc needs size to be a multiple of alignment
+    ptr = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+  if (!ptr)
+    return nullptr;
+  TracyAllocS(ptr, size, allocation_callstack_depth);
+  if (check_allocations) {
+    ++flagged_allocation_count;
+    TracyMessageLCS("Heap allocation in steady-state frame", 0xff0000, allocation_callstack_depth);
+  }
+  return ptr;
+}
+
+void *trackedAllocateOrThrow(std::size_t size, std::size_t alignment = 0) {
+  if (auto *ptr = trackedAllocate(size, alignment))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void trackedFree(void *ptr, bool aligned = false) noexcept {
+  if (!ptr)
+    return;
+  TracyFreeS(ptr, allocation_callstack_depth);
+#ifdef _WIN32
+  if (aligned) {
+    _aligned_free(ptr);
+    return;
+  }
+#endif
+  std::free(ptr);
+}
+
+class AllocationCheckScope {
+public:
+  AllocationCheckScope(bool enabled) noexcept : enabled_(enabled) {
+    flagged_allocation_count = 0;
+    check_allocations = enabled_;
+  }
+  ~AllocationCheckScope() {
+    check_allocations = false;
+    if (enabled_ && flagged_allocation_count)
+      spdlog::error("{} heap allocations during steady-state render", flagged_allocation_count);
+  }
+
+private:
+  bool enabled_;
+};
+} // namespace
+
+// Every replaceable overload is defined, so that none of them reaches the untracked default
+void *operator new(std::size_t size) { return trackedAllocateOrThrow(size); }
+void *operator new[](std::size_t size) { return trackedAllocateOrThrow(size); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return trackedAllocate(size);
+}
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return trackedAllocate(size);
+}
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return trackedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return trackedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+  return trackedAllocate(size, static_cast<std::size_t>(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return trackedAllocate(size, static_cast<std::size_t>(alignment));
+}
+void operator delete(void *ptr) noexcept { trackedFree(ptr); }
+void operator delete[](void *ptr) noexcept { trackedFree(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { trackedFree(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { trackedFree(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { trackedFree(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { trackedFree(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { trackedFree(ptr, true); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { trackedFree(ptr, true); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept { trackedFree(ptr, true); }
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+  trackedFree(ptr, true);
+}
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+  trackedFree(ptr, true);
+}
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+  trackedFree(ptr, true);
+}
+#endif
+
 namespace vme {
 
+using Jobs = entt::locator<JobSystem>;
 using Window = entt::locator<wsi::Window>;
 using Input = entt::locator<wsi::Input>;
 using Context = entt::locator<gfx::Context>;
@@ -27,10 +140,12 @@ void Application::run(unsigned update_freq) {
   // Application initialization
   {
     ZoneScopedN("Init");
+    // Pipelines recorded by previous runs land in pipeline cache before passes build them
+    Context::value().prewarmPipelines();
     onInit();
   }
   double previous = glfwGetTime(), lag = 0.;
-  while (!shouldClose()) {
+  for (unsigned frame = 0; !shouldClose(); ++frame) {
     double current = glfwGetTime(), elapsed = current - previous;
     previous = current;
     lag += elapsed;
@@ -45,6 +160,9 @@ void Application::run(unsigned update_freq) {
     // Process render
     {
       ZoneScopedN("Render");
+#ifdef VME_ALLOCATION_TRACKING
+      AllocationCheckScope allocation_check(frame >= allocation_check_warmup_frames);
+#endif
       onRender(lag / delta);
     }
     Engine::get<gfx::Context>().nextFrame();
@@ -68,6 +186,9 @@ void Engine::init() {
   IMGUI_CHECKVERSION();
   ImGui::CreateContext();
   spdlog::info("ImGui initialized successfully");
+  // Job system
+  Jobs::emplace();
+  spdlog::info("Job system started with {} workers", Jobs::value().getNumWorkers());
   // Window
   Window::emplace("VulkanMiniEngine");
   spdlog::info("Window created successfully");
@@ -75,7 +196,7 @@ void Engine::init() {
   Input::emplace(Window::value());
   spdlog::info("Input callbacks created successfully");
   // Graphics context
-  Context::emplace(Window::value());
+  Context::emplace(Window::value(), Jobs::value());
   spdlog::info("Vulkan context created successfully");
 
   spdlog::info("Engine initialized successfully");
@@ -87,6 +208,7 @@ void Engine::terminate() {
   Context::reset();
   Input::reset();
   Window::reset();
+  Jobs::reset();
   ImGui::DestroyContext();
   glfwTerminate();
   spdlog::info("Engine terminated successfully");
@@ -34,10 +34,15 @@ ForwardPass::ForwardPass(const vme::Scene &scene)
         vk::BlendOp::eAdd,
         vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eB |
             vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eA};
+    gfx::GraphicsPipelineBuilder builder(context.getPipelineCache(),
+                                         context.getPipelineLayoutCache(),
+                                         context.getDescriptorSetLayoutCache());
+    // Per-pass set is pushed when supported, so it costs no set allocation
+    push_descriptors_ = context.supportsPushDescriptors();
+    if (push_descriptors_)
+      builder.pushDescriptorSet(2);
     pipeline_ =
-        gfx::GraphicsPipelineBuilder(context.getPipelineCache(), context.getPipelineLayoutCache(),
-                                     context.getDescriptorSetLayoutCache())
-            .resourceDescriptorHeap(0, context.getSampledImageDescriptorHeap())
+        builder.resourceDescriptorHeap(0, context.getSampledImageDescriptorHeap())
             .resourceDescriptorHeap(1, context.getSamplerDescriptorHeap())
             .shaderStage(shader_module_cache.get("shader.vert.spv"))
             .shaderStage(shader_module_cache.get("shader.frag.spv"))
@@ -54,49 +59,63 @@ ForwardPass::ForwardPass(const vme::Scene &scene)
             .dynamicState(vk::DynamicState::eScissor)
             .colorAttachment(context.getSwapchain().getFormat(), blend_state)
             .depthAttachment(depth_format_)
-            .build();
+            .buildAsync(vme::Engine::get<vme::JobSystem>());
   }
-  // Upload transforms and materials and allocate descriptor set
-  transforms_ = context.getAllocator().createBufferUnique(
-      {{},
-       scene_->getTransforms().size() * sizeof(glm::mat4),
-       vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst},
-      {{}, VMA_MEMORY_USAGE_AUTO});
+  // Upload transforms and materials
+  auto &geometry_buffer = context.getGeometryBuffer();
+  const auto transforms_size = scene_->getTransforms().size() * sizeof(glm::mat4);
+  transforms_ = geometry_buffer.allocateStorage(transforms_size);
   context.getStagingBuffer().uploadBuffer<glm::mat4>(
-      transforms_->getBuffer(), scene_->getTransforms(),
-      vk::BufferCopy2{0, 0, scene_->getTransforms().size() * sizeof(glm::mat4)});
-  materials_ = context.getAllocator().createBufferUnique(
-      {{},
-       scene_->getMaterials().size() * sizeof(vme::Scene::Material),
-       vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst},
-      {{}, VMA_MEMORY_USAGE_AUTO});
+      geometry_buffer.getBuffer(), scene_->getTransforms(),
+      vk::BufferCopy2{0, transforms_.offset, transforms_size});
+  const auto materials_size = scene_->getMaterials().size() * sizeof(vme::Scene::Material);
+  materials_ = geometry_buffer.allocateStorage(materials_size);
+  // Buffer may have grown, so each upload queries current handle
   context.getStagingBuffer().uploadBuffer<vme::Scene::Material>(
-      materials_->getBuffer(), scene_->getMaterials(),
-      vk::BufferCopy2{0, 0, scene_->getMaterials().size() * sizeof(vme::Scene::Material)});
-  const vk::DescriptorBufferInfo transforms_info{transforms_->getBuffer(), 0, VK_WHOLE_SIZE};
-  const vk::DescriptorBufferInfo materials_info{materials_->getBuffer(), 0, VK_WHOLE_SIZE};
-  descriptor_set_ = gfx::DescriptorSetBuilder(context.getDescriptorSetAllocator(),
-                                              context.getDescriptorSetLayoutCache())
-                        .bindBuffer(0, vk::DescriptorType::eStorageBuffer, transforms_info,
-                                    vk::ShaderStageFlagBits::eVertex)
-                        .bindBuffer(1, vk::DescriptorType::eStorageBuffer, materials_info,
-                                    vk::ShaderStageFlagBits::eFragment)
-                        .build();
+      geometry_buffer.getBuffer(), scene_->getMaterials(),
+      vk::BufferCopy2{0, materials_.offset, materials_size});
+}
+
+ForwardPass::~ForwardPass() {
+  auto &geometry_buffer = vme::Engine::get<gfx::Context>().getGeometryBuffer();
+  geometry_buffer.free(materials_);
+  geometry_buffer.free(transforms_);
+}
+
+void ForwardPass::bindDescriptorSet(gfx::Frame &frame, const gfx::Pipeline &pipeline) {
+  auto &context = vme::Engine::get<gfx::Context>();
+  const auto &geometry_buffer = context.getGeometryBuffer();
+  gfx::DescriptorSetBuilder builder(frame.getDescriptorSetAllocator(),
+                                    context.getDescriptorSetLayoutCache());
+  builder
+      .bindBuffer(0, vk::DescriptorType::eStorageBuffer, geometry_buffer.getBuffer(),
+                  geometry_buffer.getSize(), transforms_.offset, transforms_.size,
+                  vk::ShaderStageFlagBits::eVertex)
+      .bindBuffer(1, vk::DescriptorType::eStorageBuffer, geometry_buffer.getBuffer(),
+                  geometry_buffer.getSize(), materials_.offset, materials_.size,
+                  vk::ShaderStageFlagBits::eFragment);
+  if (push_descriptors_)
+    builder.push(frame.getCommandBuffer(), pipeline.getBindPoint(), pipeline.getLayout(), 2);
+  else
+    pipeline.bindDescriptorSet(frame.getCommandBuffer(), 2, builder.build());
 }
 
 void ForwardPass::onSwapchainResize(vk::Extent2D extent) {
   auto &context = vme::Engine::get<gfx::Context>();
-  depth_image_ =
-      context.getAllocator().createImageUnique({{},
-                                                vk::ImageType::e2D,
-                                                depth_format_,
-                                                vk::Extent3D{extent.width, extent.height, 1},
-                                                1,
-                                                1,
-                                                vk::SampleCountFlagBits::e1,
-                                                vk::ImageTiling::eOptimal,
-                                                vk::ImageUsageFlagBits::eDepthStencilAttachment},
-                                               {{}, VMA_MEMORY_USAGE_AUTO});
+  depth_image_ = context.getAllocator().createImageUnique(
+      {{},
+       vk::ImageType::e2D,
+       depth_format_,
+       vk::Extent3D{extent.width, extent.height, 1},
+       1,
+       1,
+       vk::SampleCountFlagBits::e1,
+       vk::ImageTiling::eOptimal,
+       vk::ImageUsageFlagBits::eDepthStencilAttachment},
+      gfx::tagAllocation(
+          context.getMemoryPools().getAllocationCreateInfo(gfx::ResourceClass::eDepthTarget),
+          gfx::Subsystem::eRenderer),
+      "forward:depth");
   depth_image_view_ =
       context.getDevice().createImageViewUnique({{},
                                                  depth_image_->getImage(),
@@ -112,6 +131,7 @@ void ForwardPass::execute(gfx::Frame &frame) {
   auto &context = vme::Engine::get<gfx::Context>();
   auto extent = context.getSwapchain().getExtent();
   auto cmd_buf = frame.getCommandBuffer();
+  const auto &geometry_buffer = context.getGeometryBuffer();
   vk::RenderingAttachmentInfo color_attachment{
       context.getSwapchain().getCurrentImageView(),
       vk::ImageLayout::eColorAttachmentOptimal,
@@ -131,42 +151,47 @@ void ForwardPass::execute(gfx::Frame &frame) {
                                                vk::ClearValue(vk::ClearDepthStencilValue(1.f, 0))};
   cmd_buf.beginRendering(
       {vk::RenderingFlags{}, vk::Rect2D{{}, extent}, 1, 0, color_attachment, &depth_attachment});
-  pipeline_.bind(cmd_buf);
+  // Attachments are still cleared while pipeline compiles
+  const auto *pipeline = pipeline_.get();
+  if (!pipeline) {
+    cmd_buf.endRendering();
+    return;
+  }
+  pipeline->bind(cmd_buf);
   cmd_buf.setViewport(
       0, vk::Viewport{0.0f, 0.0f, (float)extent.width, (float)extent.height, 0.0f, 1.0f});
   cmd_buf.setScissor(0, vk::Rect2D{{}, extent});
-  pipeline_.bindDesriptorSets(cmd_buf, 2, descriptor_set_);
+  bindDescriptorSet(frame, *pipeline);
   static float angle = 0.f;
   glm::vec3 camera_pos{2.f * glm::cos(angle), 2.f * glm::sin(angle), -.5f};
   angle += 0.001f;
   glm::mat4 view = glm::lookAt(camera_pos, glm::vec3{}, glm::vec3{0.f, 0.f, 1.f});
   glm::mat4 proj = glm::perspective(glm::half_pi<float>(),
                                     (float)extent.width / (float)extent.height, .1f, 100.f);
-  pipeline_.setPushConstant<glm::mat4>(
+  pipeline->setPushConstant<glm::mat4>(
       cmd_buf, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment,
       offsetof(PushConstant, view_proj), proj * view);
-  pipeline_.setPushConstant<glm::vec3>(
+  pipeline->setPushConstant<glm::vec3>(
       cmd_buf, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment,
       offsetof(PushConstant, camera_pos), camera_pos);
+  // All attributes come from the same buffer, only offsets change per primitive
+  const std::array<vk::Buffer, 3> vertex_buffers{
+      geometry_buffer.getBuffer(), geometry_buffer.getBuffer(), geometry_buffer.getBuffer()};
   for (const auto &mesh : scene_->getMeshes()) {
-    pipeline_.setPushConstant<uint32_t>(
+    pipeline->setPushConstant<uint32_t>(
         cmd_buf, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment,
         offsetof(PushConstant, transform_id), mesh.transform_id);
     for (const auto &primitive : mesh.primitives) {
-      std::vector<vk::Buffer> vertex_buffers;
-      vertex_buffers.reserve(primitive.attributes.size());
-      for (const auto &view : primitive.attributes)
-        vertex_buffers.push_back(view.buffer);
-
-      std::vector<vk::DeviceSize> vertex_offsets;
-      vertex_offsets.reserve(primitive.attributes.size());
+      // Inline storage fits position, normal and texcoord without heap allocation
+      vme::SmallVector<vk::DeviceSize, 3> vertex_offsets;
       for (const auto &view : primitive.attributes)
         vertex_offsets.push_back(view.offset);
-
-      cmd_buf.bindVertexBuffers(0, vertex_buffers, vertex_offsets);
-      cmd_buf.bindIndexBuffer(primitive.indices.buffer, primitive.indices.offset,
+      cmd_buf.bindVertexBuffers(
+          0, {static_cast<uint32_t>(vertex_offsets.size()), vertex_buffers.data()},
+          {static_cast<uint32_t>(vertex_offsets.size()), vertex_offsets.data()});
+      cmd_buf.bindIndexBuffer(geometry_buffer.getBuffer(), primitive.indices.offset,
                               vk::IndexType::eUint16);
-      pipeline_.setPushConstant<uint32_t>(
+      pipeline->setPushConstant<uint32_t>(
           cmd_buf, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment,
           offsetof(PushConstant, material_id), primitive.material_id);
       cmd_buf.drawIndexed(primitive.count, 1, 0, 0, 0);
@@ -63,16 +63,21 @@ ImGuiPass::ImGuiPass() : Pass("ImGui", vk::PipelineStageFlagBits2::eAllGraphics)
     const vk::ImageSubresourceLayers subresource_layers{vk::ImageAspectFlagBits::eColor, 0, 0, 1};
     const vk::ImageSubresourceRange subresource_range{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1};
     // Create image
-    font_image_ = gfx::Image(context.getAllocator(), {{},
-                                                      vk::ImageType::e2D,
-                                                      image_format,
-                                                      image_extent,
-                                                      1,
-                                                      1,
-                                                      vk::SampleCountFlagBits::e1,
-                                                      vk::ImageTiling::eOptimal,
-                                                      vk::ImageUsageFlagBits::eTransferDst |
-                                                          vk::ImageUsageFlagBits::eSampled});
+    font_image_ = gfx::Image(
+        context.getAllocator(),
+        {{},
+         vk::ImageType::e2D,
+         image_format,
+         image_extent,
+         1,
+         1,
+         vk::SampleCountFlagBits::e1,
+         vk::ImageTiling::eOptimal,
+         vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled},
+        gfx::tagAllocation(
+            context.getMemoryPools().getAllocationCreateInfo(gfx::ResourceClass::eTexture),
+            gfx::Subsystem::eImGui),
+        "imgui:font");
     font_image_.upload(
         context.getStagingBuffer(), vk::ImageLayout::eUndefined,
         vk::ImageLayout::eShaderReadOnlyOptimal, subresource_range,
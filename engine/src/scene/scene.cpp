@@ -128,18 +128,16 @@ static vk::Format getFormat(int component, int pixel_type) {
   }
 }
 
-Scene::Scene(gfx::Context &context, const tinygltf::Model &model) {
+Scene::Scene(gfx::Context &context, const tinygltf::Model &model) : context_(&context) {
+  auto &defragmenter = context.getDefragmenter();
+  auto &geometry_buffer = context.getGeometryBuffer();
   // Upload buffers
   for (const auto &buffer : model.buffers) {
-    auto buf = context.getAllocator().createBufferUnique(
-        {{},
-         buffer.data.size(),
-         vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eIndexBuffer |
-             vk::BufferUsageFlagBits::eTransferDst},
-        {{}, VMA_MEMORY_USAGE_AUTO});
-    context.getStagingBuffer().uploadBuffer<uint8_t>(buf->getBuffer(), buffer.data,
-                                                     vk::BufferCopy2{0, 0, buffer.data.size()});
-    buffers_.push_back(std::move(buf));
+    const auto allocation = geometry_buffer.allocate(buffer.data.size());
+    context.getStagingBuffer().uploadBuffer<uint8_t>(
+        geometry_buffer.getBuffer(), buffer.data,
+        vk::BufferCopy2{0, allocation.offset, buffer.data.size()});
+    buffers_.push_back(allocation);
   }
   // Upload images
   for (const auto &image : model.images) {
@@ -148,22 +146,34 @@ Scene::Scene(gfx::Context &context, const tinygltf::Model &model) {
                               static_cast<uint32_t>(image.height), 1};
     const vk::ImageSubresourceLayers subresource_layers{vk::ImageAspectFlagBits::eColor, 0, 0, 1};
     const vk::ImageSubresourceRange subresource_range{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1};
-    auto img = gfx::Image(context.getAllocator(), {{},
-                                                   vk::ImageType::e2D,
-                                                   format,
-                                                   extent,
-                                                   1,
-                                                   1,
-                                                   vk::SampleCountFlagBits::e1,
-                                                   vk::ImageTiling::eOptimal,
-                                                   vk::ImageUsageFlagBits::eSampled |
-                                                       vk::ImageUsageFlagBits::eTransferDst});
+    const vk::ImageCreateInfo image_info{{},
+                                         vk::ImageType::e2D,
+                                         format,
+                                         extent,
+                                         1,
+                                         1,
+                                         vk::SampleCountFlagBits::e1,
+                                         vk::ImageTiling::eOptimal,
+                                         vk::ImageUsageFlagBits::eSampled |
+                                             vk::ImageUsageFlagBits::eTransferSrc |
+                                             vk::ImageUsageFlagBits::eTransferDst};
+    const auto name = "scene:" + (!image.name.empty()  ? image.name
+                                  : !image.uri.empty() ? image.uri
+                                                       : "image " + std::to_string(images_.size()));
+    const auto alloc_info = gfx::tagAllocation(
+        context.getMemoryPools().getAllocationCreateInfo(gfx::ResourceClass::eTexture, image_info),
+        gfx::Subsystem::eScene);
+    auto img = gfx::Image(context.getAllocator(), image_info, alloc_info, name.c_str());
     img.upload<uint8_t>(context.getStagingBuffer(), vk::ImageLayout::eUndefined,
                         vk::ImageLayout::eShaderReadOnlyOptimal, subresource_range, image.image,
                         vk::BufferImageCopy2{0, 0, 0, subresource_layers, vk::Offset3D{}, extent});
     auto id = img.allocate(context.getSampledImageDescriptorHeap(),
                            {vk::ImageViewType::e2D, format, {}, subresource_range},
                            vk::ImageLayout::eShaderReadOnlyOptimal);
+    defragmenter.registerImage(img.getAllocation(), img.get(), image_info,
+                               vk::ImageLayout::eShaderReadOnlyOptimal,
+                               [this, index = static_cast<uint32_t>(images_.size())](
+                                   vk::Image image) { images_[index].first.rebind(image); });
     images_.emplace_back(std::move(img), id);
   }
   // Upload samplers
@@ -199,6 +209,17 @@ Scene::Scene(gfx::Context &context, const tinygltf::Model &model) {
       addNode(model, node, glm::mat4{1.f});
 }
 
+Scene::~Scene() {
+  if (!context_)
+    return;
+  auto &defragmenter = context_->getDefragmenter();
+  for (const auto &[image, id] : images_)
+    defragmenter.unregister(image.getAllocation());
+  auto &geometry_buffer = context_->getGeometryBuffer();
+  for (const auto &allocation : buffers_)
+    geometry_buffer.free(allocation);
+}
+
 void Scene::addNode(const tinygltf::Model &model, const tinygltf::Node &node, glm::mat4 parent) {
   glm::mat4 transform{1.f};
   if (!node.matrix.empty()) {
@@ -234,7 +255,7 @@ void Scene::addMesh(const tinygltf::Model &model, const tinygltf::Mesh &mesh, gl
   for (const auto &primitive : mesh.primitives) {
     auto getBufferView = [&](int index) {
       const auto &buffer_view = model.bufferViews[model.accessors[index].bufferView];
-      return BufferView{buffers_[buffer_view.buffer]->getBuffer(), buffer_view.byteOffset};
+      return BufferView{buffers_[buffer_view.buffer].offset + buffer_view.byteOffset};
     };
     std::vector<BufferView> attributes;
     for (const auto &attribute : {"POSITION", "NORMAL", "TEXCOORD_0"}) {
@@ -21,16 +21,64 @@ UniqueAllocator createAllocatorUnique(const AllocatorCreateInfo &create_info) {
 
 void Allocator::destroy() noexcept { vmaDestroyAllocator(*this); }
 
+VirtualBlock createVirtualBlock(const VirtualBlockCreateInfo &create_info) {
+  VmaVirtualBlock virtual_block;
+  VMA_CHECK(vmaCreateVirtualBlock, &create_info, &virtual_block);
+  return virtual_block;
+}
+
+UniqueVirtualBlock createVirtualBlockUnique(const VirtualBlockCreateInfo &create_info) {
+  return UniqueVirtualBlock(createVirtualBlock(create_info), ObjectDestroy<NoParent>());
+}
+
+VirtualAllocation VirtualBlock::allocate(const VirtualAllocationCreateInfo &alloc_info,
+                                         vk::DeviceSize &offset) noexcept {
+  VmaVirtualAllocation allocation;
+  if (vmaVirtualAllocate(*this, &alloc_info, &allocation, &offset) != VK_SUCCESS)
+    return VK_NULL_HANDLE;
+  return allocation;
+}
+
+void VirtualBlock::free(VirtualAllocation allocation) noexcept {
+  vmaVirtualFree(*this, allocation);
+}
+
+bool VirtualBlock::isEmpty() const noexcept { return vmaIsVirtualBlockEmpty(*this); }
+
+VmaStatistics VirtualBlock::getStatistics() const noexcept {
+  VmaStatistics statistics;
+  vmaGetVirtualBlockStatistics(*this, &statistics);
+  return statistics;
+}
+
+void VirtualBlock::destroy() noexcept { vmaDestroyVirtualBlock(*this); }
+
 VmaAllocatorInfo Allocator::getInfo() const noexcept {
   VmaAllocatorInfo allocator_info;
   vmaGetAllocatorInfo(*this, &allocator_info);
   return allocator_info;
 }
 
+const VkPhysicalDeviceMemoryProperties &Allocator::getMemoryProperties() const noexcept {
+  const VkPhysicalDeviceMemoryProperties *memory_properties;
+  vmaGetMemoryProperties(*this, &memory_properties);
+  return *memory_properties;
+}
+
 void Allocator::setCurrentFrameIndex(uint32_t index) noexcept {
   vmaSetCurrentFrameIndex(*this, index);
 }
 
+void Allocator::getHeapBudgets(VmaBudget *budgets) const noexcept {
+  vmaGetHeapBudgets(*this, budgets);
+}
+
+VmaTotalStatistics Allocator::calculateStatistics() const noexcept {
+  VmaTotalStatistics statistics;
+  vmaCalculateStatistics(*this, &statistics);
+  return statistics;
+}
+
 uint32_t Allocator::findMemoryTypeIndex(uint32_t memory_type_bits,
                                         const AllocationCreateInfo &alloc_info) {
   uint32_t memory_type_index;
@@ -38,19 +86,39 @@ uint32_t Allocator::findMemoryTypeIndex(uint32_t memory_type_bits,
   return memory_type_index;
 }
 
+uint32_t Allocator::findMemoryTypeIndexForBufferInfo(const vk::BufferCreateInfo &buffer_info,
+                                                     const AllocationCreateInfo &alloc_info) {
+  uint32_t memory_type_index;
+  VMA_CHECK(vmaFindMemoryTypeIndexForBufferInfo, *this,
+            reinterpret_cast<const VkBufferCreateInfo *>(&buffer_info), &alloc_info,
+            &memory_type_index);
+  return memory_type_index;
+}
+
+uint32_t Allocator::findMemoryTypeIndexForImageInfo(const vk::ImageCreateInfo &image_info,
+                                                    const AllocationCreateInfo &alloc_info) {
+  uint32_t memory_type_index;
+  VMA_CHECK(vmaFindMemoryTypeIndexForImageInfo, *this,
+            reinterpret_cast<const VkImageCreateInfo *>(&image_info), &alloc_info,
+            &memory_type_index);
+  return memory_type_index;
+}
+
 Allocation Allocator::createAllocation(const vk::MemoryRequirements &memory_requirements,
-                                       const AllocationCreateInfo &alloc_info) {
+                                       const AllocationCreateInfo &alloc_info, const char *name) {
   VmaAllocation allocation;
   VMA_CHECK(vmaAllocateMemory, *this,
             reinterpret_cast<const VkMemoryRequirements *>(&memory_requirements), &alloc_info,
             &allocation, nullptr);
+  if (name)
+    setAllocationName(allocation, name);
   return allocation;
 }
 
 UniqueAllocation
 Allocator::createAllocationUnique(const vk::MemoryRequirements &memory_requirements,
-                                  const AllocationCreateInfo &alloc_info) {
-  return UniqueAllocation(createAllocation(memory_requirements, alloc_info),
+                                  const AllocationCreateInfo &alloc_info, const char *name) {
+  return UniqueAllocation(createAllocation(memory_requirements, alloc_info, name),
                           ObjectDestroy<Allocator>(*this));
 }
 
@@ -60,6 +128,14 @@ VmaAllocationInfo Allocator::getAllocationInfo(Allocation allocation) const noex
   return allocation_info;
 }
 
+void Allocator::setAllocationName(Allocation allocation, const char *name) noexcept {
+  vmaSetAllocationName(*this, allocation, name);
+}
+
+void Allocator::setAllocationUserData(Allocation allocation, void *user_data) noexcept {
+  vmaSetAllocationUserData(*this, allocation, user_data);
+}
+
 void Allocator::bindBufferMemory(Allocation allocation, vk::Buffer buffer) {
   VMA_CHECK(vmaBindBufferMemory, *this, allocation, buffer);
 }
@@ -76,19 +152,25 @@ void *Allocator::mapMemory(Allocation allocation) {
 
 void Allocator::unmapMemory(Allocation allocation) noexcept { vmaUnmapMemory(*this, allocation); }
 
-void Allocator::destroy(Allocation allocation) noexcept { vmaFreeMemory(*this, allocation); };
+void Allocator::destroy(Allocation allocation) noexcept {
+  vmaFreeMemory(*this, allocation);
+};
 
 Buffer Allocator::createBuffer(const vk::BufferCreateInfo &buffer_info,
-                               const AllocationCreateInfo &alloc_info) {
+                               const AllocationCreateInfo &alloc_info, const char *name) {
   VkBuffer buffer;
   VmaAllocation allocation;
   VMA_CHECK(vmaCreateBuffer, *this, reinterpret_cast<const VkBufferCreateInfo *>(&buffer_info),
             &alloc_info, &buffer, &allocation, nullptr);
+  if (name)
+    setAllocationName(allocation, name);
   return Buffer(buffer, allocation);
 }
 UniqueBuffer Allocator::createBufferUnique(const vk::BufferCreateInfo &buffer_info,
-                                           const AllocationCreateInfo &alloc_info) {
-  return UniqueBuffer(createBuffer(buffer_info, alloc_info), ObjectDestroy<Allocator>(*this));
+                                           const AllocationCreateInfo &alloc_info,
+                                           const char *name) {
+  return UniqueBuffer(createBuffer(buffer_info, alloc_info, name),
+                      ObjectDestroy<Allocator>(*this));
 }
 
 void Allocator::destroy(Buffer buffer) noexcept {
@@ -111,17 +193,20 @@ vk::UniqueBuffer Allocator::createAliasingBufferUnique(Allocation allocation,
 }
 
 Image Allocator::createImage(const vk::ImageCreateInfo &image_info,
-                             const AllocationCreateInfo &alloc_info) {
+                             const AllocationCreateInfo &alloc_info, const char *name) {
   VkImage image;
   VmaAllocation allocation;
   VMA_CHECK(vmaCreateImage, *this, reinterpret_cast<const VkImageCreateInfo *>(&image_info),
             &alloc_info, &image, &allocation, nullptr);
+  if (name)
+    setAllocationName(allocation, name);
   return Image(image, allocation);
 }
 
 UniqueImage Allocator::createImageUnique(const vk::ImageCreateInfo &image_info,
-                                         const AllocationCreateInfo &alloc_info) {
-  return UniqueImage(createImage(image_info, alloc_info), ObjectDestroy<Allocator>(*this));
+                                         const AllocationCreateInfo &alloc_info,
+                                         const char *name) {
+  return UniqueImage(createImage(image_info, alloc_info, name), ObjectDestroy<Allocator>(*this));
 }
 
 void Allocator::destroy(Image image) noexcept {
@@ -153,5 +238,58 @@ UniquePool Allocator::createPoolUnique(const PoolCreateInfo &pool_info) {
   return UniquePool(createPool(pool_info), ObjectDestroy<Allocator>(*this));
 }
 
+void Allocator::setPoolName(Pool pool, const char *name) noexcept {
+  vmaSetPoolName(*this, pool, name);
+}
+
+VmaStatistics Allocator::getPoolStatistics(Pool pool) const noexcept {
+  VmaStatistics statistics;
+  vmaGetPoolStatistics(*this, pool, &statistics);
+  return statistics;
+}
+
+VmaDetailedStatistics Allocator::calculatePoolStatistics(Pool pool) const noexcept {
+  VmaDetailedStatistics statistics;
+  vmaCalculatePoolStatistics(*this, pool, &statistics);
+  return statistics;
+}
+
 void Allocator::destroy(Pool pool) noexcept { vmaDestroyPool(*this, pool); };
+
+DefragmentationContext
+Allocator::beginDefragmentation(const DefragmentationInfo &defragmentation_info) {
+  VmaDefragmentationContext context;
+  VMA_CHECK(vmaBeginDefragmentation, *this, &defragmentation_info, &context);
+  return context;
+}
+
+DefragmentationStats Allocator::endDefragmentation(DefragmentationContext context) noexcept {
+  VmaDefragmentationStats stats;
+  vmaEndDefragmentation(*this, context, &stats);
+  return stats;
+}
+
+bool Allocator::beginDefragmentationPass(DefragmentationContext context,
+                                         DefragmentationPassMoveInfo &pass_info) {
+  VkResult result = vmaBeginDefragmentationPass(*this, context, &pass_info);
+  if (result != VK_SUCCESS && result != VK_INCOMPLETE)
+    vk::throwResultException(static_cast<vk::Result>(result), "vmaBeginDefragmentationPass");
+  return result == VK_INCOMPLETE;
+}
+
+bool Allocator::endDefragmentationPass(DefragmentationContext context,
+                                       DefragmentationPassMoveInfo &pass_info) {
+  VkResult result = vmaEndDefragmentationPass(*this, context, &pass_info);
+  if (result != VK_SUCCESS && result != VK_INCOMPLETE)
+    vk::throwResultException(static_cast<vk::Result>(result), "vmaEndDefragmentationPass");
+  return result == VK_INCOMPLETE;
+}
+
+std::string Allocator::buildStatsString(bool detailed_map) const {
+  char *stats_string;
+  vmaBuildStatsString(*this, &stats_string, detailed_map);
+  std::string result(stats_string);
+  vmaFreeStatsString(*this, stats_string);
+  return result;
+}
 } // namespace vma
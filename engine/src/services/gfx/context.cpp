@@ -3,8 +3,12 @@
 
 #include <GLFW/glfw3.h>
 #include <spdlog/spdlog.h>
+#include <tracy/Tracy.hpp>
+
+#include <nlohmann/json.hpp>
 
 #include <algorithm>
+#include <chrono>
 #include <stdexcept>
 
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE;
@@ -26,7 +30,9 @@ static std::vector<const char *> getRequiredDeviceExtensions() {
 }
 
 static std::vector<const char *> getDesiredDeviceExtensions() {
-  return {VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME};
+  return {VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME,
+          VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME,
+          VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME};
 }
 
 static std::vector<const char *> getValidationLayers() {
@@ -60,7 +66,25 @@ debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
 }
 #endif
 
-Context::Context(const wsi::Window &window) {
+// Device memory blocks are reported to Tracy as a separate memory pool, identified by name pointer
+static constexpr const char *vram_pool_name = "VRAM";
+
+static void VKAPI_PTR onDeviceMemoryAllocate(VmaAllocator allocator, uint32_t memory_type,
+                                             VkDeviceMemory memory, VkDeviceSize size,
+                                             void *user_data) {
+  TracyAllocN(reinterpret_cast<void *>(memory), size, vram_pool_name);
+}
+
+static void VKAPI_PTR onDeviceMemoryFree(VmaAllocator allocator, uint32_t memory_type,
+                                         VkDeviceMemory memory, VkDeviceSize size,
+                                         void *user_data) {
+  TracyFreeN(reinterpret_cast<void *>(memory), vram_pool_name);
+}
+
+Context::Context(const wsi::Window &window, vme::JobSystem &job_system,
+                 const DescriptorHeapSizes &heap_sizes,
+                 const std::filesystem::path &pipeline_cache_dir)
+    : job_system_(&job_system) {
   // Create instance
   {
     VULKAN_HPP_DEFAULT_DISPATCHER.init(glfwGetInstanceProcAddress);
@@ -108,6 +132,44 @@ Context::Context(const wsi::Window &window) {
     for (auto desired_extension : getDesiredDeviceExtensions())
       if (extension_supported(desired_extension))
         enabled_extensions_.push_back(desired_extension);
+    if (isExtensionEnabled(VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME)) {
+      const auto descriptor_buffer_features =
+          physical_device_
+              .getFeatures2<vk::PhysicalDeviceFeatures2,
+                            vk::PhysicalDeviceDescriptorBufferFeaturesEXT>()
+              .get<vk::PhysicalDeviceDescriptorBufferFeaturesEXT>();
+      const auto descriptor_buffer_properties =
+          physical_device_
+              .getProperties2<vk::PhysicalDeviceProperties2,
+                              vk::PhysicalDeviceDescriptorBufferPropertiesEXT>()
+              .get<vk::PhysicalDeviceDescriptorBufferPropertiesEXT>();
+      // Extension may be exposed without descriptor buffer feature, heaps fall back to pools then
+      if (!descriptor_buffer_features.descriptorBuffer)
+        std::erase(enabled_extensions_,
+                   std::string_view{VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME});
+      // Push descriptors can't be mixed with descriptor buffers otherwise. Without bufferless push
+      // descriptors a buffer with push descriptor usage would have to be bound as well
+      else if (!descriptor_buffer_features.descriptorBufferPushDescriptors ||
+               !descriptor_buffer_properties.bufferlessPushDescriptors)
+        std::erase(enabled_extensions_, std::string_view{VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME});
+    }
+    if (isExtensionEnabled(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME)) {
+      const auto features =
+          physical_device_
+              .getFeatures2<vk::PhysicalDeviceFeatures2,
+                            vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT>()
+              .get<vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT>();
+      const auto properties =
+          physical_device_
+              .getProperties2<vk::PhysicalDeviceProperties2,
+                              vk::PhysicalDeviceGraphicsPipelineLibraryPropertiesEXT>()
+              .get<vk::PhysicalDeviceGraphicsPipelineLibraryPropertiesEXT>();
+      // Libraries only pay off when linking them is much cheaper than a monolithic compile
+      if (!features.graphicsPipelineLibrary || !properties.graphicsPipelineLibraryFastLinking ||
+          !isExtensionEnabled(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME))
+        std::erase(enabled_extensions_,
+                   std::string_view{VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME});
+    }
     spdlog::info("[gfx] Enabled extensions:");
     for (auto extension : enabled_extensions_)
       spdlog::info("[gfx]    {}", extension);
@@ -133,7 +195,7 @@ Context::Context(const wsi::Window &window) {
       throw std::runtime_error("No device queue with compute, graphics and present support");
     std::array<float, 1> queue_priorities{1.0f};
     vk::DeviceQueueCreateInfo queue_create_info{{}, queue_family_index_, queue_priorities};
-    device_ = physical_device_.createDeviceUnique(vk::StructureChain{
+    vk::StructureChain create_info{
         vk::DeviceCreateInfo{{}, queue_create_info, {}, enabled_extensions_},
         vk::PhysicalDeviceVulkan11Features{}.setShaderDrawParameters(true),
         vk::PhysicalDeviceVulkan12Features{}
@@ -149,35 +211,30 @@ Context::Context(const wsi::Window &window) {
             .setDescriptorBindingUpdateUnusedWhilePending(true)
             .setDescriptorBindingPartiallyBound(true)
             .setRuntimeDescriptorArray(true),
-        vk::PhysicalDeviceVulkan13Features{}.setSynchronization2(true).setDynamicRendering(true)}
-                                                      .get());
+        vk::PhysicalDeviceVulkan13Features{}.setSynchronization2(true).setDynamicRendering(true),
+        vk::PhysicalDeviceDescriptorBufferFeaturesEXT{}
+            .setDescriptorBuffer(true)
+            .setDescriptorBufferPushDescriptors(supportsPushDescriptors()),
+        vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT{}.setGraphicsPipelineLibrary(true)};
+    if (!usesDescriptorBuffers())
+      create_info.unlink<vk::PhysicalDeviceDescriptorBufferFeaturesEXT>();
+    if (!supportsGraphicsPipelineLibrary())
+      create_info.unlink<vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT>();
+    device_ = physical_device_.createDeviceUnique(create_info.get());
     VULKAN_HPP_DEFAULT_DISPATCHER.init(*device_);
   }
   // Create swapchain
   swapchain_ = Swapchain(physical_device_, *surface_, *device_, queue_family_index_, 0);
   swapchain_.recreate(window.getFramebufferSize());
-  // Create resource caches
-  descriptor_set_layout_cache_ = DescriptorSetLayoutCache(*device_);
-  shader_module_cache_ = ShaderModuleCache(*device_);
-  pipeline_layout_cache_ = PipelineLayoutCache(*device_);
-  pipeline_cache_ = PipelineCache(*device_);
-  // Create resource descriptor heaps
-  storage_buffer_descriptor_heap_ =
-      BufferDescriptorHeap(*device_, vk::DescriptorType::eStorageBuffer, 1024 * 1024);
-  storage_image_descriptor_heap_ =
-      ImageDescriptorHeap(*device_, vk::DescriptorType::eStorageImage, 1024 * 1024);
-  sampled_image_descriptor_heap_ =
-      ImageDescriptorHeap(*device_, vk::DescriptorType::eSampledImage, 1024 * 1024);
-  sampler_descriptor_heap_ =
-      SamplerDescriptorHeap(*device_, vk::DescriptorType::eSampler, 1024 * 1024);
-  // Create descriptor set allocator
-  descriptor_set_allocator_ = DescriptorSetAllocator(*device_);
   // Create allocator
   {
     VmaVulkanFunctions vma_vk_funcs{};
     vma_vk_funcs.vkGetInstanceProcAddr = VULKAN_HPP_DEFAULT_DISPATCHER.vkGetInstanceProcAddr;
     vma_vk_funcs.vkGetDeviceProcAddr = VULKAN_HPP_DEFAULT_DISPATCHER.vkGetDeviceProcAddr;
 
+    VmaDeviceMemoryCallbacks device_memory_callbacks{onDeviceMemoryAllocate, onDeviceMemoryFree,
+                                                     nullptr};
+
     vma::AllocatorCreateInfo create_info{};
     create_info.flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT;
     if (isExtensionEnabled(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME))
@@ -187,14 +244,109 @@ Context::Context(const wsi::Window &window) {
     create_info.device = *device_;
     create_info.instance = *instance_;
     create_info.pVulkanFunctions = &vma_vk_funcs;
+    create_info.pDeviceMemoryCallbacks = &device_memory_callbacks;
     allocator_ = vma::createAllocatorUnique(create_info);
     allocator_->setCurrentFrameIndex(current_frame_);
   }
+  // Create resource caches
+  descriptor_set_layout_cache_ = DescriptorSetLayoutCache(*device_, usesDescriptorBuffers());
+  shader_module_cache_ = ShaderModuleCache(*device_);
+  shader_permutation_cache_ = ShaderPermutationCache(*device_, pipeline_cache_dir / "shaders");
+  pipeline_layout_cache_ = PipelineLayoutCache(*device_);
+  // Create resource descriptor heaps and descriptor set allocator
+  {
+    const auto properties =
+        physical_device_
+            .getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceVulkan12Properties>()
+            .get<vk::PhysicalDeviceVulkan12Properties>();
+    // Heaps are visible to all stages, so per-stage limits apply as well
+    const auto storage_buffers =
+        std::min({heap_sizes.storage_buffers,
+                  properties.maxDescriptorSetUpdateAfterBindStorageBuffers,
+                  properties.maxPerStageDescriptorUpdateAfterBindStorageBuffers});
+    const auto storage_images =
+        std::min({heap_sizes.storage_images,
+                  properties.maxDescriptorSetUpdateAfterBindStorageImages,
+                  properties.maxPerStageDescriptorUpdateAfterBindStorageImages});
+    const auto sampled_images =
+        std::min({heap_sizes.sampled_images,
+                  properties.maxDescriptorSetUpdateAfterBindSampledImages,
+                  properties.maxPerStageDescriptorUpdateAfterBindSampledImages});
+    const auto samplers =
+        std::min({heap_sizes.samplers, properties.maxDescriptorSetUpdateAfterBindSamplers,
+                  properties.maxPerStageDescriptorUpdateAfterBindSamplers});
+    if (usesDescriptorBuffers()) {
+      // Context-wide set ranges and ranges of every frame
+      std::vector<vk::DeviceSize> resource_ranges{DescriptorSetAllocator::descriptor_buffer_range};
+      resource_ranges.resize(1 + frames_in_flight, Frame::descriptor_buffer_range);
+      std::vector<vk::DeviceSize> sampler_ranges{
+          DescriptorSetAllocator::sampler_descriptor_buffer_range};
+      sampler_ranges.resize(1 + frames_in_flight, Frame::sampler_descriptor_buffer_range);
+      const std::array descriptor_counts{
+          vk::DescriptorPoolSize{vk::DescriptorType::eStorageBuffer, storage_buffers},
+          vk::DescriptorPoolSize{vk::DescriptorType::eStorageImage, storage_images},
+          vk::DescriptorPoolSize{vk::DescriptorType::eSampledImage, sampled_images},
+          vk::DescriptorPoolSize{vk::DescriptorType::eSampler, samplers}};
+      descriptor_buffers_ = DescriptorBuffers(physical_device_, *device_, *allocator_,
+                                              descriptor_counts, resource_ranges, sampler_ranges);
+      pipeline_cache_ =
+          PipelineCache(physical_device_, *device_, pipeline_cache_dir, &descriptor_buffers_,
+                        supportsGraphicsPipelineLibrary());
+      storage_buffer_descriptor_heap_ = BufferDescriptorHeap(
+          *device_, descriptor_buffers_, vk::DescriptorType::eStorageBuffer, storage_buffers);
+      storage_image_descriptor_heap_ = ImageDescriptorHeap(
+          *device_, descriptor_buffers_, vk::DescriptorType::eStorageImage, storage_images);
+      sampled_image_descriptor_heap_ = ImageDescriptorHeap(
+          *device_, descriptor_buffers_, vk::DescriptorType::eSampledImage, sampled_images);
+      sampler_descriptor_heap_ = SamplerDescriptorHeap(*device_, descriptor_buffers_,
+                                                       vk::DescriptorType::eSampler, samplers);
+      descriptor_set_allocator_ = DescriptorSetAllocator(*device_, descriptor_buffers_);
+    } else {
+      pipeline_cache_ = PipelineCache(physical_device_, *device_, pipeline_cache_dir, nullptr,
+                                      supportsGraphicsPipelineLibrary());
+      storage_buffer_descriptor_heap_ =
+          BufferDescriptorHeap(*device_, vk::DescriptorType::eStorageBuffer, storage_buffers);
+      storage_image_descriptor_heap_ =
+          ImageDescriptorHeap(*device_, vk::DescriptorType::eStorageImage, storage_images);
+      sampled_image_descriptor_heap_ =
+          ImageDescriptorHeap(*device_, vk::DescriptorType::eSampledImage, sampled_images);
+      sampler_descriptor_heap_ =
+          SamplerDescriptorHeap(*device_, vk::DescriptorType::eSampler, samplers);
+      descriptor_set_allocator_ = DescriptorSetAllocator(*device_);
+    }
+    spdlog::info("[gfx] Descriptor heaps ({}): {} storage buffers, {} storage images, "
+                 "{} sampled images, {} samplers",
+                 usesDescriptorBuffers() ? "descriptor buffers" : "descriptor pools",
+                 storage_buffers, storage_images, sampled_images, samplers);
+  }
+  // Create memory telemetry
+  memory_telemetry_ = MemoryTelemetry(*allocator_);
+  memory_telemetry_.addThreshold(
+      0.9f, [](uint32_t heap_index, const VmaBudget &budget, bool exceeded) {
+        if (exceeded)
+          spdlog::warn("[gfx] Memory heap {} usage is close to budget: {} of {} bytes", heap_index,
+                       budget.usage, budget.budget);
+      });
+  // Create memory pools
+  memory_pools_ = MemoryPools(*allocator_);
+  // Create defragmenter
+  defragmenter_ = Defragmenter(*device_, queue_family_index_, 0, *allocator_);
   // Create staging buffer
-  staging_buffer_ = StagingBuffer(*device_, queue_family_index_, 0, *allocator_);
+  staging_buffer_ = StagingBuffer(*device_, queue_family_index_, 0, *allocator_, &job_system);
+  // Create geometry buffer, dedicated memory since it outgrows pool blocks
+  geometry_buffer_ = MegaBuffer(
+      *device_, queue_family_index_, 0, *allocator_, staging_buffer_,
+      vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eIndexBuffer |
+          vk::BufferUsageFlagBits::eStorageBuffer,
+      tagAllocation(
+          {VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE},
+          Subsystem::eScene),
+      "scene:geometry", physical_device_.getProperties().limits.minStorageBufferOffsetAlignment);
   // Create in-flight frames
   for (auto &frame : frames_)
-    frame = Frame(physical_device_, *device_, queue_family_index_, 0, *allocator_);
+    frame = Frame(physical_device_, *device_, queue_family_index_, 0, *allocator_,
+                  usesDescriptorBuffers() ? &descriptor_buffers_ : nullptr);
+  shader_reloader_ = ShaderReloader(*this, job_system);
 }
 
 bool Context::isExtensionEnabled(std::string_view name) const noexcept {
@@ -202,12 +354,88 @@ bool Context::isExtensionEnabled(std::string_view name) const noexcept {
          enabled_extensions_.end();
 }
 
+void Context::nextFrame() {
+  allocator_->setCurrentFrameIndex(++current_frame_);
+  // Frame slots are reused after their fence wait, so older frames have completed
+  const uint32_t completed_frames =
+      current_frame_ > frames_in_flight ? current_frame_ - frames_in_flight : 0;
+  storage_buffer_descriptor_heap_.nextFrame(current_frame_, completed_frames);
+  storage_image_descriptor_heap_.nextFrame(current_frame_, completed_frames);
+  sampled_image_descriptor_heap_.nextFrame(current_frame_, completed_frames);
+  sampler_descriptor_heap_.nextFrame(current_frame_, completed_frames);
+  geometry_buffer_.nextFrame(current_frame_, completed_frames);
+  memory_telemetry_.update();
+  memory_pools_.update();
+  staging_buffer_.trim();
+  pipeline_cache_.update(*job_system_);
+  shader_reloader_.update(current_frame_, completed_frames);
+  if (defragmenter_.isRunning()) {
+    defragmenter_.update();
+    // Moved resources rewrite their descriptors
+    flushDescriptorHeaps();
+  }
+}
+
+const ResourceDescriptorHeap &Context::getResourceDescriptorHeap(vk::DescriptorType type) const {
+  switch (type) {
+  case vk::DescriptorType::eStorageBuffer:
+    return storage_buffer_descriptor_heap_;
+  case vk::DescriptorType::eStorageImage:
+    return storage_image_descriptor_heap_;
+  case vk::DescriptorType::eSampledImage:
+    return sampled_image_descriptor_heap_;
+  case vk::DescriptorType::eSampler:
+    return sampler_descriptor_heap_;
+  default:
+    throw std::runtime_error("No descriptor heap of type " + vk::to_string(type));
+  }
+}
+
+RecordedPipeline Context::loadPipeline(const nlohmann::json &description) {
+  return RecordedPipeline(
+      description, pipeline_cache_, pipeline_layout_cache_, descriptor_set_layout_cache_,
+      shader_module_cache_,
+      [this](vk::DescriptorType type) -> const ResourceDescriptorHeap & {
+        return getResourceDescriptorHeap(type);
+      });
+}
+
+size_t Context::prewarmPipelines() {
+  ZoneScoped;
+  const auto descriptions = pipeline_cache_.getDatabase().getDescriptions();
+  if (descriptions.empty())
+    return 0;
+  const auto start = std::chrono::steady_clock::now();
+  // Shader modules and layouts come from caches that aren't thread-safe, so they are built here
+  // and only pipeline compilation is spread over workers
+  std::vector<RecordedPipeline> pipelines;
+  pipelines.reserve(descriptions.size());
+  for (const auto &description : descriptions) {
+    try {
+      pipelines.push_back(loadPipeline(description));
+    } catch (const std::exception &e) {
+      spdlog::warn("[gfx] Skipping recorded pipeline: {}", e.what());
+    }
+  }
+  // Pipelines are thrown away, compiling them is only meant to fill driver's pipeline cache
+  job_system_->parallelFor(pipelines.size(), [&](size_t i) {
+    ZoneScopedN("Prewarm pipeline");
+    pipelines[i].create();
+  });
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  spdlog::info("[gfx] Prewarmed {} pipelines in {:.1f} ms", pipelines.size(), elapsed.count());
+  return pipelines.size();
+}
+
 void Context::flush() {
+  flushDescriptorHeaps();
+  staging_buffer_.flush();
+}
+
+void Context::flushDescriptorHeaps() {
   storage_buffer_descriptor_heap_.flush();
   storage_image_descriptor_heap_.flush();
   sampled_image_descriptor_heap_.flush();
   sampler_descriptor_heap_.flush();
-
-  staging_buffer_.flush();
 }
 } // namespace gfx
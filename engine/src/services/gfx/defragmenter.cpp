@@ -0,0 +1,219 @@
+#include "services/gfx/defragmenter.hpp"
+
+#include <spdlog/spdlog.h>
+#include <tracy/Tracy.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+namespace gfx {
+static vk::ImageAspectFlags getAspectMask(vk::Format format) {
+  switch (format) {
+  case vk::Format::eD16Unorm:
+  case vk::Format::eX8D24UnormPack32:
+  case vk::Format::eD32Sfloat:
+    return vk::ImageAspectFlagBits::eDepth;
+  case vk::Format::eS8Uint:
+    return vk::ImageAspectFlagBits::eStencil;
+  case vk::Format::eD16UnormS8Uint:
+  case vk::Format::eD24UnormS8Uint:
+  case vk::Format::eD32SfloatS8Uint:
+    return vk::ImageAspectFlagBits::eDepth | vk::ImageAspectFlagBits::eStencil;
+  default:
+    return vk::ImageAspectFlagBits::eColor;
+  }
+}
+
+Defragmenter::Defragmenter(vk::Device device, uint32_t queue_family_index, uint32_t queue_index,
+                           vma::Allocator allocator)
+    : device_(device), queue_(device.getQueue(queue_family_index, queue_index)),
+      allocator_(allocator) {
+  pass_fence_ = device_.createFenceUnique({});
+  command_pool_ = device_.createCommandPoolUnique({{}, queue_family_index});
+  command_buffer_ = std::move(
+      device_.allocateCommandBuffersUnique({*command_pool_, vk::CommandBufferLevel::ePrimary, 1})
+          .front());
+}
+
+Defragmenter &Defragmenter::operator=(Defragmenter &&rhs) noexcept {
+  end();
+  device_ = rhs.device_;
+  queue_ = rhs.queue_;
+  pass_fence_ = std::move(rhs.pass_fence_);
+  command_buffer_ = std::move(rhs.command_buffer_);
+  command_pool_ = std::move(rhs.command_pool_);
+  allocator_ = rhs.allocator_;
+  context_ = std::exchange(rhs.context_, nullptr);
+  pending_ = std::move(rhs.pending_);
+  resources_ = std::move(rhs.resources_);
+  return *this;
+}
+
+void Defragmenter::registerBuffer(vma::Allocation allocation, vk::Buffer buffer,
+                                  const vk::BufferCreateInfo &create_info,
+                                  BufferCallback callback) {
+  assert(!create_info.pNext && create_info.sharingMode == vk::SharingMode::eExclusive);
+  resources_.insert_or_assign(allocation,
+                              BufferResource{buffer, create_info, std::move(callback)});
+}
+
+void Defragmenter::registerImage(vma::Allocation allocation, vk::Image image,
+                                 const vk::ImageCreateInfo &create_info, vk::ImageLayout layout,
+                                 ImageCallback callback) {
+  assert(!create_info.pNext && create_info.sharingMode == vk::SharingMode::eExclusive);
+  resources_.insert_or_assign(allocation,
+                              ImageResource{image, create_info, layout, std::move(callback)});
+}
+
+void Defragmenter::begin(vma::Pool pool, vk::DeviceSize max_bytes_per_pass) {
+  vma::DefragmentationInfo defragmentation_info{};
+  defragmentation_info.flags = VMA_DEFRAGMENTATION_FLAG_ALGORITHM_BALANCED_BIT;
+  defragmentation_info.pool = pool;
+  defragmentation_info.maxBytesPerPass = max_bytes_per_pass;
+  pending_.push_back(defragmentation_info);
+  if (!context_)
+    next();
+}
+
+void Defragmenter::end() noexcept {
+  pending_.clear();
+  try {
+    next();
+  } catch (const std::exception &e) {
+    context_ = nullptr;
+    spdlog::error("[gfx] Failed to end defragmentation: {}", e.what());
+  }
+}
+
+void Defragmenter::next() {
+  if (context_) {
+    auto stats = allocator_.endDefragmentation(std::exchange(context_, nullptr));
+    spdlog::info("[gfx] Defragmentation finished: {} bytes moved, {} bytes freed, {} "
+                 "allocations moved, {} device memory blocks freed",
+                 stats.bytesMoved, stats.bytesFreed, stats.allocationsMoved,
+                 stats.deviceMemoryBlocksFreed);
+  }
+  if (pending_.empty())
+    return;
+  context_ = allocator_.beginDefragmentation(pending_.front());
+  pending_.pop_front();
+  spdlog::info("[gfx] Defragmentation started");
+}
+
+void Defragmenter::update(std::chrono::microseconds time_budget) {
+  if (!context_)
+    return;
+  ZoneScoped;
+  const auto start = Clock::now();
+  do {
+    vma::DefragmentationPassMoveInfo pass_info{};
+    if (!allocator_.beginDefragmentationPass(context_, pass_info)) {
+      next();
+      continue;
+    }
+    executePass(pass_info);
+    if (!allocator_.endDefragmentationPass(context_, pass_info))
+      next();
+  } while (context_ && Clock::now() - start < time_budget);
+}
+
+void Defragmenter::executePass(vma::DefragmentationPassMoveInfo &pass_info) {
+  // Create new resources bound to destination memory and record copies into them
+  std::vector<std::pair<Resource *, std::variant<vk::Buffer, vk::Image>>> moves;
+  std::vector<vk::ImageMemoryBarrier2> pre_copy_barriers, post_copy_barriers;
+  command_buffer_->begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+  for (auto &move : std::span(pass_info.pMoves, pass_info.moveCount)) {
+    auto it = resources_.find(move.srcAllocation);
+    if (it == resources_.end()) {
+      move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+      continue;
+    }
+    if (auto *resource = std::get_if<BufferResource>(&it->second)) {
+      auto buffer = device_.createBuffer(resource->create_info);
+      allocator_.bindBufferMemory(move.dstTmpAllocation, buffer);
+      moves.emplace_back(&it->second, buffer);
+    } else if (auto *resource = std::get_if<ImageResource>(&it->second)) {
+      auto image = device_.createImage(resource->create_info);
+      allocator_.bindImageMemory(move.dstTmpAllocation, image);
+      moves.emplace_back(&it->second, image);
+      const vk::ImageSubresourceRange subresource_range{
+          getAspectMask(resource->create_info.format), 0, VK_REMAINING_MIP_LEVELS, 0,
+          VK_REMAINING_ARRAY_LAYERS};
+      pre_copy_barriers.emplace_back(
+          vk::PipelineStageFlagBits2::eAllCommands, vk::AccessFlagBits2::eNone,
+          vk::PipelineStageFlagBits2::eCopy, vk::AccessFlagBits2::eTransferRead, resource->layout,
+          vk::ImageLayout::eTransferSrcOptimal, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+          resource->image, subresource_range);
+      pre_copy_barriers.emplace_back(
+          vk::PipelineStageFlagBits2::eNone, vk::AccessFlagBits2::eNone,
+          vk::PipelineStageFlagBits2::eCopy, vk::AccessFlagBits2::eTransferWrite,
+          vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal,
+          VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image, subresource_range);
+      post_copy_barriers.emplace_back(
+          vk::PipelineStageFlagBits2::eCopy, vk::AccessFlagBits2::eTransferWrite,
+          vk::PipelineStageFlagBits2::eAllCommands, vk::AccessFlagBits2::eMemoryRead,
+          vk::ImageLayout::eTransferDstOptimal, resource->layout, VK_QUEUE_FAMILY_IGNORED,
+          VK_QUEUE_FAMILY_IGNORED, image, subresource_range);
+    }
+  }
+  if (moves.empty()) {
+    command_buffer_->end();
+    device_.resetCommandPool(*command_pool_);
+    return;
+  }
+  // Copies wait for all earlier work on the queue, so that their fence covers frames in flight
+  const vk::MemoryBarrier2 pre_copy_barrier{
+      vk::PipelineStageFlagBits2::eAllCommands, vk::AccessFlagBits2::eMemoryWrite,
+      vk::PipelineStageFlagBits2::eCopy, vk::AccessFlagBits2::eTransferRead};
+  command_buffer_->pipelineBarrier2(
+      {vk::DependencyFlags{}, pre_copy_barrier, {}, pre_copy_barriers});
+  for (const auto &[resource, handle] : moves) {
+    if (auto *buffer = std::get_if<BufferResource>(resource)) {
+      const vk::BufferCopy2 region{0, 0, buffer->create_info.size};
+      command_buffer_->copyBuffer2(
+          vk::CopyBufferInfo2{buffer->buffer, std::get<vk::Buffer>(handle), region});
+    } else if (auto *image = std::get_if<ImageResource>(resource)) {
+      const auto &create_info = image->create_info;
+      std::vector<vk::ImageCopy2> regions;
+      for (uint32_t level = 0; level < create_info.mipLevels; ++level) {
+        const vk::ImageSubresourceLayers subresource{getAspectMask(create_info.format), level, 0,
+                                                     create_info.arrayLayers};
+        regions.emplace_back(subresource, vk::Offset3D{}, subresource, vk::Offset3D{},
+                             vk::Extent3D{std::max(create_info.extent.width >> level, 1u),
+                                          std::max(create_info.extent.height >> level, 1u),
+                                          std::max(create_info.extent.depth >> level, 1u)});
+      }
+      command_buffer_->copyImage2(vk::CopyImageInfo2{
+          image->image, vk::ImageLayout::eTransferSrcOptimal, std::get<vk::Image>(handle),
+          vk::ImageLayout::eTransferDstOptimal, regions});
+    }
+  }
+  const vk::MemoryBarrier2 buffer_barrier{
+      vk::PipelineStageFlagBits2::eCopy, vk::AccessFlagBits2::eTransferWrite,
+      vk::PipelineStageFlagBits2::eAllCommands, vk::AccessFlagBits2::eMemoryRead};
+  command_buffer_->pipelineBarrier2(
+      {vk::DependencyFlags{}, buffer_barrier, {}, post_copy_barriers});
+  command_buffer_->end();
+  queue_.submit(vk::SubmitInfo{{}, {}, *command_buffer_}, *pass_fence_);
+  // Old resources are no longer referenced once the copies, and all work before them, are done
+  if (device_.waitForFences(*pass_fence_, VK_TRUE, UINT64_MAX) == vk::Result::eTimeout)
+    throw std::runtime_error("Unexpected defragmentation fence timeout");
+  device_.resetFences(*pass_fence_);
+  device_.resetCommandPool(*command_pool_);
+  // Let owners patch their references, then destroy old handles
+  for (auto &[resource, handle] : moves) {
+    if (auto *buffer = std::get_if<BufferResource>(resource)) {
+      auto new_buffer = std::get<vk::Buffer>(handle);
+      buffer->callback(new_buffer);
+      device_.destroyBuffer(std::exchange(buffer->buffer, new_buffer));
+    } else if (auto *image = std::get_if<ImageResource>(resource)) {
+      auto new_image = std::get<vk::Image>(handle);
+      image->callback(new_image);
+      device_.destroyImage(std::exchange(image->image, new_image));
+    }
+  }
+}
+} // namespace gfx
@@ -1,4 +1,9 @@
 #include "services/gfx/descriptors.hpp"
+#include "services/gfx/memory_tags.hpp"
+
+#include <cassert>
+#include <stdexcept>
+#include <utility>
 
 namespace gfx {
 static constexpr std::pair<vk::DescriptorType, float> descriptor_sizes[] = {
@@ -14,6 +19,255 @@ static constexpr std::pair<vk::DescriptorType, float> descriptor_sizes[] = {
     {vk::DescriptorType::eStorageBufferDynamic, 1.f},
     {vk::DescriptorType::eInputAttachment, 0.5f}};
 
+static vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+DescriptorBuffers::DescriptorBuffers(
+    vk::PhysicalDevice physical_device, vk::Device device, vma::Allocator allocator,
+    const vk::ArrayProxy<const vk::DescriptorPoolSize> &descriptor_counts,
+    const vk::ArrayProxy<const vk::DeviceSize> &resource_ranges,
+    const vk::ArrayProxy<const vk::DeviceSize> &sampler_ranges)
+    : device_(device) {
+  properties_ = physical_device
+                    .getProperties2<vk::PhysicalDeviceProperties2,
+                                    vk::PhysicalDeviceDescriptorBufferPropertiesEXT>()
+                    .get<vk::PhysicalDeviceDescriptorBufferPropertiesEXT>();
+  std::array<vk::DeviceSize, 2> sizes{};
+  for (auto range : resource_ranges)
+    sizes[resource_buffer_index] += range + properties_.descriptorBufferOffsetAlignment;
+  for (auto range : sampler_ranges)
+    sizes[sampler_buffer_index] += range + properties_.descriptorBufferOffsetAlignment;
+  for (const auto &count : descriptor_counts)
+    sizes[isSamplerType(count.type) ? sampler_buffer_index : resource_buffer_index] +=
+        count.descriptorCount * getDescriptorSize(count.type) +
+        properties_.descriptorBufferOffsetAlignment;
+  // Set offsets are relative to buffer start, so buffers are limited to the addressable range
+  sizes[resource_buffer_index] =
+      std::min(sizes[resource_buffer_index], properties_.maxResourceDescriptorBufferRange);
+  sizes[sampler_buffer_index] =
+      std::min(sizes[sampler_buffer_index], properties_.maxSamplerDescriptorBufferRange);
+  const std::array<std::pair<vk::BufferUsageFlags, const char *>, 2> buffer_descs = {
+      std::pair{vk::BufferUsageFlags{vk::BufferUsageFlagBits::eResourceDescriptorBufferEXT},
+                "descriptors:resources"},
+      std::pair{vk::BufferUsageFlags{vk::BufferUsageFlagBits::eSamplerDescriptorBufferEXT},
+                "descriptors:samplers"}};
+  vma::AllocationCreateInfo alloc_info{VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                                           VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                                       VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE};
+  // Descriptors are written without explicit flushes
+  alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  for (size_t i = 0; i < storages_.size(); ++i) {
+    auto &storage = storages_[i];
+    const auto &[usage, name] = buffer_descs[i];
+    storage.buffer = allocator.createBufferUnique(
+        {{}, sizes[i], usage | vk::BufferUsageFlagBits::eShaderDeviceAddress},
+        tagAllocation(alloc_info, Subsystem::eRenderer), name);
+    storage.address = device_.getBufferAddress({storage.buffer->getBuffer()});
+    storage.data = static_cast<std::byte *>(
+        allocator.getAllocationInfo(storage.buffer->getAllocation()).pMappedData);
+    storage.size = sizes[i];
+  }
+}
+
+size_t DescriptorBuffers::getDescriptorSize(vk::DescriptorType type) const noexcept {
+  switch (type) {
+  case vk::DescriptorType::eSampler:
+    return properties_.samplerDescriptorSize;
+  case vk::DescriptorType::eCombinedImageSampler:
+    return properties_.combinedImageSamplerDescriptorSize;
+  case vk::DescriptorType::eSampledImage:
+    return properties_.sampledImageDescriptorSize;
+  case vk::DescriptorType::eStorageImage:
+    return properties_.storageImageDescriptorSize;
+  case vk::DescriptorType::eUniformTexelBuffer:
+    return properties_.uniformTexelBufferDescriptorSize;
+  case vk::DescriptorType::eStorageTexelBuffer:
+    return properties_.storageTexelBufferDescriptorSize;
+  case vk::DescriptorType::eUniformBuffer:
+    return properties_.uniformBufferDescriptorSize;
+  case vk::DescriptorType::eStorageBuffer:
+    return properties_.storageBufferDescriptorSize;
+  case vk::DescriptorType::eInputAttachment:
+    return properties_.inputAttachmentDescriptorSize;
+  default:
+    return 0;
+  }
+}
+
+DescriptorBuffers::Range DescriptorBuffers::reserve(vk::DeviceSize size, bool samplers) {
+  const uint32_t index = samplers ? sampler_buffer_index : resource_buffer_index;
+  auto &storage = storages_[index];
+  const auto offset = alignUp(storage.used, properties_.descriptorBufferOffsetAlignment);
+  if (offset + size > storage.size)
+    throw std::runtime_error("Descriptor buffer exhausted");
+  storage.used = offset + size;
+  return {index, offset, size, storage.data + offset};
+}
+
+void DescriptorBuffers::write(std::byte *dst, vk::DescriptorType type,
+                              const vk::DescriptorImageInfo *image_info,
+                              const vk::DescriptorBufferInfo *buffer_info) const {
+  vk::DescriptorGetInfoEXT get_info{type};
+  vk::DescriptorAddressInfoEXT address_info{};
+  switch (type) {
+  case vk::DescriptorType::eSampler:
+    get_info.data.pSampler = &image_info->sampler;
+    break;
+  case vk::DescriptorType::eCombinedImageSampler:
+    get_info.data.pCombinedImageSampler = image_info;
+    break;
+  case vk::DescriptorType::eSampledImage:
+    get_info.data.pSampledImage = image_info;
+    break;
+  case vk::DescriptorType::eStorageImage:
+    get_info.data.pStorageImage = image_info;
+    break;
+  case vk::DescriptorType::eInputAttachment:
+    get_info.data.pInputAttachmentImage = image_info;
+    break;
+  case vk::DescriptorType::eUniformBuffer:
+  case vk::DescriptorType::eStorageBuffer:
+    if (buffer_info->range == VK_WHOLE_SIZE)
+      throw std::runtime_error("Buffer descriptor range has to be explicit");
+    address_info.address = device_.getBufferAddress({buffer_info->buffer}) + buffer_info->offset;
+    address_info.range = buffer_info->range;
+    if (type == vk::DescriptorType::eUniformBuffer)
+      get_info.data.pUniformBuffer = &address_info;
+    else
+      get_info.data.pStorageBuffer = &address_info;
+    break;
+  default:
+    throw std::runtime_error("Descriptor type not supported with descriptor buffers");
+  }
+  device_.getDescriptorEXT(get_info, getDescriptorSize(type), dst);
+}
+
+void DescriptorBuffers::bind(vk::CommandBuffer cmd_buf) const {
+  const std::array binding_infos{
+      vk::DescriptorBufferBindingInfoEXT{storages_[resource_buffer_index].address,
+                                         vk::BufferUsageFlagBits::eResourceDescriptorBufferEXT},
+      vk::DescriptorBufferBindingInfoEXT{storages_[sampler_buffer_index].address,
+                                         vk::BufferUsageFlagBits::eSamplerDescriptorBufferEXT}};
+  cmd_buf.bindDescriptorBuffersEXT(binding_infos);
+}
+
+DescriptorSetLayoutKey::DescriptorSetLayoutKey(
+    vk::DescriptorSetLayoutCreateFlags flags,
+    const vk::ArrayProxy<const vk::DescriptorSetLayoutBinding> &bindings)
+    : flags(flags), bindings(bindings.begin(), bindings.end()) {
+  std::sort(this->bindings.begin(), this->bindings.end(),
+            [](const vk::DescriptorSetLayoutBinding &lhs,
+               const vk::DescriptorSetLayoutBinding &rhs) { return lhs.binding < rhs.binding; });
+  for (uint32_t i = 0; i < this->bindings.size(); ++i) {
+    auto &binding = this->bindings[i];
+    if (!binding.pImmutableSamplers)
+      continue;
+    immutable_sampler_bindings.push_back(i);
+    immutable_samplers.insert(immutable_samplers.end(), binding.pImmutableSamplers,
+                              binding.pImmutableSamplers + binding.descriptorCount);
+    binding.pImmutableSamplers = nullptr;
+  }
+}
+
+size_t DescriptorSetLayoutKey::Hash::operator()(const DescriptorSetLayoutKey &key) const noexcept {
+  size_t seed = 0;
+  vme::hashCombine(seed, key.flags);
+  for (const auto &binding : key.bindings)
+    vme::hashCombine(seed, binding);
+  for (auto index : key.immutable_sampler_bindings)
+    vme::hashCombine(seed, index);
+  for (auto sampler : key.immutable_samplers)
+    vme::hashCombine(seed, sampler);
+  return seed;
+}
+
+// Has to match hash of the owning key built from the same bindings
+size_t
+DescriptorSetLayoutKey::Hash::operator()(const DescriptorSetLayoutKeyView &key) const noexcept {
+  size_t seed = 0;
+  vme::hashCombine(seed, key.flags);
+  for (auto binding : key.bindings) {
+    binding.pImmutableSamplers = nullptr;
+    vme::hashCombine(seed, binding);
+  }
+  for (uint32_t i = 0; i < key.bindings.size(); ++i)
+    if (key.bindings[i].pImmutableSamplers)
+      vme::hashCombine(seed, i);
+  for (const auto &binding : key.bindings)
+    if (binding.pImmutableSamplers)
+      for (uint32_t i = 0; i < binding.descriptorCount; ++i)
+        vme::hashCombine(seed, binding.pImmutableSamplers[i]);
+  return seed;
+}
+
+bool DescriptorSetLayoutKey::Equal::operator()(
+    const DescriptorSetLayoutKey &lhs, const DescriptorSetLayoutKeyView &rhs) const noexcept {
+  if (lhs.flags != rhs.flags || lhs.bindings.size() != rhs.bindings.size())
+    return false;
+  size_t sampler_binding = 0;
+  const auto *samplers = lhs.immutable_samplers.data();
+  for (uint32_t i = 0; i < rhs.bindings.size(); ++i) {
+    auto binding = rhs.bindings[i];
+    const auto *immutable_samplers = std::exchange(binding.pImmutableSamplers, nullptr);
+    if (binding != lhs.bindings[i])
+      return false;
+    if (!immutable_samplers)
+      continue;
+    if (sampler_binding == lhs.immutable_sampler_bindings.size() ||
+        lhs.immutable_sampler_bindings[sampler_binding++] != i ||
+        !std::equal(immutable_samplers, immutable_samplers + binding.descriptorCount, samplers))
+      return false;
+    samplers += binding.descriptorCount;
+  }
+  return sampler_binding == lhs.immutable_sampler_bindings.size();
+}
+
+vk::UniqueDescriptorSetLayout DescriptorSetLayoutCache::create(const DescriptorSetLayoutKey &key) {
+  auto bindings = key.bindings;
+  const auto *immutable_samplers = key.immutable_samplers.data();
+  for (auto index : key.immutable_sampler_bindings) {
+    bindings[index].pImmutableSamplers = immutable_samplers;
+    immutable_samplers += bindings[index].descriptorCount;
+  }
+  auto flags = key.flags;
+  // Pipeline layouts can't mix descriptor buffer layouts with others, push descriptor layouts
+  // included. Context only keeps push descriptors when they need no push descriptor buffer
+  if (descriptor_buffers_)
+    flags |= vk::DescriptorSetLayoutCreateFlagBits::eDescriptorBufferEXT;
+  return device_.createDescriptorSetLayoutUnique({flags, bindings});
+}
+
+vk::DescriptorUpdateTemplate DescriptorSetLayoutCache::getUpdateTemplate(
+    vk::DescriptorSetLayout layout,
+    const vk::ArrayProxy<const vk::DescriptorSetLayoutBinding> &bindings) {
+  auto &update_template = update_templates_[layout];
+  if (update_template)
+    return *update_template;
+  vme::SmallVector<vk::DescriptorUpdateTemplateEntry, 8> entries;
+  size_t offset = 0;
+  for (const auto &binding : bindings) {
+    if (!binding.descriptorCount)
+      continue;
+    entries.emplace_back(binding.binding, 0, binding.descriptorCount, binding.descriptorType,
+                         offset, sizeof(DescriptorData));
+    offset += binding.descriptorCount * sizeof(DescriptorData);
+  }
+  update_template = device_.createDescriptorUpdateTemplateUnique(
+      {{}, static_cast<uint32_t>(entries.size()), entries.data(),
+       vk::DescriptorUpdateTemplateType::eDescriptorSet, layout});
+  return *update_template;
+}
+
+DescriptorSetAllocator::DescriptorSetAllocator(vk::Device device,
+                                               DescriptorBuffers &descriptor_buffers,
+                                               vk::DeviceSize range, vk::DeviceSize sampler_range)
+    : device_(device), descriptor_buffers_(&descriptor_buffers) {
+  ranges_[DescriptorBuffers::resource_buffer_index] = descriptor_buffers.reserve(range, false);
+  ranges_[DescriptorBuffers::sampler_buffer_index] =
+      descriptor_buffers.reserve(sampler_range, true);
+}
+
 vk::DescriptorPool DescriptorSetAllocator::getPool(unsigned size) {
   if (free_pools_.empty()) {
     std::vector<vk::DescriptorPoolSize> pool_sizes;
@@ -29,9 +283,57 @@ vk::DescriptorPool DescriptorSetAllocator::getPool(unsigned size) {
   return *used_pools_.back();
 }
 
-vk::DescriptorSet
+DescriptorSet
 DescriptorSetAllocator::allocate(const vk::DescriptorSetLayout &descriptor_layout,
                                  const vk::ArrayProxy<const vk::WriteDescriptorSet> &bindings) {
+  if (descriptor_buffers_) {
+    // Sets live in a linear range of the buffer matching their descriptor types
+    const auto sampler_count =
+        std::count_if(bindings.begin(), bindings.end(), [](const vk::WriteDescriptorSet &write) {
+          return DescriptorBuffers::isSamplerType(write.descriptorType);
+        });
+    if (sampler_count && sampler_count != static_cast<ptrdiff_t>(bindings.size()))
+      throw std::runtime_error("Descriptor set mixes samplers and resources");
+    const uint32_t index = sampler_count ? DescriptorBuffers::sampler_buffer_index
+                                         : DescriptorBuffers::resource_buffer_index;
+    const auto &range = ranges_[index];
+    const auto offset = alignUp(used_[index], descriptor_buffers_->getOffsetAlignment());
+    const auto size = descriptor_buffers_->getLayoutSize(descriptor_layout);
+    if (offset + size > range.size)
+      throw std::runtime_error("Descriptor set range exhausted");
+    used_[index] = offset + size;
+    for (const auto &write : bindings) {
+      const auto descriptor_size = descriptor_buffers_->getDescriptorSize(write.descriptorType);
+      auto *dst = range.data + offset +
+                  descriptor_buffers_->getBindingOffset(descriptor_layout, write.dstBinding) +
+                  write.dstArrayElement * descriptor_size;
+      for (uint32_t i = 0; i < write.descriptorCount; ++i, dst += descriptor_size)
+        descriptor_buffers_->write(dst, write.descriptorType,
+                                   write.pImageInfo ? write.pImageInfo + i : nullptr,
+                                   write.pBufferInfo ? write.pBufferInfo + i : nullptr);
+    }
+    return {{}, index, range.offset + offset};
+  }
+  const auto descriptor_set = allocateSet(descriptor_layout);
+  vme::SmallVector<vk::WriteDescriptorSet, 8> writes(bindings.begin(), bindings.end());
+  for (auto &write : writes) {
+    assert(!write.dstSet);
+    write.dstSet = descriptor_set;
+  }
+  device_.updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  return {descriptor_set};
+}
+
+DescriptorSet DescriptorSetAllocator::allocate(const vk::DescriptorSetLayout &descriptor_layout,
+                                               vk::DescriptorUpdateTemplate update_template,
+                                               const void *data) {
+  assert(!descriptor_buffers_);
+  const auto descriptor_set = allocateSet(descriptor_layout);
+  device_.updateDescriptorSetWithTemplate(descriptor_set, update_template, data);
+  return {descriptor_set};
+}
+
+vk::DescriptorSet DescriptorSetAllocator::allocateSet(vk::DescriptorSetLayout descriptor_layout) {
   vk::DescriptorSet descriptor_set{};
   if (!current_pool_)
     current_pool_ = getPool();
@@ -41,16 +343,11 @@ DescriptorSetAllocator::allocate(const vk::DescriptorSetLayout &descriptor_layou
     alloc_info.descriptorPool = current_pool_ = getPool();
     result = device_.allocateDescriptorSets(&alloc_info, &descriptor_set);
   }
-  std::vector<vk::WriteDescriptorSet> writes(bindings.begin(), bindings.end());
-  for (auto &write : writes) {
-    assert(!write.dstSet);
-    write.dstSet = descriptor_set;
-  }
-  device_.updateDescriptorSets(writes, {});
   return descriptor_set;
 }
 
 void DescriptorSetAllocator::reset() {
+  used_ = {};
   for (const auto &pool : used_pools_)
     device_.resetDescriptorPool(*pool);
   free_pools_.insert(free_pools_.end(), std::make_move_iterator(used_pools_.begin()),
@@ -59,7 +356,23 @@ void DescriptorSetAllocator::reset() {
   current_pool_ = nullptr;
 }
 
-vk::DescriptorSet DescriptorSetBuilder::build() {
-  return descriptor_allocator_->allocate(DescriptorSetLayoutBuilder::build(), bindings_);
+DescriptorSet DescriptorSetBuilder::build() {
+  resolveBufferInfos();
+  const auto layout = DescriptorSetLayoutBuilder::build();
+  if (descriptor_allocator_->usesDescriptorBuffers())
+    return descriptor_allocator_->allocate(
+        layout, {static_cast<uint32_t>(bindings_.size()), bindings_.data()});
+  // Template expects descriptors in binding order
+  std::stable_sort(bindings_.begin(), bindings_.end(), [](const auto &lhs, const auto &rhs) {
+    return lhs.dstBinding < rhs.dstBinding;
+  });
+  vme::SmallVector<DescriptorData, 16> data;
+  for (const auto &write : bindings_)
+    for (uint32_t i = 0; i < write.descriptorCount; ++i)
+      if (write.pImageInfo)
+        data.emplace_back(write.pImageInfo[i]);
+      else
+        data.emplace_back(write.pBufferInfo[i]);
+  return descriptor_allocator_->allocate(layout, buildUpdateTemplate(layout), data.data());
 }
 } // namespace gfx
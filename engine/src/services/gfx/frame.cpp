@@ -1,4 +1,5 @@
 #include "services/gfx/frame.hpp"
+#include "services/gfx/memory_tags.hpp"
 
 namespace gfx {
 TransientAllocator::TransientAllocator(vma::Allocator allocator) : allocator_(allocator) {
@@ -11,6 +12,7 @@ TransientAllocator::TransientAllocator(vma::Allocator allocator) : allocator_(al
   pool_info.flags =
       VMA_POOL_CREATE_LINEAR_ALGORITHM_BIT | VMA_POOL_CREATE_IGNORE_BUFFER_IMAGE_GRANULARITY_BIT;
   pool_ = allocator_.createPoolUnique(pool_info);
+  allocator_.setPoolName(*pool_, "Transient");
 }
 
 std::pair<vk::Buffer, void *> TransientAllocator::createBuffer(vk::BufferUsageFlags usage,
@@ -19,13 +21,15 @@ std::pair<vk::Buffer, void *> TransientAllocator::createBuffer(vk::BufferUsageFl
   allocation_info.flags =
       VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
   allocation_info.pool = *pool_;
-  buffers_.push_back(allocator_.createBufferUnique({{}, size, usage}, allocation_info));
+  // Only tagged, naming would copy strings every frame
+  buffers_.push_back(allocator_.createBufferUnique(
+      {{}, size, usage}, tagAllocation(allocation_info, Subsystem::eFrame)));
   const auto &buffer = buffers_.back();
   return {buffer->getBuffer(), allocator_.getAllocationInfo(buffer->getAllocation()).pMappedData};
 }
 
 Frame::Frame(vk::PhysicalDevice physical_device, vk::Device device, uint32_t queue_family_index,
-             uint32_t queue_index, vma::Allocator allocator)
+             uint32_t queue_index, vma::Allocator allocator, DescriptorBuffers *descriptor_buffers)
     : device_(device), queue_(device.getQueue(queue_family_index, queue_index)),
       transient_allocator_(allocator) {
   image_available_ = device_.createSemaphoreUnique({});
@@ -37,6 +41,11 @@ Frame::Frame(vk::PhysicalDevice physical_device, vk::Device device, uint32_t que
       device_.allocateCommandBuffersUnique({*command_pool_, vk::CommandBufferLevel::ePrimary, 1})
           .front());
   tracy_vk_ctx_ = UniqueTracyVkCtx(physical_device, device, queue_, *command_buffer_);
+  descriptor_set_allocator_ =
+      descriptor_buffers ? DescriptorSetAllocator(device_, *descriptor_buffers,
+                                                  descriptor_buffer_range,
+                                                  sampler_descriptor_buffer_range)
+                         : DescriptorSetAllocator(device_);
 }
 
 void Frame::submit() const {
@@ -54,5 +63,6 @@ void Frame::reset() {
   device_.resetFences({*render_fence_});
   device_.resetCommandPool(*command_pool_);
   transient_allocator_.reset();
+  descriptor_set_allocator_.reset();
 }
 } // namespace gfx
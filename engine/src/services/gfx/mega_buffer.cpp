@@ -0,0 +1,171 @@
+#include "services/gfx/mega_buffer.hpp"
+#include "services/gfx/staging_buffer.hpp"
+
+#include <spdlog/spdlog.h>
+#include <tracy/Tracy.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <utility>
+
+namespace gfx {
+// Growth steps are kept aligned, so that alignment inside each virtual block is absolute
+static constexpr vk::DeviceSize size_granularity = 64 * 1024;
+
+static vk::DeviceSize alignSize(vk::DeviceSize size) {
+  return (size + size_granularity - 1) / size_granularity * size_granularity;
+}
+
+MegaBuffer::MegaBuffer(vk::Device device, uint32_t queue_family_index, uint32_t queue_index,
+                       vma::Allocator allocator, StagingBuffer &staging_buffer,
+                       vk::BufferUsageFlags usage, const vma::AllocationCreateInfo &alloc_info,
+                       const char *name, vk::DeviceSize storage_alignment, vk::DeviceSize size)
+    : device_(device), queue_(device.getQueue(queue_family_index, queue_index)),
+      allocator_(allocator), staging_buffer_(&staging_buffer), usage_(usage),
+      alloc_info_(alloc_info), name_(name), storage_alignment_(storage_alignment) {
+  command_pool_ = device_.createCommandPoolUnique({{}, queue_family_index});
+  command_buffer_ = std::move(
+      device_.allocateCommandBuffersUnique({*command_pool_, vk::CommandBufferLevel::ePrimary, 1})
+          .front());
+  fence_ = device_.createFenceUnique({vk::FenceCreateFlagBits::eSignaled});
+  size_ = alignSize(size);
+  buffer_ = createBuffer(size_);
+  device_address_ = device_.getBufferAddress({buffer_->getBuffer()});
+  addBlock(0, size_);
+}
+
+MegaBuffer &MegaBuffer::operator=(MegaBuffer &&rhs) noexcept {
+  if (this == &rhs)
+    return *this;
+  // Virtual blocks must be empty when they are destroyed
+  releaseFreed(UINT32_MAX);
+  device_ = rhs.device_;
+  queue_ = rhs.queue_;
+  command_pool_ = std::move(rhs.command_pool_);
+  command_buffer_ = std::move(rhs.command_buffer_);
+  fence_ = std::move(rhs.fence_);
+  allocator_ = rhs.allocator_;
+  staging_buffer_ = rhs.staging_buffer_;
+  usage_ = rhs.usage_;
+  alloc_info_ = rhs.alloc_info_;
+  name_ = std::move(rhs.name_);
+  storage_alignment_ = rhs.storage_alignment_;
+  buffer_ = std::move(rhs.buffer_);
+  device_address_ = rhs.device_address_;
+  size_ = rhs.size_;
+  generation_ = rhs.generation_;
+  current_frame_ = rhs.current_frame_;
+  retired_ = std::move(rhs.retired_);
+  freed_ = std::exchange(rhs.freed_, {});
+  blocks_ = std::move(rhs.blocks_);
+  return *this;
+}
+
+MegaBuffer::~MegaBuffer() { releaseFreed(UINT32_MAX); }
+
+VmaStatistics MegaBuffer::getStatistics() const noexcept {
+  VmaStatistics statistics{};
+  for (const auto &[offset, block] : blocks_) {
+    const auto block_statistics = block->getStatistics();
+    statistics.blockCount += block_statistics.blockCount;
+    statistics.allocationCount += block_statistics.allocationCount;
+    statistics.blockBytes += block_statistics.blockBytes;
+    statistics.allocationBytes += block_statistics.allocationBytes;
+  }
+  return statistics;
+}
+
+MegaBuffer::Allocation MegaBuffer::allocate(vk::DeviceSize size, vk::DeviceSize alignment) {
+  assert(alignment <= size_granularity);
+  VmaVirtualAllocationCreateInfo alloc_info{};
+  alloc_info.size = size;
+  alloc_info.alignment = alignment;
+  auto tryAllocate = [&](uint32_t index) -> Allocation {
+    vk::DeviceSize offset;
+    auto &[base, block] = blocks_[index];
+    if (auto allocation = block->allocate(alloc_info, offset))
+      return {index, allocation, base + offset, size};
+    return {};
+  };
+  for (uint32_t i = 0; i < blocks_.size(); ++i)
+    if (auto allocation = tryAllocate(i))
+      return allocation;
+  grow(size);
+  auto allocation = tryAllocate(static_cast<uint32_t>(blocks_.size() - 1));
+  if (!allocation)
+    throw std::runtime_error("Mega buffer allocation failed");
+  return allocation;
+}
+
+void MegaBuffer::free(const Allocation &allocation) noexcept {
+  if (allocation)
+    freed_.emplace_back(current_frame_, allocation);
+}
+
+void MegaBuffer::nextFrame(uint32_t frame, uint32_t completed_frames) noexcept {
+  current_frame_ = frame;
+  while (!retired_.empty() && retired_.front().first < completed_frames)
+    retired_.pop_front();
+  releaseFreed(completed_frames);
+}
+
+vma::UniqueBuffer MegaBuffer::createBuffer(vk::DeviceSize size) {
+  return allocator_.createBufferUnique({{},
+                                        size,
+                                        usage_ | vk::BufferUsageFlagBits::eTransferSrc |
+                                            vk::BufferUsageFlagBits::eTransferDst |
+                                            vk::BufferUsageFlagBits::eShaderDeviceAddress},
+                                       alloc_info_, name_.c_str());
+}
+
+void MegaBuffer::addBlock(vk::DeviceSize offset, vk::DeviceSize size) {
+  VmaVirtualBlockCreateInfo create_info{};
+  create_info.size = size;
+  blocks_.emplace_back(offset, vma::createVirtualBlockUnique(create_info));
+}
+
+void MegaBuffer::grow(vk::DeviceSize min_size) {
+  ZoneScoped;
+  // Pending uploads target current buffer, so they have to land before its contents are copied
+  staging_buffer_->flush();
+  const auto old_size = size_;
+  const auto new_size = alignSize(std::max(old_size * 2, old_size + min_size));
+  auto buffer = createBuffer(new_size);
+  // Only previous growth copy is waited for, not the whole queue
+  if (device_.waitForFences(*fence_, VK_TRUE, UINT64_MAX) != vk::Result::eSuccess)
+    throw std::runtime_error("Mega buffer copy wait failed");
+  device_.resetFences(*fence_);
+  device_.resetCommandPool(*command_pool_);
+  command_buffer_->begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+  const vk::MemoryBarrier2 pre_copy_barrier{
+      vk::PipelineStageFlagBits2::eAllCommands, vk::AccessFlagBits2::eMemoryWrite,
+      vk::PipelineStageFlagBits2::eCopy, vk::AccessFlagBits2::eTransferRead};
+  command_buffer_->pipelineBarrier2({vk::DependencyFlags{}, pre_copy_barrier, {}, {}});
+  const vk::BufferCopy2 region{0, 0, old_size};
+  command_buffer_->copyBuffer2(
+      vk::CopyBufferInfo2{buffer_->getBuffer(), buffer->getBuffer(), region});
+  const vk::MemoryBarrier2 post_copy_barrier{
+      vk::PipelineStageFlagBits2::eCopy, vk::AccessFlagBits2::eTransferWrite,
+      vk::PipelineStageFlagBits2::eAllCommands,
+      vk::AccessFlagBits2::eMemoryRead | vk::AccessFlagBits2::eMemoryWrite};
+  command_buffer_->pipelineBarrier2({vk::DependencyFlags{}, post_copy_barrier, {}, {}});
+  command_buffer_->end();
+  queue_.submit(vk::SubmitInfo{{}, {}, *command_buffer_}, *fence_);
+  // Frames in flight and commands recorded in current frame may still reference old buffer
+  retired_.emplace_back(current_frame_, std::exchange(buffer_, std::move(buffer)));
+  device_address_ = device_.getBufferAddress({buffer_->getBuffer()});
+  size_ = new_size;
+  ++generation_;
+  addBlock(old_size, new_size - old_size);
+  spdlog::info("[gfx] Mega buffer {} grown to {} bytes", name_, size_);
+}
+
+void MegaBuffer::releaseFreed(uint32_t completed_frames) noexcept {
+  while (!freed_.empty() && freed_.front().first < completed_frames) {
+    const auto &allocation = freed_.front().second;
+    blocks_[allocation.block].second->free(allocation.allocation);
+    freed_.pop_front();
+  }
+}
+} // namespace gfx
@@ -0,0 +1,86 @@
+#include "services/gfx/memory_pools.hpp"
+
+#include <tracy/Tracy.hpp>
+
+namespace gfx {
+namespace {
+struct PoolDesc {
+  const char *name;
+  // Representative resource used to select memory type
+  vk::ImageCreateInfo image_info;
+  VmaAllocationCreateFlags alloc_flags;
+};
+
+vk::ImageCreateInfo getImageInfo(vk::Format format, vk::ImageUsageFlags usage) {
+  return {{},
+          vk::ImageType::e2D,
+          format,
+          vk::Extent3D{1024, 1024, 1},
+          1,
+          1,
+          vk::SampleCountFlagBits::e1,
+          vk::ImageTiling::eOptimal,
+          usage};
+}
+
+// Blocks are sized by VMA, which starts small and grows them with the pool
+const PoolDesc pool_descs[MemoryPools::class_count] = {
+    // Depth formats may be restricted to other memory types than color formats
+    {"Depth targets",
+     getImageInfo(vk::Format::eD32Sfloat, vk::ImageUsageFlagBits::eDepthStencilAttachment), 0},
+    {"Textures",
+     getImageInfo(vk::Format::eR8G8B8A8Unorm, vk::ImageUsageFlagBits::eSampled |
+                                                  vk::ImageUsageFlagBits::eTransferSrc |
+                                                  vk::ImageUsageFlagBits::eTransferDst),
+     0}};
+} // namespace
+
+MemoryPools::MemoryPools(vma::Allocator allocator)
+    : allocator_(allocator), device_(allocator.getInfo().device) {
+  for (size_t i = 0; i < class_count; ++i) {
+    const auto &desc = pool_descs[i];
+    const vma::AllocationCreateInfo alloc_info{desc.alloc_flags, VMA_MEMORY_USAGE_AUTO};
+    vma::PoolCreateInfo pool_info{};
+    pool_info.memoryTypeIndex =
+        allocator_.findMemoryTypeIndexForImageInfo(desc.image_info, alloc_info);
+    memory_type_indices_[i] = pool_info.memoryTypeIndex;
+    pools_[i] = allocator_.createPoolUnique(pool_info);
+    allocator_.setPoolName(*pools_[i], desc.name);
+    alloc_infos_[i] = alloc_info;
+    alloc_infos_[i].pool = *pools_[i];
+    usage_plot_names_[i] = std::string(desc.name) + " pool usage";
+    block_plot_names_[i] = std::string(desc.name) + " pool blocks";
+  }
+}
+
+const char *MemoryPools::getName(ResourceClass resource_class) noexcept {
+  return pool_descs[static_cast<size_t>(resource_class)].name;
+}
+
+vma::AllocationCreateInfo
+MemoryPools::getAllocationCreateInfo(ResourceClass resource_class) const noexcept {
+  return alloc_infos_[static_cast<size_t>(resource_class)];
+}
+
+vma::AllocationCreateInfo
+MemoryPools::getAllocationCreateInfo(ResourceClass resource_class,
+                                     const vk::ImageCreateInfo &image_info) const {
+  auto alloc_info = getAllocationCreateInfo(resource_class);
+  // Formats and usages may be restricted to other memory types than the representative image
+  const auto memory_type_bits =
+      device_.getImageMemoryRequirements(vk::DeviceImageMemoryRequirements{&image_info})
+          .memoryRequirements.memoryTypeBits;
+  if (!(memory_type_bits & (1u << memory_type_indices_[static_cast<size_t>(resource_class)])))
+    alloc_info.pool = {};
+  return alloc_info;
+}
+
+void MemoryPools::update() {
+  ZoneScoped;
+  for (size_t i = 0; i < class_count; ++i) {
+    const auto statistics = allocator_.getPoolStatistics(*pools_[i]);
+    TracyPlot(usage_plot_names_[i].c_str(), static_cast<int64_t>(statistics.allocationBytes));
+    TracyPlot(block_plot_names_[i].c_str(), static_cast<int64_t>(statistics.blockBytes));
+  }
+}
+} // namespace gfx
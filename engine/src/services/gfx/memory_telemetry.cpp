@@ -0,0 +1,111 @@
+#include "services/gfx/memory_telemetry.hpp"
+#include "services/gfx/memory_tags.hpp"
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include <tracy/Tracy.hpp>
+
+#include <fstream>
+#include <map>
+#include <string>
+
+namespace gfx {
+namespace {
+struct Usage {
+  uint64_t bytes = 0;
+  uint64_t count = 0;
+};
+
+using SubsystemUsage = std::map<std::string, std::map<std::string, Usage>>;
+
+// Detailed VMA statistics list allocations of every block and dedicated allocations, with user
+// data printed as a pointer
+void addUsage(const nlohmann::json &json, SubsystemUsage &usage) {
+  if (!json.is_structured())
+    return;
+  for (const auto &[key, value] : json.items()) {
+    if ((key != "Suballocations" && key != "DedicatedAllocations") || !value.is_array()) {
+      addUsage(value, usage);
+      continue;
+    }
+    for (const auto &allocation : value) {
+      if (allocation.value("Type", "FREE") == "FREE")
+        continue;
+      const auto user_data = allocation.value("CustomData", "0");
+      const auto subsystem = static_cast<Subsystem>(std::stoull(user_data, nullptr, 16));
+      auto &name_usage = usage[getSubsystemName(subsystem)][allocation.value("Name", "unnamed")];
+      name_usage.bytes += allocation.value("Size", uint64_t{0});
+      ++name_usage.count;
+    }
+  }
+}
+} // namespace
+
+MemoryTelemetry::MemoryTelemetry(vma::Allocator allocator) : allocator_(allocator) {
+  const auto heap_count = allocator_.getMemoryProperties().memoryHeapCount;
+  budgets_.resize(heap_count);
+  for (uint32_t i = 0; i < heap_count; ++i) {
+    const std::string heap_name =
+        (isDeviceLocal(i) ? "VRAM heap " : "System heap ") + std::to_string(i);
+    usage_plot_names_.push_back(heap_name + " usage");
+    budget_plot_names_.push_back(heap_name + " budget");
+  }
+}
+
+bool MemoryTelemetry::isDeviceLocal(uint32_t heap_index) const noexcept {
+  return allocator_.getMemoryProperties().memoryHeaps[heap_index].flags &
+         VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+}
+
+void MemoryTelemetry::addThreshold(float ratio, Callback callback) {
+  thresholds_.push_back({ratio, std::move(callback), std::vector<bool>(budgets_.size())});
+}
+
+void MemoryTelemetry::update() {
+  ZoneScoped;
+  allocator_.getHeapBudgets(budgets_.data());
+  for (uint32_t i = 0; i < budgets_.size(); ++i) {
+    const auto &budget = budgets_[i];
+    TracyPlot(usage_plot_names_[i].c_str(), static_cast<int64_t>(budget.usage));
+    TracyPlot(budget_plot_names_[i].c_str(), static_cast<int64_t>(budget.budget));
+    for (auto &threshold : thresholds_) {
+      const bool exceeded = budget.usage > threshold.ratio * budget.budget;
+      if (exceeded == threshold.exceeded[i])
+        continue;
+      threshold.exceeded[i] = exceeded;
+      threshold.callback(i, budget, exceeded);
+    }
+  }
+}
+
+void MemoryTelemetry::dumpStatistics(const std::filesystem::path &path) const {
+  ZoneScoped;
+  const auto stats_string = allocator_.buildStatsString(true);
+  {
+    spdlog::info("[gfx] Saving memory statistics to {}", path.string());
+    std::ofstream f(path, std::ios::out);
+    f << stats_string;
+  }
+  // Tags are aggregated from the dump, so that allocations aren't tracked while running
+  SubsystemUsage usage;
+  addUsage(nlohmann::json::parse(stats_string), usage);
+  nlohmann::json tags = nlohmann::json::object();
+  for (const auto &[subsystem, names] : usage) {
+    auto &subsystem_json = tags[subsystem];
+    Usage total;
+    for (const auto &[name, name_usage] : names) {
+      subsystem_json["Allocations"][name] = {{"Bytes", name_usage.bytes},
+                                             {"Count", name_usage.count}};
+      total.bytes += name_usage.bytes;
+      total.count += name_usage.count;
+    }
+    subsystem_json["Bytes"] = total.bytes;
+    subsystem_json["Count"] = total.count;
+  }
+  auto tags_path = path;
+  tags_path.replace_extension(".tags.json");
+  spdlog::info("[gfx] Saving memory usage by tag to {}", tags_path.string());
+  std::ofstream f(tags_path, std::ios::out);
+  f << tags.dump(2);
+}
+} // namespace gfx
@@ -1,14 +1,20 @@
 #include "services/gfx/pipelines.hpp"
 
+#include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
+#include <tracy/Tracy.hpp>
 
 #include <algorithm>
+#include <array>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <utility>
 
 namespace gfx {
-static const std::filesystem::path cache_path =
-    std::filesystem::current_path() / "shader_cache.bin";
 
 template <typename Key, typename Value>
 std::vector<Value> getFlattenedVector(const std::unordered_map<Key, Value> &map) {
@@ -26,6 +32,10 @@ PipelineLayoutBuilder &PipelineLayoutBuilder::shaderStage(const ShaderModule &sh
   }
   if (auto push_constant_range = shader_module.getPushConstantRange())
     push_constant_ranges_.push_back(*push_constant_range);
+  if (shader_module.getSourceName().empty())
+    recordable_ = false;
+  else
+    shader_names_.push_back(shader_module.getSourceName());
   return *this;
 }
 
@@ -58,24 +68,290 @@ vk::PipelineLayout PipelineLayoutBuilder::build() {
     DescriptorSetLayoutBindings merged_bindigns{};
     if (auto it = descriptor_set_layouts_.find(id); it != descriptor_set_layouts_.end())
       merged_bindigns = mergeDescriptorSetLayoutBindings(it->second);
-    merged_descriptor_set_layouts[id] = *descriptor_set_layout_cache_->get({{}, merged_bindigns});
+    const auto flags = push_descriptor_sets_.contains(id)
+                           ? vk::DescriptorSetLayoutCreateFlagBits::ePushDescriptorKHR
+                           : vk::DescriptorSetLayoutCreateFlags{};
+    merged_descriptor_set_layouts[id] =
+        *descriptor_set_layout_cache_->get(DescriptorSetLayoutKey(flags, merged_bindigns));
   }
-
-  return *pipeline_layout_cache_->get({{}, merged_descriptor_set_layouts, push_constant_ranges_});
+  auto push_constant_ranges = push_constant_ranges_;
+  std::sort(push_constant_ranges.begin(), push_constant_ranges.end());
+  return *pipeline_layout_cache_->get(
+      {{}, std::move(merged_descriptor_set_layouts), std::move(push_constant_ranges)});
 };
 
-PipelineCache::PipelineCache(vk::Device device) : device_(device) {
-  spdlog::info("[gfx] Loading shader cache from {}", cache_path.string());
-  std::ifstream f(cache_path, std::ios::in | std::ios::binary);
-  std::vector<char> cache_data{std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+// Enums and flags are stored as integers, state structs as flat arrays of their members
+template <typename T> static auto toJson(const T &value) {
+  if constexpr (std::is_enum_v<T>)
+    return static_cast<std::underlying_type_t<T>>(value);
+  else if constexpr (requires { typename T::MaskType; })
+    return static_cast<typename T::MaskType>(value);
+  else
+    return value;
+}
+
+template <typename T> static void fromJson(const nlohmann::json &json, T &value) {
+  if constexpr (std::is_enum_v<T>)
+    value = static_cast<T>(json.get<std::underlying_type_t<T>>());
+  else if constexpr (requires { typename T::MaskType; })
+    value = T(json.get<typename T::MaskType>());
+  else
+    value = json.get<T>();
+}
+
+template <typename... Ts> static nlohmann::json pack(const Ts &...values) {
+  return nlohmann::json::array({nlohmann::json(toJson(values))...});
+}
+
+template <typename... Ts> static void unpack(const nlohmann::json &json, Ts &...values) {
+  size_t i = 0;
+  (fromJson(json.at(i++), values), ...);
+}
+
+// Containers are sorted, so that equal pipelines always have equal descriptions
+nlohmann::json PipelineLayoutBuilder::describeLayout() const {
+  auto shaders = shader_names_;
+  std::sort(shaders.begin(), shaders.end());
+  std::vector<nlohmann::json> heaps;
+  for (const auto &[id, type] : std::map(resource_descriptor_heap_types_.begin(),
+                                         resource_descriptor_heap_types_.end()))
+    heaps.push_back(pack(id, type));
+  std::vector push_descriptor_sets(push_descriptor_sets_.begin(), push_descriptor_sets_.end());
+  std::sort(push_descriptor_sets.begin(), push_descriptor_sets.end());
+  return {{"shaders", shaders},
+          {"heaps", heaps},
+          {"push_descriptor_sets", push_descriptor_sets}};
+}
+
+size_t PipelineLayoutBuilder::hashLayout() const {
+  // Sorted like the description, so that order of builder calls doesn't matter
+  vme::SmallVector<const std::string *, 4> shaders;
+  for (const auto &name : shader_names_)
+    shaders.push_back(&name);
+  std::sort(shaders.begin(), shaders.end(), [](auto *lhs, auto *rhs) { return *lhs < *rhs; });
+  vme::SmallVector<std::pair<uint32_t, vk::DescriptorType>, 4> heaps(
+      resource_descriptor_heap_types_.begin(), resource_descriptor_heap_types_.end());
+  std::sort(heaps.begin(), heaps.end());
+  vme::SmallVector<uint32_t, 4> push_descriptor_sets(push_descriptor_sets_.begin(),
+                                                     push_descriptor_sets_.end());
+  std::sort(push_descriptor_sets.begin(), push_descriptor_sets.end());
+  size_t seed = 0;
+  for (const auto *name : shaders)
+    vme::hashCombine(seed, *name);
+  vme::hashCombine(seed, heaps.size());
+  for (const auto &[id, type] : heaps) {
+    vme::hashCombine(seed, id);
+    vme::hashCombine(seed, type);
+  }
+  vme::hashCombine(seed, push_descriptor_sets.size());
+  for (auto id : push_descriptor_sets)
+    vme::hashCombine(seed, id);
+  return seed;
+}
+
+template <typename Builder>
+static void loadLayout(Builder &builder, const nlohmann::json &description,
+                       ShaderModuleCache &shader_module_cache,
+                       const ResourceDescriptorHeapLookup &get_heap) {
+  for (const auto &name : description.at("shaders"))
+    builder.shaderStage(shader_module_cache.get(name.get<std::string>()));
+  for (const auto &heap : description.at("heaps")) {
+    uint32_t id;
+    vk::DescriptorType type;
+    unpack(heap, id, type);
+    builder.resourceDescriptorHeap(id, get_heap(type));
+  }
+  for (const auto &id : description.at("push_descriptor_sets"))
+    builder.pushDescriptorSet(id.get<uint32_t>());
+}
+
+static constexpr int database_version = 1;
+
+PipelineDatabase::PipelineDatabase(const std::filesystem::path &path) : path_(path) {
+  std::ifstream f(path_);
+  if (!f)
+    return;
+  try {
+    const auto database = nlohmann::json::parse(f);
+    if (database.at("version").get<int>() != database_version) {
+      spdlog::warn("[gfx] Pipeline database {} has unsupported version, ignoring it",
+                   path_.string());
+      return;
+    }
+    for (const auto &description : database.at("pipelines"))
+      descriptions_.insert(description.dump());
+  } catch (const nlohmann::json::exception &e) {
+    spdlog::warn("[gfx] Failed to parse pipeline database {}: {}", path_.string(), e.what());
+    descriptions_.clear();
+    return;
+  }
+  spdlog::info("[gfx] Loaded {} pipeline descriptions from {}", descriptions_.size(),
+               path_.string());
+}
+
+std::vector<nlohmann::json> PipelineDatabase::getDescriptions() const {
+  std::lock_guard lock(*mutex_);
+  std::vector<nlohmann::json> descriptions;
+  descriptions.reserve(descriptions_.size());
+  for (const auto &description : descriptions_)
+    descriptions.push_back(nlohmann::json::parse(description));
+  return descriptions;
+}
+
+void PipelineDatabase::record(const nlohmann::json &description) {
+  auto key = description.dump();
+  std::lock_guard lock(*mutex_);
+  if (descriptions_.insert(std::move(key)).second)
+    dirty_->store(true, std::memory_order_relaxed);
+}
+
+std::string PipelineDatabase::dump() {
+  std::vector<std::string> descriptions;
+  {
+    std::lock_guard lock(*mutex_);
+    dirty_->store(false, std::memory_order_relaxed);
+    descriptions.assign(descriptions_.begin(), descriptions_.end());
+  }
+  std::sort(descriptions.begin(), descriptions.end());
+  auto pipelines = nlohmann::json::array();
+  for (const auto &description : descriptions)
+    pipelines.push_back(nlohmann::json::parse(description));
+  return nlohmann::json{{"version", database_version}, {"pipelines", pipelines}}.dump(1);
+}
+
+static std::string getCacheFileName(const vk::PhysicalDeviceProperties &properties) {
+  static constexpr char digits[] = "0123456789abcdef";
+  std::string name;
+  for (auto byte : properties.pipelineCacheUUID) {
+    name += digits[byte >> 4];
+    name += digits[byte & 0xf];
+  }
+  return name + "_" + std::to_string(properties.vendorID) + "_" +
+         std::to_string(properties.deviceID) + "_" + std::to_string(properties.driverVersion) +
+         ".bin";
+}
+
+// Drivers are expected to reject foreign data, but not all of them do
+static bool isCacheDataValid(const std::vector<char> &data,
+                             const vk::PhysicalDeviceProperties &properties) {
+  VkPipelineCacheHeaderVersionOne header;
+  if (data.size() < sizeof(header))
+    return false;
+  std::memcpy(&header, data.data(), sizeof(header));
+  return header.headerSize >= sizeof(header) && header.headerSize <= data.size() &&
+         header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         header.vendorID == properties.vendorID && header.deviceID == properties.deviceID &&
+         std::equal(properties.pipelineCacheUUID.begin(), properties.pipelineCacheUUID.end(),
+                    header.pipelineCacheUUID);
+}
+
+static std::vector<char> readCacheFile(const std::filesystem::path &path,
+                                       const vk::PhysicalDeviceProperties &properties) {
+  std::ifstream f(path, std::ios::in | std::ios::binary | std::ios::ate);
+  if (!f)
+    return {};
+  std::vector<char> data(static_cast<size_t>(f.tellg()));
+  f.seekg(0);
+  if (!f.read(data.data(), static_cast<std::streamsize>(data.size()))) {
+    spdlog::warn("[gfx] Failed to read pipeline cache {}", path.string());
+    return {};
+  }
+  if (!isCacheDataValid(data, properties)) {
+    spdlog::warn("[gfx] Pipeline cache {} doesn't match device, ignoring it", path.string());
+    return {};
+  }
+  return data;
+}
+
+// Written to temporary file first, so that a crash never leaves truncated file behind
+static bool writeFile(const std::filesystem::path &path, const void *data, size_t size) {
+  std::error_code error;
+  std::filesystem::create_directories(path.parent_path(), error);
+  auto temp_path = path;
+  temp_path += ".tmp";
+  std::ofstream f(temp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+  f.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+  f.close();
+  if (f.fail()) {
+    spdlog::warn("[gfx] Failed to write {}", temp_path.string());
+    return false;
+  }
+  std::filesystem::rename(temp_path, path, error);
+  if (error) {
+    spdlog::warn("[gfx] Failed to replace {}: {}", path.string(), error.message());
+    return false;
+  }
+  return true;
+}
+
+static void writeCacheFile(vk::Device device, vk::PipelineCache pipeline_cache,
+                           const std::filesystem::path &path) {
+  ZoneScoped;
+  const auto data = device.getPipelineCacheData(pipeline_cache);
+  if (writeFile(path, data.data(), data.size()))
+    spdlog::info("[gfx] Saved {} bytes of pipeline cache to {}", data.size(), path.string());
+}
+
+void PipelineDatabase::save(const std::filesystem::path &path, const std::string &data) {
+  ZoneScoped;
+  if (!path.empty())
+    writeFile(path, data.data(), data.size());
+}
+
+PipelineCache::PipelineCache(vk::PhysicalDevice physical_device, vk::Device device,
+                             const std::filesystem::path &directory,
+                             const DescriptorBuffers *descriptor_buffers, bool use_libraries)
+    : device_(device), descriptor_buffers_(descriptor_buffers), use_libraries_(use_libraries),
+      database_(directory / "pipelines.json") {
+  const auto properties = physical_device.getProperties();
+  path_ = directory / getCacheFileName(properties);
+  spdlog::info("[gfx] Loading pipeline cache from {}", path_.string());
+  const auto cache_data = readCacheFile(path_, properties);
   pipeline_cache_ = device_.createPipelineCacheUnique({{}, cache_data.size(), cache_data.data()});
 }
 
-void PipelineCache::save() const {
-  spdlog::info("[gfx] Saving shader cache to {}", cache_path.string());
-  std::vector<uint8_t> data{device_.getPipelineCacheData(*pipeline_cache_)};
-  std::ofstream f(cache_path, std::ios::out | std::ios::binary);
-  std::copy(data.begin(), data.end(), std::ostreambuf_iterator<char>(f));
+PipelineCache::~PipelineCache() {
+  if (save_future_.valid())
+    save_future_.wait();
+}
+
+void PipelineCache::update(vme::JobSystem &job_system) {
+  const auto created_count = created_count_->load(std::memory_order_relaxed);
+  if (!created_count)
+    return;
+  if (save_future_.valid()) {
+    if (save_future_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      return;
+    save_future_.get();
+  }
+  const auto now = std::chrono::steady_clock::now();
+  if (created_count < save_burst_size && now - last_save_ < save_interval)
+    return;
+  created_count_->fetch_sub(created_count, std::memory_order_relaxed);
+  last_save_ = now;
+  std::string database;
+  if (database_.isDirty())
+    database = database_.dump();
+  save_future_ = job_system.submit([device = device_, pipeline_cache = *pipeline_cache_,
+                                    path = path_, database_path = database_.getPath(),
+                                    database = std::move(database)]() {
+    writeCacheFile(device, pipeline_cache, path);
+    if (!database.empty())
+      PipelineDatabase::save(database_path, database);
+  });
+}
+
+void PipelineCache::save() {
+  if (save_future_.valid())
+    save_future_.get();
+  if (database_.isDirty())
+    database_.save();
+  const auto statistics = getStatistics();
+  spdlog::info("[gfx] Shared pipelines: {} hits, {} misses", statistics.hits, statistics.misses);
+  if (!created_count_->exchange(0, std::memory_order_relaxed))
+    return;
+  last_save_ = std::chrono::steady_clock::now();
+  writeCacheFile(device_, *pipeline_cache_, path_);
 }
 
 static vk::UniquePipeline getPipelineResult(vk::ResultValue<vk::UniquePipeline> &&result) {
@@ -84,37 +360,252 @@ static vk::UniquePipeline getPipelineResult(vk::ResultValue<vk::UniquePipeline>
   return std::move(result.value);
 }
 
-vk::UniquePipeline PipelineCache::create(const vk::ComputePipelineCreateInfo &create_info) const {
+PipelineCache::SharedPipeline
+PipelineCache::getLibrary(const std::string &key,
+                          const std::function<vk::UniquePipeline()> &create_library) {
+  {
+    std::lock_guard lock(*mutex_);
+    if (auto it = libraries_.find(key); it != libraries_.end())
+      return it->second;
+  }
+  // Compiled without holding the lock, library compiled meanwhile by another thread wins
+  auto library = std::make_shared<vk::UniquePipeline>(create_library());
+  std::lock_guard lock(*mutex_);
+  return libraries_.try_emplace(key, std::move(library)).first->second;
+}
+
+PipelineCache::SharedPipeline PipelineCache::findLibrary(const std::string &key) {
+  std::lock_guard lock(*mutex_);
+  auto it = libraries_.find(key);
+  return it != libraries_.end() ? it->second : nullptr;
+}
+
+static bool usesAnyShader(const nlohmann::json &description,
+                          const std::unordered_set<std::string> &shader_names) {
+  const auto it = description.find("shaders");
+  return it != description.end() &&
+         std::any_of(it->begin(), it->end(), [&](const nlohmann::json &name) {
+           return shader_names.contains(name.get<std::string>());
+         });
+}
+
+void PipelineCache::dropLibraries(const std::unordered_set<std::string> &shader_names) {
+  std::lock_guard lock(*mutex_);
+  std::erase_if(libraries_, [&](const auto &library) {
+    return usesAnyShader(nlohmann::json::parse(library.first), shader_names);
+  });
+}
+
+PipelineCache::SharedPipeline PipelineCache::getShared(
+    size_t key, vk::PipelineLayout layout,
+    const std::function<std::pair<vk::UniquePipeline, std::string>()> &create_pipeline) {
+  {
+    std::lock_guard lock(*mutex_);
+    if (auto it = shared_pipelines_.find(key);
+        it != shared_pipelines_.end() && it->second.layout == layout)
+      if (auto pipeline = it->second.pipeline.lock()) {
+        hits_->fetch_add(1, std::memory_order_relaxed);
+        return pipeline;
+      }
+  }
+  misses_->fetch_add(1, std::memory_order_relaxed);
+  auto [created, description] = create_pipeline();
+  auto pipeline = std::make_shared<vk::UniquePipeline>(std::move(created));
+  std::lock_guard lock(*mutex_);
+  std::erase_if(shared_pipelines_, [](const auto &shared_pipeline) {
+    return shared_pipeline.second.pipeline.expired();
+  });
+  auto &entry = shared_pipelines_[key];
+  // Same pipeline may have been compiled meanwhile by another thread
+  if (auto existing = entry.pipeline.lock(); existing && entry.layout == layout)
+    return existing;
+  entry = {pipeline, layout, std::move(description)};
+  return pipeline;
+}
+
+std::vector<PipelineCache::SharedPipelineInfo>
+PipelineCache::getSharedPipelines(const std::unordered_set<std::string> &shader_names) {
+  std::lock_guard lock(*mutex_);
+  std::vector<SharedPipelineInfo> pipelines;
+  for (const auto &[key, entry] : shared_pipelines_)
+    if (auto pipeline = entry.pipeline.lock())
+      if (usesAnyShader(nlohmann::json::parse(entry.description), shader_names))
+        pipelines.push_back({entry.description, entry.layout, std::move(pipeline)});
+  return pipelines;
+}
+
+vk::UniquePipeline PipelineCache::create(vk::ComputePipelineCreateInfo create_info) const {
+  if (descriptor_buffers_)
+    create_info.flags |= vk::PipelineCreateFlagBits::eDescriptorBufferEXT;
+  created_count_->fetch_add(1, std::memory_order_relaxed);
   return getPipelineResult(device_.createComputePipelineUnique(*pipeline_cache_, create_info));
 }
-vk::UniquePipeline PipelineCache::create(const vk::GraphicsPipelineCreateInfo &create_info) const {
+vk::UniquePipeline PipelineCache::create(vk::GraphicsPipelineCreateInfo create_info) const {
+  if (descriptor_buffers_)
+    create_info.flags |= vk::PipelineCreateFlagBits::eDescriptorBufferEXT;
+  created_count_->fetch_add(1, std::memory_order_relaxed);
   return getPipelineResult(device_.createGraphicsPipelineUnique(*pipeline_cache_, create_info));
 }
 
+void AsyncPipeline::finish() noexcept {
+  if (!future_.valid())
+    return;
+  future_.wait();
+  try {
+    future_.get();
+  } catch (const std::exception &e) {
+    spdlog::error("[gfx] Discarded pipeline failed to compile: {}", e.what());
+  }
+}
+
 vk::UniquePipeline ComputePipelineBuilder::create(vk::PipelineLayout pipeline_layout) {
+  if (recordable_)
+    return create(pipeline_layout, describe());
   return pipeline_cache_->create(vk::ComputePipelineCreateInfo{
       {}, shader_stages_[vk::ShaderStageFlagBits::eCompute], pipeline_layout});
 }
 
+vk::UniquePipeline ComputePipelineBuilder::create(vk::PipelineLayout pipeline_layout,
+                                                  const nlohmann::json &description) {
+  pipeline_cache_->getDatabase().record(description);
+  return pipeline_cache_->create(vk::ComputePipelineCreateInfo{
+      {}, shader_stages_[vk::ShaderStageFlagBits::eCompute], pipeline_layout});
+}
+
+size_t ComputePipelineBuilder::hashState() const {
+  auto seed = hashLayout();
+  vme::hashCombine(seed, bind_point);
+  return seed;
+}
+
+// Pipelines that aren't described by content aren't shared
+PipelineCache::SharedPipeline
+ComputePipelineBuilder::createShared(vk::PipelineLayout pipeline_layout) {
+  if (!recordable_)
+    return std::make_shared<vk::UniquePipeline>(create(pipeline_layout));
+  return pipeline_cache_->getShared(hashState(), pipeline_layout, [&] {
+    const auto description = describe();
+    return std::pair{create(pipeline_layout, description), description.dump()};
+  });
+}
+
+nlohmann::json ComputePipelineBuilder::describe() const {
+  auto description = describeLayout();
+  description["type"] = "compute";
+  return description;
+}
+
+ComputePipelineBuilder &ComputePipelineBuilder::load(const nlohmann::json &description,
+                                                     ShaderModuleCache &shader_module_cache,
+                                                     const ResourceDescriptorHeapLookup &get_heap) {
+  loadLayout(*this, description, shader_module_cache, get_heap);
+  return *this;
+}
+
 vk::UniquePipeline GraphicsPipelineBuilder::create(vk::PipelineLayout pipeline_layout) {
-  std::vector<vk::PipelineShaderStageCreateInfo> shader_stages = getFlattenedVector(shader_stages_);
+  if (!recordable_)
+    return createPipeline(pipeline_layout);
+  return create(pipeline_layout, describe());
+}
+
+vk::UniquePipeline GraphicsPipelineBuilder::create(vk::PipelineLayout pipeline_layout,
+                                                   const nlohmann::json &description) {
+  pipeline_cache_->getDatabase().record(description);
+  if (usesLibraries())
+    return link(pipeline_layout, description, true);
+  return createPipeline(pipeline_layout);
+}
+
+PipelineCache::SharedPipeline
+GraphicsPipelineBuilder::createShared(vk::PipelineLayout pipeline_layout) {
+  if (!recordable_)
+    return std::make_shared<vk::UniquePipeline>(create(pipeline_layout));
+  return pipeline_cache_->getShared(hashState(), pipeline_layout, [&] {
+    const auto description = describe();
+    return std::pair{create(pipeline_layout, description), description.dump()};
+  });
+}
+
+size_t GraphicsPipelineBuilder::hashState() const {
+  auto seed = hashLayout();
+  vme::hashCombine(seed, bind_point);
+  vme::hashCombine(seed, vertex_bindings_.size());
+  for (const auto &binding : vertex_bindings_)
+    vme::hashCombine(seed, binding);
+  vme::hashCombine(seed, vertex_attributes_.size());
+  for (const auto &attribute : vertex_attributes_)
+    vme::hashCombine(seed, attribute);
+  vme::hashCombine(seed, input_assembly_state_);
+  vme::hashCombine(seed, tesselation_state_);
+  vme::hashCombine(seed, viewports_.size());
+  for (const auto &viewport : viewports_)
+    vme::hashCombine(seed, viewport);
+  vme::hashCombine(seed, scissors_.size());
+  for (const auto &scissor : scissors_)
+    vme::hashCombine(seed, scissor);
+  vme::hashCombine(seed, rasterization_state_);
+  vme::hashCombine(seed, multisample_state_);
+  vme::hashCombine(seed, depth_stencil_state_);
+  vme::hashCombine(seed, logic_op_enable_);
+  vme::hashCombine(seed, logic_op_);
+  for (auto blend_constant : blend_constants_)
+    vme::hashCombine(seed, blend_constant);
+  vme::hashCombine(seed, blend_states_.size());
+  for (const auto &blend_state : blend_states_)
+    vme::hashCombine(seed, blend_state);
+  vme::SmallVector<vk::DynamicState, 8> dynamic_states(dynamic_states_.begin(),
+                                                       dynamic_states_.end());
+  std::sort(dynamic_states.begin(), dynamic_states.end());
+  vme::hashCombine(seed, dynamic_states.size());
+  for (auto dynamic_state : dynamic_states)
+    vme::hashCombine(seed, dynamic_state);
+  vme::hashCombine(seed, color_attachments_.size());
+  for (auto format : color_attachments_)
+    vme::hashCombine(seed, format);
+  vme::hashCombine(seed, depth_attachment_);
+  vme::hashCombine(seed, stencil_attachment_);
+  return seed;
+}
+
+vk::UniquePipeline GraphicsPipelineBuilder::createFastLinked(vk::PipelineLayout pipeline_layout) {
+  if (!usesLibraries())
+    return {};
+  return link(pipeline_layout, describe(), false);
+}
+
+static vk::GraphicsPipelineLibraryFlagsEXT getLibraryState(vk::ShaderStageFlagBits stage) {
+  return stage == vk::ShaderStageFlagBits::eFragment
+             ? vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentShader
+             : vk::GraphicsPipelineLibraryFlagBitsEXT::ePreRasterizationShaders;
+}
+
+vk::UniquePipeline
+GraphicsPipelineBuilder::createPipeline(vk::PipelineLayout pipeline_layout,
+                                        vk::GraphicsPipelineLibraryFlagsEXT library) {
+  // Libraries get only the shader stages of their own state, other state is ignored by them
+  std::vector<vk::PipelineShaderStageCreateInfo> shader_stages;
+  for (const auto &[stage, shader_stage] : shader_stages_)
+    if (!library || (library & getLibraryState(stage)))
+      shader_stages.push_back(shader_stage);
   vk::PipelineVertexInputStateCreateInfo vertex_input_state{
       {}, vertex_bindings_, vertex_attributes_};
+  auto viewports = viewports_;
   if (dynamic_states_.contains(vk::DynamicState::eViewport)) {
-    assert(viewports_.empty());
-    viewports_.emplace_back();
+    assert(viewports.empty());
+    viewports.emplace_back();
   }
+  auto scissors = scissors_;
   if (dynamic_states_.contains(vk::DynamicState::eScissor)) {
-    assert(scissors_.empty());
-    scissors_.emplace_back();
+    assert(scissors.empty());
+    scissors.emplace_back();
   }
-  vk::PipelineViewportStateCreateInfo viewport_state{{}, viewports_, scissors_};
+  vk::PipelineViewportStateCreateInfo viewport_state{{}, viewports, scissors};
   vk::PipelineColorBlendStateCreateInfo color_blend_state{
       {}, logic_op_enable_, logic_op_, blend_states_, blend_constants_};
   std::vector<vk::DynamicState> dynamic_states(dynamic_states_.begin(), dynamic_states_.end());
   vk::PipelineDynamicStateCreateInfo dynamic_state{{}, dynamic_states};
 
-  return pipeline_cache_->create(vk::StructureChain{
+  vk::StructureChain create_info{
       vk::GraphicsPipelineCreateInfo{{},
                                      shader_stages,
                                      &vertex_input_state,
@@ -127,8 +618,215 @@ vk::UniquePipeline GraphicsPipelineBuilder::create(vk::PipelineLayout pipeline_l
                                      &color_blend_state,
                                      &dynamic_state,
                                      pipeline_layout},
-      vk::PipelineRenderingCreateInfo{
-          0, color_attachments_, depth_attachment_,
-          stencil_attachment_}}.get());
+      vk::PipelineRenderingCreateInfo{0, color_attachments_, depth_attachment_,
+                                      stencil_attachment_},
+      vk::GraphicsPipelineLibraryCreateInfoEXT{library}};
+  if (library)
+    create_info.get<vk::GraphicsPipelineCreateInfo>().flags =
+        vk::PipelineCreateFlagBits::eLibraryKHR |
+        vk::PipelineCreateFlagBits::eRetainLinkTimeOptimizationInfoEXT;
+  else
+    create_info.unlink<vk::GraphicsPipelineLibraryCreateInfoEXT>();
+  return pipeline_cache_->create(create_info.get());
+}
+
+// Description fields each library depends on. Layout is shared by all libraries, so shaders and
+// heaps it's built from are part of both shader library keys
+static const std::array<std::pair<vk::GraphicsPipelineLibraryFlagBitsEXT,
+                                  std::vector<const char *>>,
+                        4>
+    library_fields = {{
+        {vk::GraphicsPipelineLibraryFlagBitsEXT::eVertexInputInterface,
+         {"vertex_bindings", "vertex_attributes", "input_assembly", "dynamic_states"}},
+        {vk::GraphicsPipelineLibraryFlagBitsEXT::ePreRasterizationShaders,
+         {"shaders", "heaps", "push_descriptor_sets", "tesselation", "viewports", "scissors",
+          "rasterization", "dynamic_states"}},
+        {vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentShader,
+         {"shaders", "heaps", "push_descriptor_sets", "multisample", "depth_stencil",
+          "stencil_front", "stencil_back", "dynamic_states"}},
+        {vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentOutputInterface,
+         {"color_blend", "blend_states", "multisample", "color_attachments", "depth_attachment",
+          "stencil_attachment", "dynamic_states"}},
+    }};
+
+vk::UniquePipeline GraphicsPipelineBuilder::link(vk::PipelineLayout pipeline_layout,
+                                                 const nlohmann::json &description,
+                                                 bool optimize) {
+  ZoneScoped;
+  std::array<PipelineCache::SharedPipeline, library_fields.size()> shared_libraries;
+  std::array<vk::Pipeline, library_fields.size()> libraries;
+  for (size_t i = 0; i < library_fields.size(); ++i) {
+    const auto &[library, fields] = library_fields[i];
+    nlohmann::json key{{"library", toJson(library)}};
+    for (const auto *field : fields)
+      key[field] = description.at(field);
+    if (optimize)
+      shared_libraries[i] = pipeline_cache_->getLibrary(
+          key.dump(), [&, library = library] { return createPipeline(pipeline_layout, library); });
+    else if (!(shared_libraries[i] = pipeline_cache_->findLibrary(key.dump())))
+      return {};
+    libraries[i] = **shared_libraries[i];
+  }
+  vk::StructureChain create_info{
+      vk::GraphicsPipelineCreateInfo{}.setLayout(pipeline_layout),
+      vk::PipelineLibraryCreateInfoKHR{libraries}};
+  if (optimize)
+    create_info.get<vk::GraphicsPipelineCreateInfo>().flags =
+        vk::PipelineCreateFlagBits::eLinkTimeOptimizationEXT;
+  return pipeline_cache_->create(create_info.get());
+}
+
+static nlohmann::json packStencilOp(const vk::StencilOpState &state) {
+  return pack(state.failOp, state.passOp, state.depthFailOp, state.compareOp, state.compareMask,
+              state.writeMask, state.reference);
+}
+
+static void unpackStencilOp(const nlohmann::json &json, vk::StencilOpState &state) {
+  unpack(json, state.failOp, state.passOp, state.depthFailOp, state.compareOp, state.compareMask,
+         state.writeMask, state.reference);
+}
+
+nlohmann::json GraphicsPipelineBuilder::describe() const {
+  auto description = describeLayout();
+  description["type"] = "graphics";
+  auto &vertex_bindings = description["vertex_bindings"] = nlohmann::json::array();
+  for (const auto &binding : vertex_bindings_)
+    vertex_bindings.push_back(pack(binding.binding, binding.stride, binding.inputRate));
+  auto &vertex_attributes = description["vertex_attributes"] = nlohmann::json::array();
+  for (const auto &attribute : vertex_attributes_)
+    vertex_attributes.push_back(
+        pack(attribute.location, attribute.binding, attribute.format, attribute.offset));
+  description["input_assembly"] =
+      pack(input_assembly_state_.topology, input_assembly_state_.primitiveRestartEnable);
+  description["tesselation"] = tesselation_state_.patchControlPoints;
+  auto &viewports = description["viewports"] = nlohmann::json::array();
+  for (const auto &viewport : viewports_)
+    viewports.push_back(pack(viewport.x, viewport.y, viewport.width, viewport.height,
+                             viewport.minDepth, viewport.maxDepth));
+  auto &scissors = description["scissors"] = nlohmann::json::array();
+  for (const auto &scissor : scissors_)
+    scissors.push_back(
+        pack(scissor.offset.x, scissor.offset.y, scissor.extent.width, scissor.extent.height));
+  const auto &raster = rasterization_state_;
+  description["rasterization"] =
+      pack(raster.depthClampEnable, raster.rasterizerDiscardEnable, raster.polygonMode,
+           raster.cullMode, raster.frontFace, raster.depthBiasEnable,
+           raster.depthBiasConstantFactor, raster.depthBiasClamp, raster.depthBiasSlopeFactor,
+           raster.lineWidth);
+  const auto &multisample = multisample_state_;
+  description["multisample"] =
+      pack(multisample.rasterizationSamples, multisample.sampleShadingEnable,
+           multisample.minSampleShading, multisample.alphaToCoverageEnable,
+           multisample.alphaToOneEnable);
+  const auto &depth_stencil = depth_stencil_state_;
+  description["depth_stencil"] =
+      pack(depth_stencil.depthTestEnable, depth_stencil.depthWriteEnable,
+           depth_stencil.depthCompareOp, depth_stencil.depthBoundsTestEnable,
+           depth_stencil.stencilTestEnable, depth_stencil.minDepthBounds,
+           depth_stencil.maxDepthBounds);
+  description["stencil_front"] = packStencilOp(depth_stencil.front);
+  description["stencil_back"] = packStencilOp(depth_stencil.back);
+  description["color_blend"] = pack(logic_op_enable_, logic_op_, blend_constants_);
+  auto &blend_states = description["blend_states"] = nlohmann::json::array();
+  for (const auto &blend : blend_states_)
+    blend_states.push_back(pack(blend.blendEnable, blend.srcColorBlendFactor,
+                                blend.dstColorBlendFactor, blend.colorBlendOp,
+                                blend.srcAlphaBlendFactor, blend.dstAlphaBlendFactor,
+                                blend.alphaBlendOp, blend.colorWriteMask));
+  std::vector<uint32_t> dynamic_states;
+  for (auto dynamic_state : dynamic_states_)
+    dynamic_states.push_back(toJson(dynamic_state));
+  std::sort(dynamic_states.begin(), dynamic_states.end());
+  description["dynamic_states"] = dynamic_states;
+  auto &color_attachments = description["color_attachments"] = nlohmann::json::array();
+  for (auto format : color_attachments_)
+    color_attachments.push_back(toJson(format));
+  description["depth_attachment"] = toJson(depth_attachment_);
+  description["stencil_attachment"] = toJson(stencil_attachment_);
+  return description;
+}
+
+GraphicsPipelineBuilder &
+GraphicsPipelineBuilder::load(const nlohmann::json &description,
+                              ShaderModuleCache &shader_module_cache,
+                              const ResourceDescriptorHeapLookup &get_heap) {
+  loadLayout(*this, description, shader_module_cache, get_heap);
+  for (const auto &json : description.at("vertex_bindings")) {
+    auto &binding = vertex_bindings_.emplace_back();
+    unpack(json, binding.binding, binding.stride, binding.inputRate);
+  }
+  for (const auto &json : description.at("vertex_attributes")) {
+    auto &attribute = vertex_attributes_.emplace_back();
+    unpack(json, attribute.location, attribute.binding, attribute.format, attribute.offset);
+  }
+  unpack(description.at("input_assembly"), input_assembly_state_.topology,
+         input_assembly_state_.primitiveRestartEnable);
+  fromJson(description.at("tesselation"), tesselation_state_.patchControlPoints);
+  for (const auto &json : description.at("viewports")) {
+    auto &viewport = viewports_.emplace_back();
+    unpack(json, viewport.x, viewport.y, viewport.width, viewport.height, viewport.minDepth,
+           viewport.maxDepth);
+  }
+  for (const auto &json : description.at("scissors")) {
+    auto &scissor = scissors_.emplace_back();
+    unpack(json, scissor.offset.x, scissor.offset.y, scissor.extent.width, scissor.extent.height);
+  }
+  auto &raster = rasterization_state_;
+  unpack(description.at("rasterization"), raster.depthClampEnable,
+         raster.rasterizerDiscardEnable, raster.polygonMode, raster.cullMode, raster.frontFace,
+         raster.depthBiasEnable, raster.depthBiasConstantFactor, raster.depthBiasClamp,
+         raster.depthBiasSlopeFactor, raster.lineWidth);
+  auto &multisample = multisample_state_;
+  unpack(description.at("multisample"), multisample.rasterizationSamples,
+         multisample.sampleShadingEnable, multisample.minSampleShading,
+         multisample.alphaToCoverageEnable, multisample.alphaToOneEnable);
+  auto &depth_stencil = depth_stencil_state_;
+  unpack(description.at("depth_stencil"), depth_stencil.depthTestEnable,
+         depth_stencil.depthWriteEnable, depth_stencil.depthCompareOp,
+         depth_stencil.depthBoundsTestEnable, depth_stencil.stencilTestEnable,
+         depth_stencil.minDepthBounds, depth_stencil.maxDepthBounds);
+  unpackStencilOp(description.at("stencil_front"), depth_stencil.front);
+  unpackStencilOp(description.at("stencil_back"), depth_stencil.back);
+  unpack(description.at("color_blend"), logic_op_enable_, logic_op_, blend_constants_);
+  for (const auto &json : description.at("blend_states")) {
+    auto &blend = blend_states_.emplace_back();
+    unpack(json, blend.blendEnable, blend.srcColorBlendFactor, blend.dstColorBlendFactor,
+           blend.colorBlendOp, blend.srcAlphaBlendFactor, blend.dstAlphaBlendFactor,
+           blend.alphaBlendOp, blend.colorWriteMask);
+  }
+  for (const auto &json : description.at("dynamic_states"))
+    dynamic_states_.insert(static_cast<vk::DynamicState>(json.get<uint32_t>()));
+  for (const auto &json : description.at("color_attachments"))
+    color_attachments_.push_back(static_cast<vk::Format>(json.get<uint32_t>()));
+  fromJson(description.at("depth_attachment"), depth_attachment_);
+  fromJson(description.at("stencil_attachment"), stencil_attachment_);
+  return *this;
+}
+
+static std::variant<ComputePipelineBuilder, GraphicsPipelineBuilder>
+makeBuilder(const nlohmann::json &description, PipelineCache &pipeline_cache,
+            PipelineLayoutCache &pipeline_layout_cache,
+            DescriptorSetLayoutCache &descriptor_set_layout_cache) {
+  if (description.at("type") == "compute")
+    return ComputePipelineBuilder(pipeline_cache, pipeline_layout_cache,
+                                  descriptor_set_layout_cache);
+  return GraphicsPipelineBuilder(pipeline_cache, pipeline_layout_cache,
+                                 descriptor_set_layout_cache);
+}
+
+RecordedPipeline::RecordedPipeline(const nlohmann::json &description,
+                                   PipelineCache &pipeline_cache,
+                                   PipelineLayoutCache &pipeline_layout_cache,
+                                   DescriptorSetLayoutCache &descriptor_set_layout_cache,
+                                   ShaderModuleCache &shader_module_cache,
+                                   const ResourceDescriptorHeapLookup &get_heap)
+    : builder_(makeBuilder(description, pipeline_cache, pipeline_layout_cache,
+                           descriptor_set_layout_cache)) {
+  layout_ = std::visit(
+      [&](auto &builder) {
+        builder.load(description, shader_module_cache, get_heap);
+        return builder.PipelineLayoutBuilder::build();
+      },
+      builder_);
 }
 } // namespace gfx
@@ -1,5 +1,8 @@
 #include "services/gfx/resources.hpp"
 
+#include <algorithm>
+#include <stdexcept>
+
 namespace gfx {
 
 ResourceDescriptorHeap::ResourceDescriptorHeap(vk::Device device, vk::DescriptorType type,
@@ -22,44 +25,140 @@ ResourceDescriptorHeap::ResourceDescriptorHeap(vk::Device device, vk::Descriptor
   reset();
 }
 
+ResourceDescriptorHeap::ResourceDescriptorHeap(vk::Device device,
+                                               DescriptorBuffers &descriptor_buffers,
+                                               vk::DescriptorType type, uint32_t size,
+                                               uint32_t binding)
+    : device_(device), type_(type), size_(size), binding_(binding),
+      descriptor_buffers_(&descriptor_buffers) {
+  vk::DescriptorSetLayoutBinding layout_binding{binding_, type_, size_,
+                                                vk::ShaderStageFlagBits::eAll};
+  // Descriptor buffers may be written while in use, update-after-bind flags do not apply
+  vk::DescriptorBindingFlags binding_flags = vk::DescriptorBindingFlagBits::ePartiallyBound;
+  descriptor_set_layout_ = device_.createDescriptorSetLayoutUnique(vk::StructureChain{
+      vk::DescriptorSetLayoutCreateInfo{vk::DescriptorSetLayoutCreateFlagBits::eDescriptorBufferEXT,
+                                        layout_binding},
+      vk::DescriptorSetLayoutBindingFlagsCreateInfo{binding_flags}}.get());
+  range_ = descriptor_buffers_->reserve(descriptor_buffers_->getLayoutSize(*descriptor_set_layout_),
+                                        DescriptorBuffers::isSamplerType(type_));
+  descriptor_offset_ = descriptor_buffers_->getBindingOffset(*descriptor_set_layout_, binding_);
+  descriptor_size_ = descriptor_buffers_->getDescriptorSize(type_);
+  reset();
+}
+
 void ResourceDescriptorHeap::flush() {
+  auto &descriptors = flushed_descriptors_;
+  {
+    std::lock_guard lock(*mutex_);
+    descriptors.swap(descriptors_);
+  }
+  if (descriptors.empty())
+    return;
+  auto by_id = [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; };
+  auto same_id = [](const auto &lhs, const auto &rhs) { return lhs.first == rhs.first; };
+  // Stable sort keeps submission order per index, so that only the latest write survives
+  std::stable_sort(descriptors.begin(), descriptors.end(), by_id);
+  auto superseded = std::unique(descriptors.rbegin(), descriptors.rend(), same_id);
+  descriptors.erase(descriptors.begin(), superseded.base());
+  // Heap holds descriptors of single type, infos of contiguous indices are laid out contiguously
+  std::vector<vk::DescriptorImageInfo> image_infos;
+  std::vector<vk::DescriptorBufferInfo> buffer_infos;
+  const bool buffers = std::holds_alternative<vk::DescriptorBufferInfo>(descriptors[0].second);
+  if (buffers)
+    buffer_infos.reserve(descriptors.size());
+  else
+    image_infos.reserve(descriptors.size());
   std::vector<vk::WriteDescriptorSet> writes;
-  writes.reserve(descriptors_.size());
-  for (const auto &[id, descriptor_info] : descriptors_) {
+  for (size_t i = 0; i < descriptors.size(); ++i) {
+    const auto &[id, descriptor_info] = descriptors[i];
+    if (buffers)
+      buffer_infos.push_back(std::get<vk::DescriptorBufferInfo>(descriptor_info));
+    else
+      image_infos.push_back(std::get<vk::DescriptorImageInfo>(descriptor_info));
+    if (i > 0 && descriptors[i - 1].first + 1 == id) {
+      ++writes.back().descriptorCount;
+      continue;
+    }
     writes.emplace_back(descriptor_set_, binding_, id, 1, type_,
-                        std::get_if<vk::DescriptorImageInfo>(&descriptor_info),
-                        std::get_if<vk::DescriptorBufferInfo>(&descriptor_info));
+                        buffers ? nullptr : &image_infos.back(),
+                        buffers ? &buffer_infos.back() : nullptr);
   }
   device_.updateDescriptorSets(writes, {});
-  descriptors_.clear();
+  descriptors.clear();
 };
 void ResourceDescriptorHeap::reset() {
+  std::lock_guard lock(*mutex_);
   descriptors_.clear();
-  free_list_.clear();
-  free_list_.reserve(size_);
-  for (uint32_t i = 0; i < size_; ++i)
-    free_list_.push_back(size_ - i - 1);
+  indices_ = vme::IndexAllocator(size_);
+  retired_.clear();
+}
+
+void ResourceDescriptorHeap::free(uint32_t id) noexcept {
+  std::lock_guard lock(*mutex_);
+  retired_.emplace_back(current_frame_, id);
+}
+
+void ResourceDescriptorHeap::nextFrame(uint32_t frame, uint32_t completed_frames) noexcept {
+  std::lock_guard lock(*mutex_);
+  current_frame_ = frame;
+  while (!retired_.empty() && retired_.front().first < completed_frames) {
+    indices_.free(retired_.front().second);
+    retired_.pop_front();
+  }
 }
 
 uint32_t ResourceDescriptorHeap::allocate() {
-  if (free_list_.empty())
+  auto id = indices_.allocate();
+  if (id == vme::IndexAllocator::invalid_index)
     throw std::runtime_error("Resource heap exceeded");
-  auto id = free_list_.back();
-  free_list_.pop_back();
   return id;
 }
 
+void ResourceDescriptorHeap::write(uint32_t id, const DescriptorInfo &descriptor_info) {
+  if (descriptor_buffers_) {
+    // Each index owns its slot, so concurrent writes need no lock
+    descriptor_buffers_->write(range_.data + descriptor_offset_ + id * descriptor_size_, type_,
+                               std::get_if<vk::DescriptorImageInfo>(&descriptor_info),
+                               std::get_if<vk::DescriptorBufferInfo>(&descriptor_info));
+    return;
+  }
+  std::lock_guard lock(*mutex_);
+  descriptors_.emplace_back(id, descriptor_info);
+}
+
 uint32_t Buffer::allocate(BufferDescriptorHeap &heap, const BufferView &view) {
-  handles_.push_back(heap.allocateUnique(get(), view.offset, view.range));
-  return handles_.back().get();
+  // Descriptor buffers need explicit range
+  const BufferView resolved{view.offset,
+                            view.range == VK_WHOLE_SIZE ? size_ - view.offset : view.range};
+  handles_.push_back(
+      {&heap, resolved, heap.allocateUnique(get(), resolved.offset, resolved.range)});
+  return handles_.back().handle.get();
 }
 
-uint32_t Image::allocate(ImageDescriptorHeap &heap, const ImageView &view, vk::ImageLayout layout) {
-  auto image_view = vk::Device{image_.getOwner().getInfo().device}.createImageViewUnique(
+void Buffer::rebind(vk::Buffer buffer) {
+  *buffer_ = vma::Buffer(buffer, buffer_->getAllocation());
+  for (const auto &handle : handles_)
+    handle.heap->update(handle.handle.get(), buffer, handle.view.offset, handle.view.range);
+}
+
+vk::UniqueImageView Image::createImageView(const ImageView &view) {
+  return vk::Device{image_.getOwner().getInfo().device}.createImageViewUnique(
       {{}, get(), view.view_type, view.format, view.component_mapping, view.subresource_range});
+}
+
+uint32_t Image::allocate(ImageDescriptorHeap &heap, const ImageView &view, vk::ImageLayout layout) {
+  auto image_view = createImageView(view);
   auto handle = heap.allocateUnique(*image_view, layout);
-  handles_.emplace_back(std::move(image_view), std::move(handle));
-  return handles_.back().second.get();
+  handles_.push_back({&heap, view, layout, std::move(image_view), std::move(handle)});
+  return handles_.back().handle.get();
+}
+
+void Image::rebind(vk::Image image) {
+  *image_ = vma::Image(image, image_->getAllocation());
+  for (auto &handle : handles_) {
+    handle.image_view = createImageView(handle.view);
+    handle.heap->update(handle.handle.get(), *handle.image_view, handle.layout);
+  }
 }
 
 uint32_t Sampler::allocate(SamplerDescriptorHeap &heap) {
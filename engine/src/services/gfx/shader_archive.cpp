@@ -0,0 +1,311 @@
+#include "services/gfx/shader_archive.hpp"
+
+#include <spirv_reflect.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SPV_CHECK(result)                                                                          \
+  do {                                                                                             \
+    if ((result) != SPV_REFLECT_RESULT_SUCCESS)                                                    \
+      throw std::runtime_error("spirv-reflect runtime error");                                     \
+  } while (0)
+
+namespace gfx {
+static DescriptorSetLayoutBindings
+getDescriptorSetLayoutBindings(const SpvReflectDescriptorSet *set, vk::ShaderStageFlagBits stage) {
+  std::vector<const SpvReflectDescriptorBinding *> descriptor_bindings(
+      set->bindings, set->bindings + set->binding_count);
+  DescriptorSetLayoutBindings res;
+  std::transform(descriptor_bindings.begin(), descriptor_bindings.end(), std::back_inserter(res),
+                 [&](const SpvReflectDescriptorBinding *binding) {
+                   return vk::DescriptorSetLayoutBinding(
+                       binding->binding, static_cast<vk::DescriptorType>(binding->descriptor_type),
+                       binding->count, stage);
+                 });
+  return res;
+}
+
+ShaderReflection::ShaderReflection(std::span<const uint32_t> code) {
+  spv_reflect::ShaderModule reflection(code.size_bytes(), code.data(),
+                                       SPV_REFLECT_MODULE_FLAG_NO_COPY);
+  SPV_CHECK(reflection.GetResult());
+  entry_point = reflection.GetEntryPointName();
+  stage = static_cast<vk::ShaderStageFlagBits>(reflection.GetShaderStage());
+  // Descriptor sets
+  uint32_t count = 0;
+  SPV_CHECK(reflection.EnumerateDescriptorSets(&count, nullptr));
+  std::vector<SpvReflectDescriptorSet *> descriptor_sets(count);
+  SPV_CHECK(reflection.EnumerateDescriptorSets(&count, descriptor_sets.data()));
+  std::transform(descriptor_sets.begin(), descriptor_sets.end(),
+                 std::back_inserter(descriptor_set_layouts),
+                 [&](const SpvReflectDescriptorSet *set) {
+                   return std::make_pair(set->set, getDescriptorSetLayoutBindings(set, stage));
+                 });
+  // Push constants
+  SPV_CHECK(reflection.EnumeratePushConstantBlocks(&count, nullptr));
+  if (count) {
+    assert(count == 1);
+    SpvReflectBlockVariable *push_constant_block;
+    SPV_CHECK(reflection.EnumeratePushConstantBlocks(&count, &push_constant_block));
+    push_constant_range =
+        vk::PushConstantRange{stage, push_constant_block->offset, push_constant_block->size};
+  }
+  // Vertex inputs
+  if (stage == vk::ShaderStageFlagBits::eVertex) {
+    SPV_CHECK(reflection.EnumerateInputVariables(&count, nullptr));
+    std::vector<SpvReflectInterfaceVariable *> inputs(count);
+    SPV_CHECK(reflection.EnumerateInputVariables(&count, inputs.data()));
+    for (const auto *input : inputs)
+      if (!(input->decoration_flags & SPV_REFLECT_DECORATION_BUILT_IN))
+        vertex_inputs.emplace_back(input->location, static_cast<vk::Format>(input->format));
+    std::sort(vertex_inputs.begin(), vertex_inputs.end());
+  }
+  // Specialization constants
+  SPV_CHECK(reflection.EnumerateSpecializationConstants(&count, nullptr));
+  std::vector<SpvReflectSpecializationConstant *> constants(count);
+  SPV_CHECK(reflection.EnumerateSpecializationConstants(&count, constants.data()));
+  for (const auto *constant : constants)
+    if (constant->name)
+      specialization_constants.emplace(constant->name, constant->constant_id);
+}
+
+std::vector<uint32_t> loadSpirv(const std::filesystem::path &path) {
+  std::ifstream f(path, std::ios::in | std::ios::binary);
+  std::vector<char> code{std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+  // Reloaded files may be caught half-written
+  if (code.size() < sizeof(uint32_t) || code.size() % sizeof(uint32_t) ||
+      *reinterpret_cast<const uint32_t *>(code.data()) != SpvMagicNumber)
+    throw std::runtime_error("Invalid SPIR-V in " + path.string());
+  return {reinterpret_cast<uint32_t *>(code.data()),
+          reinterpret_cast<uint32_t *>(code.data() + code.size())};
+}
+
+// Archive layout, in 32 bit words: header, table of entries, then strings, code and reflection
+// of every shader. Strings are stored as byte size followed by characters padded to words
+static constexpr uint32_t archive_magic = 0x41534d56; // "VMSA"
+static constexpr uint32_t archive_version = 1;
+static constexpr size_t archive_header_size = 3;
+// Name offset, code offset, code size and reflection offset
+static constexpr size_t archive_entry_size = 4;
+
+namespace {
+struct ArchiveWriter {
+  std::vector<uint32_t> words;
+
+  void write(uint32_t value) { words.push_back(value); }
+  void write(const std::string &value) {
+    write(static_cast<uint32_t>(value.size()));
+    const auto offset = words.size();
+    words.resize(offset + (value.size() + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+    std::memcpy(words.data() + offset, value.data(), value.size());
+  }
+  void write(const ShaderReflection &reflection) {
+    write(static_cast<uint32_t>(reflection.stage));
+    write(reflection.entry_point);
+    write(static_cast<uint32_t>(reflection.descriptor_set_layouts.size()));
+    for (const auto &[set, bindings] : reflection.descriptor_set_layouts) {
+      write(set);
+      write(static_cast<uint32_t>(bindings.size()));
+      for (const auto &binding : bindings) {
+        write(binding.binding);
+        write(static_cast<uint32_t>(binding.descriptorType));
+        write(binding.descriptorCount);
+      }
+    }
+    write(reflection.push_constant_range.has_value());
+    if (reflection.push_constant_range) {
+      write(reflection.push_constant_range->offset);
+      write(reflection.push_constant_range->size);
+    }
+    write(static_cast<uint32_t>(reflection.vertex_inputs.size()));
+    for (const auto &[location, format] : reflection.vertex_inputs) {
+      write(location);
+      write(static_cast<uint32_t>(format));
+    }
+    write(static_cast<uint32_t>(reflection.specialization_constants.size()));
+    for (const auto &[name, constant_id] : reflection.specialization_constants) {
+      write(constant_id);
+      write(name);
+    }
+  }
+};
+
+// Bounds-checked, archive may be truncated or stale
+struct ArchiveReader {
+  std::span<const uint32_t> words;
+  size_t offset = 0;
+
+  uint32_t read() {
+    if (offset >= words.size())
+      throw std::runtime_error("Truncated shader archive");
+    return words[offset++];
+  }
+  std::string readString() {
+    const auto size = read();
+    const auto word_count = (size_t{size} + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    if (offset + word_count > words.size())
+      throw std::runtime_error("Truncated shader archive");
+    std::string res(reinterpret_cast<const char *>(words.data() + offset), size);
+    offset += word_count;
+    return res;
+  }
+  ShaderReflection readReflection() {
+    ShaderReflection reflection;
+    reflection.stage = static_cast<vk::ShaderStageFlagBits>(read());
+    reflection.entry_point = readString();
+    reflection.descriptor_set_layouts.resize(read());
+    for (auto &[set, bindings] : reflection.descriptor_set_layouts) {
+      set = read();
+      bindings.resize(read());
+      for (auto &binding : bindings) {
+        binding.binding = read();
+        binding.descriptorType = static_cast<vk::DescriptorType>(read());
+        binding.descriptorCount = read();
+        binding.stageFlags = reflection.stage;
+      }
+    }
+    if (read()) {
+      const auto push_constant_offset = read();
+      reflection.push_constant_range =
+          vk::PushConstantRange{reflection.stage, push_constant_offset, read()};
+    }
+    reflection.vertex_inputs.resize(read());
+    for (auto &[location, format] : reflection.vertex_inputs) {
+      location = read();
+      format = static_cast<vk::Format>(read());
+    }
+    for (auto count = read(); count; --count) {
+      const auto constant_id = read();
+      reflection.specialization_constants.emplace(readString(), constant_id);
+    }
+    return reflection;
+  }
+};
+} // namespace
+
+ShaderArchive::ShaderArchive(const std::filesystem::path &path) {
+#ifdef __unix__
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    throw std::runtime_error("Failed to open shader archive " + path.string());
+  struct stat file_stat;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+    data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // Mapping stays valid after descriptor is closed
+  close(fd);
+  if (data == MAP_FAILED)
+    throw std::runtime_error("Failed to map shader archive " + path.string());
+  words_ = static_cast<const uint32_t *>(data);
+  word_count_ = static_cast<size_t>(file_stat.st_size) / sizeof(uint32_t);
+#else
+  std::ifstream f(path, std::ios::in | std::ios::binary | std::ios::ate);
+  if (!f)
+    throw std::runtime_error("Failed to open shader archive " + path.string());
+  contents_.resize(static_cast<size_t>(f.tellg()) / sizeof(uint32_t));
+  f.seekg(0);
+  f.read(reinterpret_cast<char *>(contents_.data()), contents_.size() * sizeof(uint32_t));
+  words_ = contents_.data();
+  word_count_ = contents_.size();
+#endif
+  try {
+    ArchiveReader reader{{words_, word_count_}};
+    if (reader.read() != archive_magic || reader.read() != archive_version)
+      throw std::runtime_error("Unsupported shader archive " + path.string());
+    const auto entry_count = reader.read();
+    for (uint32_t i = 0; i < entry_count; ++i) {
+      ArchiveReader entry{{words_, word_count_}, archive_header_size + i * archive_entry_size};
+      const auto name_offset = entry.read();
+      const auto code_offset = entry.read();
+      const auto code_size = entry.read();
+      const auto reflection_offset = entry.read();
+      if (size_t{code_offset} + code_size > word_count_ || reflection_offset >= word_count_)
+        throw std::runtime_error("Truncated shader archive");
+      entries_.emplace(ArchiveReader{{words_, word_count_}, name_offset}.readString(),
+                       Entry{{words_ + code_offset, code_size}, reflection_offset});
+    }
+  } catch (...) {
+    unmap();
+    throw;
+  }
+}
+
+ShaderArchive &ShaderArchive::operator=(ShaderArchive &&rhs) noexcept {
+  if (this == &rhs)
+    return *this;
+  unmap();
+  words_ = std::exchange(rhs.words_, nullptr);
+  word_count_ = std::exchange(rhs.word_count_, 0);
+  contents_ = std::move(rhs.contents_);
+  entries_ = std::move(rhs.entries_);
+  return *this;
+}
+
+ShaderArchive::~ShaderArchive() { unmap(); }
+
+void ShaderArchive::unmap() noexcept {
+#ifdef __unix__
+  if (words_)
+    munmap(const_cast<uint32_t *>(words_), word_count_ * sizeof(uint32_t));
+#endif
+  words_ = nullptr;
+  word_count_ = 0;
+  contents_.clear();
+  entries_.clear();
+}
+
+std::optional<std::pair<std::span<const uint32_t>, ShaderReflection>>
+ShaderArchive::find(const std::string &name) const {
+  auto it = entries_.find(name);
+  if (it == entries_.end())
+    return {};
+  const auto &[code, reflection_offset] = it->second;
+  ArchiveReader reader{{words_, word_count_}, reflection_offset};
+  return std::pair{code, reader.readReflection()};
+}
+
+void ShaderArchive::pack(const std::filesystem::path &path,
+                         const std::vector<std::filesystem::path> &spirv_paths) {
+  ArchiveWriter writer;
+  writer.write(archive_magic);
+  writer.write(archive_version);
+  writer.write(static_cast<uint32_t>(spirv_paths.size()));
+  writer.words.resize(archive_header_size + spirv_paths.size() * archive_entry_size);
+  for (size_t i = 0; i < spirv_paths.size(); ++i) {
+    const auto code = loadSpirv(spirv_paths[i]);
+    auto *entry = &writer.words[archive_header_size + i * archive_entry_size];
+    entry[0] = static_cast<uint32_t>(writer.words.size());
+    writer.write(spirv_paths[i].filename().string());
+    // Writes may reallocate the words
+    entry = &writer.words[archive_header_size + i * archive_entry_size];
+    entry[1] = static_cast<uint32_t>(writer.words.size());
+    entry[2] = static_cast<uint32_t>(code.size());
+    writer.words.insert(writer.words.end(), code.begin(), code.end());
+    entry = &writer.words[archive_header_size + i * archive_entry_size];
+    entry[3] = static_cast<uint32_t>(writer.words.size());
+    writer.write(ShaderReflection(code));
+  }
+  // Truncating the file in place would change contents of its live mappings
+  auto temp_path = path;
+  temp_path += ".tmp";
+  std::ofstream f(temp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+  f.write(reinterpret_cast<const char *>(writer.words.data()),
+          writer.words.size() * sizeof(uint32_t));
+  f.close();
+  if (f.fail())
+    throw std::runtime_error("Failed to write shader archive " + temp_path.string());
+  std::filesystem::rename(temp_path, path);
+}
+} // namespace gfx
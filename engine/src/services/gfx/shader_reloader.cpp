@@ -0,0 +1,247 @@
+#include "services/gfx/shader_reloader.hpp"
+#include "common/job_system.hpp"
+#include "services/gfx/context.hpp"
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include <tracy/Tracy.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <system_error>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace gfx {
+template <typename T> static bool isReady(const std::future<T> &future) {
+  return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+ShaderReloader::ShaderReloader(Context &context, vme::JobSystem &job_system)
+    : context_(&context), job_system_(&job_system) {
+#ifdef VME_SHADER_HOT_RELOAD
+#ifdef __linux__
+  watch_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch_fd_ == -1) {
+    spdlog::warn("[gfx] Failed to initialize inotify, shader hot-reload is disabled");
+    return;
+  }
+  watch(ShaderModuleCache::getDirectory());
+#ifdef VME_GLSLANG_VALIDATOR
+  // Includes may live in subdirectories
+  watch(VME_SHADER_SOURCE_DIR);
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::recursive_directory_iterator(VME_SHADER_SOURCE_DIR, ec))
+    if (entry.is_directory())
+      watch(entry.path());
+#endif
+#else
+  spdlog::info("[gfx] Shader hot-reload is only supported on Linux");
+#endif
+#endif
+}
+
+ShaderReloader &ShaderReloader::operator=(ShaderReloader &&rhs) noexcept {
+  if (this == &rhs)
+    return *this;
+  wait();
+#ifdef __linux__
+  if (watch_fd_ != -1)
+    close(watch_fd_);
+#endif
+  context_ = rhs.context_;
+  job_system_ = rhs.job_system_;
+  watch_fd_ = std::exchange(rhs.watch_fd_, -1);
+  watched_directories_ = std::move(rhs.watched_directories_);
+  compilations_ = std::move(rhs.compilations_);
+  modules_ = std::move(rhs.modules_);
+  pipelines_ = std::move(rhs.pipelines_);
+  retired_ = std::move(rhs.retired_);
+  current_frame_ = rhs.current_frame_;
+  return *this;
+}
+
+ShaderReloader::~ShaderReloader() {
+  wait();
+#ifdef __linux__
+  if (watch_fd_ != -1)
+    close(watch_fd_);
+#endif
+}
+
+void ShaderReloader::update(uint32_t frame, uint32_t completed_frames) {
+  current_frame_ = frame;
+  while (!retired_.empty() && retired_.front().first < completed_frames)
+    retired_.pop_front();
+  if (!isWatching())
+    return;
+  ZoneScoped;
+  const auto changes = pollChanges();
+  for (const auto &path : changes)
+    onChanged(path);
+  compileDependents(changes);
+  // Compiled SPIR-V is picked up by the watch on its directory
+  std::erase_if(compilations_, [](const std::future<void> &future) { return isReady(future); });
+  swapModules();
+  swapPipelines();
+}
+
+void ShaderReloader::watch(const std::filesystem::path &directory) {
+#ifdef __linux__
+  // Compilers and editors that save through a temporary file are caught by moves
+  const auto wd = inotify_add_watch(watch_fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd == -1) {
+    spdlog::warn("[gfx] Failed to watch {} for shader changes", directory.string());
+    return;
+  }
+  watched_directories_.emplace(wd, directory);
+  spdlog::info("[gfx] Watching {} for shader changes", directory.string());
+#endif
+}
+
+std::vector<std::filesystem::path> ShaderReloader::pollChanges() {
+  std::vector<std::filesystem::path> changes;
+#ifdef __linux__
+  alignas(inotify_event) char buffer[4096];
+  ssize_t size;
+  while ((size = read(watch_fd_, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t offset = 0; offset < size;) {
+      const auto *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+      if (event->len)
+        if (auto it = watched_directories_.find(event->wd); it != watched_directories_.end())
+          changes.push_back(it->second / event->name);
+      offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+    }
+  }
+#endif
+  // The same file may be written several times in a row
+  std::sort(changes.begin(), changes.end());
+  changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+  return changes;
+}
+
+void ShaderReloader::onChanged(const std::filesystem::path &path) {
+  auto &shader_module_cache = context_->getShaderModuleCache();
+  const auto name = path.filename().string();
+  // Modules that were never loaded are loaded on first use anyway
+  if (path.extension() != ".spv" || !shader_module_cache.find(name))
+    return;
+  spdlog::info("[gfx] Reloading shader module {}", name);
+  modules_.emplace_back(name, job_system_->submit([&shader_module_cache, name]() {
+    ZoneScopedN("Reload shader module");
+    return shader_module_cache.load(name);
+  }));
+}
+
+void ShaderReloader::compileDependents(const std::vector<std::filesystem::path> &changes) {
+#ifdef VME_GLSLANG_VALIDATOR
+  std::unordered_set<std::string> changed;
+  for (const auto &path : changes)
+    if (path.extension() != ".spv")
+      changed.insert(std::filesystem::weakly_canonical(path).string());
+  if (changed.empty())
+    return;
+  auto &shader_module_cache = context_->getShaderModuleCache();
+  std::error_code ec;
+  for (const auto &entry :
+       std::filesystem::recursive_directory_iterator(VME_SHADER_SOURCE_DIR, ec)) {
+    const auto &path = entry.path();
+    const auto spirv_name = path.filename().string() + ".spv";
+    if (!entry.is_regular_file() || !shader_module_cache.find(spirv_name))
+      continue;
+    try {
+      const auto dependencies = ShaderPermutationCache::getDependencies(path);
+      if (std::none_of(dependencies.begin(), dependencies.end(),
+                       [&](const std::string &dependency) { return changed.contains(dependency); }))
+        continue;
+    } catch (const std::exception &e) {
+      spdlog::warn("[gfx] Failed to resolve includes of shader {}: {}", path.string(), e.what());
+      continue;
+    }
+    const auto output = ShaderModuleCache::getDirectory() / spirv_name;
+    spdlog::info("[gfx] Compiling shader {}", path.string());
+    compilations_.push_back(job_system_->submit([path, output]() {
+      ZoneScopedN("Compile shader");
+      // Include fallback matches the permutation preprocessor
+      const auto command = std::string("\"") + VME_GLSLANG_VALIDATOR + "\" -V -I\"" +
+                           VME_SHADER_SOURCE_DIR + "\" \"" + path.string() + "\" -o \"" +
+                           output.string() + "\"";
+      if (std::system(command.c_str()) != 0)
+        spdlog::warn("[gfx] Failed to compile shader {}", path.string());
+    }));
+  }
+#endif
+}
+
+void ShaderReloader::swapModules() {
+  auto &shader_module_cache = context_->getShaderModuleCache();
+  std::unordered_set<std::string> reloaded;
+  for (auto it = modules_.begin(); it != modules_.end();) {
+    auto &[name, future] = *it;
+    if (!isReady(future)) {
+      ++it;
+      continue;
+    }
+    try {
+      *shader_module_cache.find(name) = future.get();
+      reloaded.insert(name);
+    } catch (const std::exception &e) {
+      spdlog::warn("[gfx] Failed to reload shader module {}: {}", name, e.what());
+    }
+    it = modules_.erase(it);
+  }
+  if (reloaded.empty())
+    return;
+  auto &pipeline_cache = context_->getPipelineCache();
+  pipeline_cache.dropLibraries(reloaded);
+  // Pipeline database descriptions of shared pipelines are enough to build them again
+  for (auto &[description, layout, pipeline] : pipeline_cache.getSharedPipelines(reloaded)) {
+    try {
+      auto recorded = std::make_shared<RecordedPipeline>(
+          context_->loadPipeline(nlohmann::json::parse(description)));
+      // Descriptor sets bound by passes follow the old layout
+      if (recorded->getLayout() != layout) {
+        spdlog::warn("[gfx] Reloaded shaders changed pipeline layout, restart to apply them");
+        continue;
+      }
+      pipelines_.push_back({std::move(pipeline), job_system_->submit([recorded]() {
+                              ZoneScopedN("Rebuild pipeline");
+                              return recorded->create();
+                            })});
+    } catch (const std::exception &e) {
+      spdlog::warn("[gfx] Failed to rebuild pipeline: {}", e.what());
+    }
+  }
+}
+
+void ShaderReloader::swapPipelines() {
+  for (auto it = pipelines_.begin(); it != pipelines_.end();) {
+    if (!isReady(it->future)) {
+      ++it;
+      continue;
+    }
+    try {
+      if (auto pipeline = it->future.get()) {
+        std::swap(*it->pipeline, pipeline);
+        retired_.emplace_back(current_frame_, std::move(pipeline));
+      }
+    } catch (const std::exception &e) {
+      spdlog::warn("[gfx] Failed to rebuild pipeline: {}", e.what());
+    }
+    it = pipelines_.erase(it);
+  }
+}
+
+void ShaderReloader::wait() noexcept {
+  for (auto &future : compilations_)
+    future.wait();
+  for (auto &[name, future] : modules_)
+    future.wait();
+  for (auto &rebuild : pipelines_)
+    rebuild.future.wait();
+}
+} // namespace gfx
@@ -1,72 +1,263 @@
 #include "services/gfx/shaders.hpp"
 
 #include <spdlog/spdlog.h>
+#include <tracy/Tracy.hpp>
+#include <xxhash.h>
 
+#include <algorithm>
+#include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
 #include <stdexcept>
-
-#define SPV_CHECK(result)                                                                          \
-  do {                                                                                             \
-    if ((result) != SPV_REFLECT_RESULT_SUCCESS)                                                    \
-      throw std::runtime_error("spirv-reflect runtime error");                                     \
-  } while (0)
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 
 namespace gfx {
 static const std::filesystem::path shaders_path =
     std::filesystem::current_path() / ".." / ".." / "shaders";
 
-ShaderModule::ShaderModule(vk::Device device, const Code &code)
-    : shader_module_(device.createShaderModuleUnique({{}, code})), reflection_(code) {
-  SPV_CHECK(reflection_.GetResult());
+static ShaderReflection reflect(std::span<const uint32_t> code) {
+  ZoneScopedN("Reflect shader");
+  return ShaderReflection(code);
 }
 
-static DescriptorSetLayoutBindings
-getDescriptorSetLayoutBindings(const SpvReflectDescriptorSet *set, vk::ShaderStageFlagBits stage) {
-  std::vector<const SpvReflectDescriptorBinding *> descriptor_bindings(
-      set->bindings, set->bindings + set->binding_count);
-  DescriptorSetLayoutBindings res;
-  std::transform(descriptor_bindings.begin(), descriptor_bindings.end(), std::back_inserter(res),
-                 [&](const SpvReflectDescriptorBinding *binding) {
-                   return vk::DescriptorSetLayoutBinding(
-                       binding->binding, static_cast<vk::DescriptorType>(binding->descriptor_type),
-                       binding->count, stage);
-                 });
-  return res;
+ShaderModule::ShaderModule(vk::Device device, std::span<const uint32_t> code,
+                           const std::string &source_name)
+    : ShaderModule(device, code, reflect(code), source_name) {}
+
+ShaderModule::ShaderModule(vk::Device device, std::span<const uint32_t> code,
+                           ShaderReflection &&reflection, const std::string &source_name)
+    : shader_module_(std::make_shared<const vk::UniqueShaderModule>(
+          device.createShaderModuleUnique({{}, code.size_bytes(), code.data()}))),
+      reflection_(std::make_shared<const ShaderReflection>(std::move(reflection))),
+      source_name_(source_name) {}
+
+ShaderModuleCache::ShaderModuleCache(vk::Device device) : device_(device) {
+  const auto archive_path = shaders_path / "shaders.pak";
+  if (!device_ || !std::filesystem::exists(archive_path))
+    return;
+  try {
+    ZoneScopedN("Map shader archive");
+    archive_ = ShaderArchive(archive_path);
+    archive_time_ = std::filesystem::last_write_time(archive_path);
+    spdlog::info("[gfx] Mapped shader archive {} with {} shaders", archive_path.string(),
+                 archive_.getShaderCount());
+  } catch (const std::exception &e) {
+    spdlog::warn("[gfx] {}, loading shader modules from their files", e.what());
+  }
 }
 
-std::vector<std::pair<uint32_t, DescriptorSetLayoutBindings>>
-ShaderModule::getDescriptorSetLayouts() const {
-  uint32_t count = 0;
-  SPV_CHECK(reflection_.EnumerateDescriptorSets(&count, nullptr));
-  std::vector<SpvReflectDescriptorSet *> descriptor_sets(count);
-  SPV_CHECK(reflection_.EnumerateDescriptorSets(&count, descriptor_sets.data()));
-  auto stage = getStage();
-  std::vector<std::pair<uint32_t, DescriptorSetLayoutBindings>> res;
-  std::transform(descriptor_sets.begin(), descriptor_sets.end(), std::back_inserter(res),
-                 [&](const SpvReflectDescriptorSet *set) {
-                   return std::make_pair(set->set, getDescriptorSetLayoutBindings(set, stage));
-                 });
-  return res;
+const std::filesystem::path &ShaderModuleCache::getDirectory() noexcept { return shaders_path; }
+
+ShaderModule ShaderModuleCache::create(const std::string &name) const {
+  if (archive_) {
+    // Shaders rebuilt after archive was packed, e.g. while hot-reloading, are newer in their files
+    std::error_code error;
+    const auto time = std::filesystem::last_write_time(shaders_path / name, error);
+    if (error || time <= archive_time_)
+      if (auto shader = archive_.find(name))
+        return ShaderModule(device_, shader->first, std::move(shader->second), name);
+  }
+  return load(name);
 }
 
-std::optional<vk::PushConstantRange> ShaderModule::getPushConstantRange() const {
-  uint32_t count = 0;
-  SPV_CHECK(reflection_.EnumeratePushConstantBlocks(&count, nullptr));
-  if (!count)
-    return {};
-  assert(count == 1);
-  SpvReflectBlockVariable *push_constant_block;
-  SPV_CHECK(reflection_.EnumeratePushConstantBlocks(&count, &push_constant_block));
-  return vk::PushConstantRange{getStage(), push_constant_block->offset, push_constant_block->size};
-};
-
-ShaderModule ShaderModuleCache::create(const std::string &name) {
+ShaderModule ShaderModuleCache::load(const std::string &name) const {
   std::filesystem::path path = shaders_path / name;
   spdlog::info("[gfx] Loading shader module from {}", path.string());
-  std::ifstream f(path, std::ios::in | std::ios::binary);
-  std::vector<char> code{std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
-  return ShaderModule(device_, {reinterpret_cast<uint32_t *>(code.data()),
-                                reinterpret_cast<uint32_t *>(code.data() + code.size())});
+  return ShaderModule(device_, loadSpirv(path), name);
+}
+
+ShaderPermutationKey::ShaderPermutationKey(
+    std::string source, std::vector<std::pair<std::string, std::string>> defines,
+    std::vector<std::pair<std::string, uint32_t>> specialization_constants)
+    : source(std::move(source)), defines(std::move(defines)),
+      specialization_constants(std::move(specialization_constants)) {
+  // Same permutation requested with differently ordered lists is compiled once
+  std::sort(this->defines.begin(), this->defines.end());
+  std::sort(this->specialization_constants.begin(), this->specialization_constants.end());
+}
+
+size_t ShaderPermutationKey::Hash::operator()(const ShaderPermutationKey &key) const noexcept {
+  size_t seed = std::hash<std::string>{}(key.source);
+  for (const auto &[name, value] : key.defines) {
+    vme::hashCombine(seed, name);
+    vme::hashCombine(seed, value);
+  }
+  for (const auto &[name, value] : key.specialization_constants) {
+    vme::hashCombine(seed, name);
+    vme::hashCombine(seed, value);
+  }
+  return seed;
+}
+
+ShaderPermutation::ShaderPermutation(
+    ShaderModule &&shader_module,
+    const std::vector<std::pair<std::string, uint32_t>> &specialization_constants)
+    : shader_module_(std::move(shader_module)) {
+  const auto &constant_ids = shader_module_.getSpecializationConstants();
+  for (const auto &[name, value] : specialization_constants) {
+    auto it = constant_ids.find(name);
+    if (it == constant_ids.end())
+      throw std::runtime_error("Unknown specialization constant " + name);
+    map_entries_.emplace_back(it->second, static_cast<uint32_t>(data_.size() * sizeof(uint32_t)),
+                              sizeof(uint32_t));
+    data_.push_back(value);
+  }
+  specialization_info_ = {static_cast<uint32_t>(map_entries_.size()), map_entries_.data(),
+                          data_.size() * sizeof(uint32_t), data_.data()};
+}
+
+ShaderPermutation &ShaderPermutation::operator=(ShaderPermutation &&rhs) noexcept {
+  shader_module_ = std::move(rhs.shader_module_);
+  map_entries_ = std::move(rhs.map_entries_);
+  data_ = std::move(rhs.data_);
+  specialization_info_ = {static_cast<uint32_t>(map_entries_.size()), map_entries_.data(),
+                          data_.size() * sizeof(uint32_t), data_.data()};
+  return *this;
+}
+
+static std::string getLineDirective(uint32_t line, const std::filesystem::path &path) {
+  return "#line " + std::to_string(line) + " \"" + path.generic_string() + "\"\n";
+}
+
+// Inlines #include "name" directives, every file is included once. Included files are wrapped in
+// #line directives, so that compiler errors point at lines of original files. False when file was
+// already included
+static bool preprocess(const std::filesystem::path &path, std::unordered_set<std::string> &included,
+                       std::string &output, bool root = true) {
+  if (!included.insert(std::filesystem::weakly_canonical(path).string()).second)
+    return false;
+  std::ifstream f(path);
+  if (!f)
+    throw std::runtime_error("Failed to open shader source " + path.string());
+  if (!root)
+    output += getLineDirective(1, path);
+  std::string line;
+  for (uint32_t line_number = 1; std::getline(f, line); ++line_number) {
+    std::string_view directive(line);
+    directive.remove_prefix(std::min(directive.find_first_not_of(" \t"), directive.size()));
+    // Removed lines are kept empty to preserve line numbers
+    if (directive.starts_with("#extension GL_GOOGLE_include_directive")) {
+      output += '\n';
+      continue;
+    }
+    if (!directive.starts_with("#include")) {
+      output += line;
+      output += '\n';
+      continue;
+    }
+    const auto begin = directive.find('"');
+    const auto end = directive.rfind('"');
+    if (begin == std::string_view::npos || end == begin)
+      throw std::runtime_error("Malformed #include in " + path.string());
+    const std::filesystem::path name(directive.substr(begin + 1, end - begin - 1));
+    // Relative to including file first, then to source directory
+    auto include_path = path.parent_path() / name;
+    if (!std::filesystem::exists(include_path))
+      include_path = ShaderPermutationCache::getSourceDirectory() / name;
+    if (preprocess(include_path, included, output, false))
+      output += getLineDirective(line_number + 1, path);
+    else
+      output += '\n';
+  }
+  return true;
+}
+
+bool ShaderPermutationCache::isAvailable() noexcept {
+#ifdef VME_GLSLANG_VALIDATOR
+  return true;
+#else
+  return false;
+#endif
+}
+
+const std::filesystem::path &ShaderPermutationCache::getSourceDirectory() noexcept {
+#ifdef VME_SHADER_SOURCE_DIR
+  static const std::filesystem::path source_path = VME_SHADER_SOURCE_DIR;
+  return source_path;
+#else
+  return shaders_path;
+#endif
+}
+
+std::unordered_set<std::string>
+ShaderPermutationCache::getDependencies(const std::filesystem::path &path) {
+  std::string source;
+  std::unordered_set<std::string> included;
+  preprocess(path, included, source);
+  return included;
+}
+
+ShaderPermutation ShaderPermutationCache::create(const ShaderPermutationKey &key) const {
+  ZoneScoped;
+  const auto path = getSourceDirectory() / key.source;
+  std::string source;
+  std::unordered_set<std::string> included;
+  preprocess(path, included, source);
+  // Defines go right after #version, which has to come first and can't come from an include
+  const auto version = source.find("#version");
+  if (version == std::string::npos)
+    throw std::runtime_error("Missing #version in " + path.string());
+  const auto version_end = source.find('\n', version) + 1;
+  const auto version_line =
+      static_cast<uint32_t>(std::count(source.begin(), source.begin() + version_end, '\n'));
+  std::string defines = "#extension GL_GOOGLE_cpp_style_line_directive : require\n";
+  for (const auto &[name, value] : key.defines)
+    defines += "#define " + name + " " + value + "\n";
+  defines += getLineDirective(version_line + 1, path);
+  source.insert(version_end, defines);
+  spdlog::info("[gfx] Loading shader permutation of {} with {} defines", key.source,
+               key.defines.size());
+  return ShaderPermutation(ShaderModule(device_, compile(source, path.extension().string())),
+                           key.specialization_constants);
+}
+
+ShaderModule::Code ShaderPermutationCache::compile(const std::string &source,
+                                                   const std::string &extension) const {
+#ifdef VME_GLSLANG_VALIDATOR
+  // Preprocessed source covers includes and defines, extension covers stage. Content is stored
+  // next to SPIR-V and compared on a hit, so that hash collisions can't pick a wrong module
+  const auto content = extension + "\n" + source;
+  std::ostringstream hash;
+  hash << std::hex << std::setw(16) << std::setfill('0')
+       << XXH64(content.data(), content.size(), 0);
+  const auto spirv_path = cache_dir_ / (hash.str() + ".spv");
+  const auto content_path = cache_dir_ / (hash.str() + ".src");
+  if (std::filesystem::exists(spirv_path)) {
+    std::ifstream f(content_path, std::ios::in | std::ios::binary);
+    const std::string cached_content{std::istreambuf_iterator<char>(f),
+                                     std::istreambuf_iterator<char>()};
+    if (cached_content == content)
+      return loadSpirv(spirv_path);
+    spdlog::warn("[gfx] Cached shader permutation {} doesn't match its source, compiling it again",
+                 spirv_path.string());
+  }
+  ZoneScopedN("Compile shader permutation");
+  std::filesystem::create_directories(cache_dir_);
+  // Threads compiling same permutation don't share files, extension lets compiler deduce stage
+  const auto name =
+      hash.str() + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+  const auto source_path = cache_dir_ / (name + extension);
+  const auto output_path = cache_dir_ / (name + ".spv");
+  std::ofstream(source_path, std::ios::out | std::ios::binary) << source;
+  const auto command = std::string("\"") + VME_GLSLANG_VALIDATOR + "\" -V \"" +
+                       source_path.string() + "\" -o \"" + output_path.string() + "\"";
+  if (std::system(command.c_str()) != 0)
+    throw std::runtime_error("Failed to compile shader permutation, preprocessed source is in " +
+                             source_path.string());
+  std::filesystem::remove(source_path);
+  // Content is written first, so that SPIR-V is never found without it
+  const auto content_tmp_path = cache_dir_ / (name + ".src");
+  std::ofstream(content_tmp_path, std::ios::out | std::ios::binary) << content;
+  std::filesystem::rename(content_tmp_path, content_path);
+  std::filesystem::rename(output_path, spirv_path);
+  return loadSpirv(spirv_path);
+#else
+  throw std::runtime_error("Runtime shader compilation is not available");
+#endif
 }
 } // namespace gfx
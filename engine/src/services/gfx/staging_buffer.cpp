@@ -1,92 +1,200 @@
 #include "services/gfx/staging_buffer.hpp"
+#include "services/gfx/memory_tags.hpp"
+
+#include "common/stream_copy.hpp"
+
+#include <spdlog/spdlog.h>
+#include <tracy/Tracy.hpp>
+
+#include <algorithm>
 
 namespace gfx {
 class CmdBufGenerator {
 public:
-  CmdBufGenerator(vk::CommandBuffer cmd_buf, vk::Buffer staging_buf)
-      : cmd_buf_(cmd_buf), staging_buf_(staging_buf) {}
+  CmdBufGenerator(vk::CommandBuffer cmd_buf) : cmd_buf_(cmd_buf) {}
 
   void operator()(const StagingBuffer::BufferCopy &copy) {
-    cmd_buf_.copyBuffer2(vk::CopyBufferInfo2{staging_buf_, copy.buffer, copy.regions});
+    cmd_buf_.copyBuffer2(vk::CopyBufferInfo2{copy.src_buffer, copy.buffer, copy.regions});
   }
 
   void operator()(const StagingBuffer::ImageCopy &copy) {
-    if (copy.old_layout != vk::ImageLayout::eTransferDstOptimal) {
-      vk::ImageMemoryBarrier2 barrier{vk::PipelineStageFlagBits2::eTopOfPipe,
-                                      vk::AccessFlagBits2::eNone,
-                                      vk::PipelineStageFlagBits2::eCopy,
-                                      vk::AccessFlagBits2::eTransferWrite,
-                                      copy.old_layout,
-                                      vk::ImageLayout::eTransferDstOptimal,
-                                      {},
-                                      {},
-                                      copy.image,
-                                      copy.subresource};
-      cmd_buf_.pipelineBarrier2({vk::DependencyFlags{}, {}, {}, barrier});
-    }
-
     cmd_buf_.copyBufferToImage2(vk::CopyBufferToImageInfo2{
-        staging_buf_, copy.image, vk::ImageLayout::eTransferDstOptimal, copy.regions});
-
-    if (copy.new_layout != vk::ImageLayout::eTransferDstOptimal) {
-      vk::ImageMemoryBarrier2 barrier{vk::PipelineStageFlagBits2::eCopy,
-                                      vk::AccessFlagBits2::eTransferWrite,
-                                      vk::PipelineStageFlagBits2::eBottomOfPipe,
-                                      vk::AccessFlagBits2::eNone,
-                                      vk::ImageLayout::eTransferDstOptimal,
-                                      copy.new_layout,
-                                      {},
-                                      {},
-                                      copy.image,
-                                      copy.subresource};
-      cmd_buf_.pipelineBarrier2({vk::DependencyFlags{}, {}, {}, barrier});
-    }
+        copy.src_buffer, copy.image, vk::ImageLayout::eTransferDstOptimal, copy.regions});
   }
 
 private:
   vk::CommandBuffer cmd_buf_;
-  vk::Buffer staging_buf_;
 };
 
 StagingBuffer::StagingBuffer(vk::Device device, uint32_t queue_family_index, uint32_t queue_index,
-                             vma::Allocator allocator)
-    : device_(device), queue_(device.getQueue(queue_family_index, queue_index)) {
+                             vma::Allocator allocator, vme::JobSystem *job_system,
+                             size_t chunk_size, std::chrono::milliseconds release_delay)
+    : device_(device), queue_(device.getQueue(queue_family_index, queue_index)),
+      allocator_(allocator), job_system_(job_system), chunk_size_(chunk_size),
+      release_delay_(release_delay) {
   upload_fence_ = device_.createFenceUnique({});
   command_pool_ = device_.createCommandPoolUnique({{}, queue_family_index});
   command_buffer_ = std::move(
       device_.allocateCommandBuffersUnique({*command_pool_, vk::CommandBufferLevel::ePrimary, 1})
           .front());
-  staging_buffer_ = allocator.createBufferUnique(
-      {{}, max_size, vk::BufferUsageFlagBits::eTransferSrc},
-      {VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT,
-       VMA_MEMORY_USAGE_AUTO});
-  mapped_data_ = allocator.getAllocationInfo(staging_buffer_->getAllocation()).pMappedData;
+}
+
+// Ranges overlap when their aspects, mip levels and array layers all intersect
+static bool overlaps(const vk::ImageSubresourceRange &a, const vk::ImageSubresourceRange &b) {
+  auto intersects = [](uint32_t a_base, uint32_t a_count, uint32_t b_base, uint32_t b_count) {
+    const auto a_end = a_count == VK_REMAINING_MIP_LEVELS ? UINT32_MAX : a_base + a_count;
+    const auto b_end = b_count == VK_REMAINING_MIP_LEVELS ? UINT32_MAX : b_base + b_count;
+    return a_base < b_end && b_base < a_end;
+  };
+  return (a.aspectMask & b.aspectMask) &&
+         intersects(a.baseMipLevel, a.levelCount, b.baseMipLevel, b.levelCount) &&
+         intersects(a.baseArrayLayer, a.layerCount, b.baseArrayLayer, b.layerCount);
 }
 
 void StagingBuffer::flush() {
+  if (copies_.empty())
+    return;
   command_buffer_->begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-  for (const auto &copy : copies_)
-    std::visit(CmdBufGenerator(*command_buffer_, staging_buffer_->getBuffer()), copy);
+  // Layout transitions of a batch of copies are gathered, so that it's surrounded by just two
+  // barriers. Batch is split before a copy to a subresource that was already written in it
+  struct WrittenImage {
+    vk::Image image;
+    vk::ImageSubresourceRange subresource;
+    vk::ImageLayout layout;
+    vk::PipelineStageFlags2 stage;
+  };
+  std::vector<WrittenImage> written;
+  std::vector<vk::ImageMemoryBarrier2> pre_copy_barriers, post_copy_barriers;
+  size_t batch_begin = 0, batch_written_begin = 0;
+  auto recordBatch = [&](size_t batch_end) {
+    if (!pre_copy_barriers.empty())
+      command_buffer_->pipelineBarrier2({vk::DependencyFlags{}, {}, {}, pre_copy_barriers});
+    for (size_t i = batch_begin; i < batch_end; ++i)
+      std::visit(CmdBufGenerator(*command_buffer_), copies_[i]);
+    if (!post_copy_barriers.empty())
+      command_buffer_->pipelineBarrier2({vk::DependencyFlags{}, {}, {}, post_copy_barriers});
+    pre_copy_barriers.clear();
+    post_copy_barriers.clear();
+    batch_begin = batch_end;
+    batch_written_begin = written.size();
+  };
+  for (size_t i = 0; i < copies_.size(); ++i) {
+    const auto *image_copy = std::get_if<ImageCopy>(&copies_[i]);
+    if (!image_copy)
+      continue;
+    auto old_layout = image_copy->old_layout;
+    vk::PipelineStageFlags2 src_stage = vk::PipelineStageFlagBits2::eTopOfPipe;
+    vk::AccessFlags2 src_access = vk::AccessFlagBits2::eNone;
+    auto previous = std::find_if(written.rbegin(), written.rend(), [&](const WrittenImage &w) {
+      return w.image == image_copy->image && overlaps(w.subresource, image_copy->subresource);
+    });
+    if (previous != written.rend()) {
+      if (static_cast<size_t>(written.rend() - previous - 1) >= batch_written_begin)
+        recordBatch(i);
+      // Continue from the layout the earlier upload left, after its copy and transition
+      if (previous->subresource == image_copy->subresource)
+        old_layout = previous->layout;
+      src_stage = vk::PipelineStageFlagBits2::eCopy | previous->stage;
+      src_access = vk::AccessFlagBits2::eTransferWrite;
+    }
+    if (old_layout != vk::ImageLayout::eTransferDstOptimal || previous != written.rend())
+      pre_copy_barriers.emplace_back(
+          src_stage, src_access, vk::PipelineStageFlagBits2::eCopy,
+          vk::AccessFlagBits2::eTransferWrite, old_layout, vk::ImageLayout::eTransferDstOptimal,
+          VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image_copy->image,
+          image_copy->subresource);
+    if (image_copy->new_layout != vk::ImageLayout::eTransferDstOptimal)
+      post_copy_barriers.emplace_back(
+          vk::PipelineStageFlagBits2::eCopy, vk::AccessFlagBits2::eTransferWrite,
+          image_copy->dst_stage, image_copy->dst_access, vk::ImageLayout::eTransferDstOptimal,
+          image_copy->new_layout, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+          image_copy->image, image_copy->subresource);
+    written.push_back({image_copy->image, image_copy->subresource, image_copy->new_layout,
+                       image_copy->dst_stage});
+  }
+  recordBatch(copies_.size());
   command_buffer_->end();
   queue_.submit(vk::SubmitInfo{{}, {}, *command_buffer_}, *upload_fence_);
   if (device_.waitForFences(*upload_fence_, VK_TRUE, UINT64_MAX) == vk::Result::eTimeout)
     throw std::runtime_error("Unexpected upload fence timeout");
   device_.resetFences(*upload_fence_);
   device_.resetCommandPool(*command_pool_);
+  const auto now = Clock::now();
+  for (size_t i = 0; i <= current_chunk_ && i < chunks_.size(); ++i)
+    chunks_[i].last_used = now;
+  current_chunk_ = 0;
   offset_ = 0;
   copies_.clear();
 }
 
-size_t StagingBuffer::copyData(const void *data, size_t size) {
+void StagingBuffer::trim() noexcept {
+  // Chunks are filled front to back, so idle ones are always at the tail
+  const size_t used_chunks = copies_.empty() ? 0 : current_chunk_ + 1;
+  const auto now = Clock::now();
+  while (chunks_.size() > used_chunks && now - chunks_.back().last_used >= release_delay_) {
+    spdlog::debug("[gfx] Releasing staging chunk of {} bytes", chunks_.back().size);
+    resident_size_ -= chunks_.back().size;
+    chunks_.pop_back();
+  }
+  TracyPlot("Staging memory", static_cast<int64_t>(resident_size_));
+}
+
+StagingBuffer::Chunk *StagingBuffer::findChunk(size_t size) noexcept {
+  for (; current_chunk_ < chunks_.size(); ++current_chunk_, offset_ = 0)
+    if (offset_ + size <= chunks_[current_chunk_].size)
+      return &chunks_[current_chunk_];
+  return nullptr;
+}
+
+StagingBuffer::Chunk &StagingBuffer::createChunk(size_t size) {
+  auto buffer = allocator_.createBufferUnique(
+      {{}, size, vk::BufferUsageFlagBits::eTransferSrc},
+      tagAllocation({VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                         VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                     VMA_MEMORY_USAGE_AUTO},
+                    Subsystem::eStaging),
+      "staging:chunk");
+  auto mapped_data = allocator_.getAllocationInfo(buffer->getAllocation()).pMappedData;
+  chunks_.push_back(Chunk{std::move(buffer), mapped_data, size, Clock::now()});
+  resident_size_ += size;
+  high_water_mark_ = std::max(high_water_mark_, resident_size_);
+  current_chunk_ = chunks_.size() - 1;
+  offset_ = 0;
+  return chunks_.back();
+}
+
+StagingBuffer::Chunk &StagingBuffer::getChunk(size_t size) {
+  if (auto chunk = findChunk(size))
+    return *chunk;
+  const size_t chunk_size = std::max(size, chunk_size_);
+  if (resident_size_ + chunk_size <= max_size)
+    return createChunk(chunk_size);
+  // Pool limit reached: submit pending copies and reuse existing chunks
+  flush();
+  if (auto chunk = findChunk(size))
+    return *chunk;
+  // None of the existing chunks is large enough, release them to make room for a new one
+  while (!chunks_.empty() && resident_size_ + chunk_size > max_size) {
+    resident_size_ -= chunks_.back().size;
+    chunks_.pop_back();
+  }
+  return createChunk(chunk_size);
+}
+
+std::pair<vk::Buffer, size_t> StagingBuffer::copyData(const void *data, size_t size) {
   if (size > max_size)
     throw std::runtime_error("Data block exceeds staging buffer size");
-  else if (offset_ + size > max_size)
-    flush();
-  assert(offset_ + size <= max_size);
-  memcpy(reinterpret_cast<void *>(reinterpret_cast<std::byte *>(mapped_data_) + offset_), data,
-         size);
+  ZoneScoped;
+  auto &chunk = getChunk(size);
+  assert(offset_ + size <= chunk.size);
+  // Staging memory is write-combined, so bypass caches with streaming stores
+  void *dst = reinterpret_cast<void *>(reinterpret_cast<std::byte *>(chunk.mapped_data) + offset_);
+  if (job_system_ && size >= parallel_copy_threshold)
+    vme::parallelStreamCopy(*job_system_, dst, data, size);
+  else
+    vme::streamCopy(dst, data, size);
   auto offset = offset_;
   offset_ += size;
-  return offset;
+  return {chunk.buffer->getBuffer(), offset};
 }
 } // namespace gfx
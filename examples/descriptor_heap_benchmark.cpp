@@ -0,0 +1,168 @@
+#include "common/index_allocator.hpp"
+#include "engine.hpp"
+#include "services/gfx/context.hpp"
+
+#include <cxxopts.hpp>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+template <typename Func> static double runThreads(unsigned thread_count, Func &&func) {
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count);
+  auto start = Clock::now();
+  for (unsigned i = 0; i < thread_count; ++i)
+    threads.emplace_back([&func, i] { func(i); });
+  for (auto &thread : threads)
+    thread.join();
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  return elapsed.count();
+}
+
+// Random allocate/free mix, every allocated index is checked to be owned by one thread only
+static bool runStressTest(unsigned thread_count, unsigned iterations, uint32_t capacity) {
+  vme::IndexAllocator allocator(capacity);
+  std::vector<std::atomic<uint8_t>> owned(capacity);
+  std::atomic<unsigned> duplicates = 0;
+  const uint32_t max_owned = capacity / thread_count;
+  runThreads(thread_count, [&](unsigned thread_index) {
+    std::mt19937 random(thread_index);
+    std::vector<uint32_t> indices;
+    indices.reserve(max_owned);
+    for (unsigned i = 0; i < iterations; ++i) {
+      if (indices.empty() || (indices.size() < max_owned && random() % 2)) {
+        const auto index = allocator.allocate();
+        if (index == vme::IndexAllocator::invalid_index)
+          continue;
+        if (owned[index].exchange(1))
+          ++duplicates;
+        indices.push_back(index);
+      } else {
+        const auto position = random() % indices.size();
+        const auto index = indices[position];
+        indices[position] = indices.back();
+        indices.pop_back();
+        owned[index].store(0);
+        allocator.free(index);
+      }
+    }
+    for (auto index : indices) {
+      owned[index].store(0);
+      allocator.free(index);
+    }
+  });
+  // All indices have to be allocatable again
+  uint32_t reallocated = 0;
+  while (allocator.allocate() != vme::IndexAllocator::invalid_index)
+    ++reallocated;
+  spdlog::info("Stress test: {} duplicates, {} of {} indices reallocated", duplicates.load(),
+               reallocated, capacity);
+  return duplicates == 0 && reallocated == capacity;
+}
+
+// Each thread repeatedly allocates a batch of indices and frees it again
+template <typename Allocate, typename Free>
+static double measureThroughput(unsigned thread_count, unsigned iterations, unsigned batch,
+                                Allocate &&allocate, Free &&free) {
+  const double seconds = runThreads(thread_count, [&](unsigned) {
+    std::vector<uint32_t> indices(batch);
+    for (unsigned i = 0; i < iterations; ++i) {
+      for (auto &index : indices)
+        index = allocate();
+      for (auto index : indices)
+        free(index);
+    }
+  });
+  return 2. * thread_count * iterations * batch / seconds / 1e6;
+}
+
+static void runAllocatorBenchmarks(unsigned thread_count, unsigned iterations, unsigned batch,
+                                   uint32_t capacity) {
+  vme::IndexAllocator allocator(capacity);
+  spdlog::info("{:>24}: {:8.2f} Mops/s", "Lock-free bitset",
+               measureThroughput(
+                   thread_count, iterations, batch, [&] { return allocator.allocate(); },
+                   [&](uint32_t index) { allocator.free(index); }));
+  // Previous heap implementation guarded by a mutex
+  std::mutex mutex;
+  std::vector<uint32_t> free_list;
+  free_list.reserve(capacity);
+  for (uint32_t i = 0; i < capacity; ++i)
+    free_list.push_back(capacity - i - 1);
+  spdlog::info("{:>24}: {:8.2f} Mops/s", "Mutex free list",
+               measureThroughput(
+                   thread_count, iterations, batch,
+                   [&] {
+                     std::lock_guard lock(mutex);
+                     auto index = free_list.back();
+                     free_list.pop_back();
+                     return index;
+                   },
+                   [&](uint32_t index) {
+                     std::lock_guard lock(mutex);
+                     free_list.push_back(index);
+                   }));
+}
+
+// Concurrent descriptor allocation through a standalone sampler heap, drained by flush. Heap of
+// the context is left alone, its freed indices are only recycled by real frames
+static void runHeapBenchmark(unsigned thread_count) {
+  auto &context = vme::Engine::get<gfx::Context>();
+  gfx::SamplerDescriptorHeap heap(context.getDevice(), vk::DescriptorType::eSampler,
+                                  context.getSamplerDescriptorHeap().getSize());
+  auto sampler = context.getDevice().createSamplerUnique({});
+  const uint32_t per_thread = heap.getSize() / thread_count;
+  std::vector<std::vector<uint32_t>> indices(thread_count);
+  const double allocate_seconds = runThreads(thread_count, [&](unsigned thread_index) {
+    indices[thread_index].reserve(per_thread);
+    for (uint32_t i = 0; i < per_thread; ++i)
+      indices[thread_index].push_back(heap.allocate(*sampler));
+  });
+  auto start = Clock::now();
+  heap.flush();
+  std::chrono::duration<double> flush_seconds = Clock::now() - start;
+  runThreads(thread_count, [&](unsigned thread_index) {
+    for (auto index : indices[thread_index])
+      heap.free(index);
+  });
+  spdlog::info("Heap: {} descriptors allocated in {:.3f} ms, flushed in {:.3f} ms",
+               per_thread * thread_count, allocate_seconds * 1e3, flush_seconds.count() * 1e3);
+}
+
+int main(int argc, char *argv[]) {
+  cxxopts::Options options("DescriptorHeapBenchmark",
+                           "Stress-tests and measures concurrent bindless index allocation");
+  options.add_options()("t,threads", "Number of threads",
+                        cxxopts::value<unsigned>()->default_value(
+                            std::to_string(std::max(std::thread::hardware_concurrency(), 2u))))(
+      "i,iterations", "Number of iterations per thread",
+      cxxopts::value<unsigned>()->default_value("100000"))(
+      "c,capacity", "Allocator capacity", cxxopts::value<uint32_t>()->default_value("262144"));
+  auto result = options.parse(argc, argv);
+  const unsigned thread_count = result["threads"].as<unsigned>();
+  const unsigned iterations = result["iterations"].as<unsigned>();
+  const uint32_t capacity = result["capacity"].as<uint32_t>();
+  try {
+    if (!runStressTest(thread_count, iterations, capacity)) {
+      spdlog::error("Stress test failed");
+      return 1;
+    }
+    runAllocatorBenchmarks(thread_count, iterations / 64, 64, capacity);
+    vme::Engine::init();
+    runHeapBenchmark(thread_count);
+    vme::Engine::terminate();
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+  }
+  return 0;
+}
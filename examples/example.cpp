@@ -66,6 +66,22 @@ private:
       window.setFullscreen(!window.isFullscreen());
     }
     prev_state = cur_state;
+    // Start defragmentation
+    static bool prev_defragment_state = false;
+    bool cur_defragment_state = vme::Engine::get<wsi::Input>().isKeyPressed(GLFW_KEY_F9);
+    if (!prev_defragment_state && cur_defragment_state) {
+      auto &context = vme::Engine::get<gfx::Context>();
+      // Geometry is suballocated from dedicated mega buffer, only textures move
+      context.getDefragmenter().begin(
+          context.getMemoryPools().getPool(gfx::ResourceClass::eTexture));
+    }
+    prev_defragment_state = cur_defragment_state;
+    // Dump memory statistics
+    static bool prev_dump_state = false;
+    bool cur_dump_state = vme::Engine::get<wsi::Input>().isKeyPressed(GLFW_KEY_F10);
+    if (!prev_dump_state && cur_dump_state)
+      vme::Engine::get<gfx::Context>().getMemoryTelemetry().dumpStatistics("vma_stats.json");
+    prev_dump_state = cur_dump_state;
     // Collect ImGui data
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
@@ -0,0 +1,146 @@
+#include "engine.hpp"
+#include "services/gfx/context.hpp"
+
+#include <cxxopts.hpp>
+#include <spdlog/spdlog.h>
+
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+static unsigned failures = 0;
+
+static void check(bool condition, const char *description) {
+  if (!condition) {
+    spdlog::error("Check failed: {}", description);
+    ++failures;
+  }
+}
+
+// Keys only compare handles, so samplers don't have to be real
+static vk::Sampler fakeSampler(uintptr_t value) {
+  return vk::Sampler(reinterpret_cast<VkSampler>(value));
+}
+
+template <typename Key> static bool sameKeys(const Key &lhs, const Key &rhs) {
+  return lhs == rhs && typename Key::Hash{}(lhs) == typename Key::Hash{}(rhs);
+}
+
+template <typename Key> static bool differentKeys(const Key &lhs, const Key &rhs) {
+  return !(lhs == rhs) && typename Key::Hash{}(lhs) != typename Key::Hash{}(rhs);
+}
+
+static void checkDescriptorSetLayoutKeys() {
+  const std::vector<vk::Sampler> samplers{fakeSampler(1), fakeSampler(2)};
+  const std::vector<vk::Sampler> other_samplers{fakeSampler(1), fakeSampler(3)};
+  auto makeBindings = [](const std::vector<vk::Sampler> &immutable_samplers) {
+    return std::vector<vk::DescriptorSetLayoutBinding>{
+        {0, vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eVertex},
+        {1, vk::DescriptorType::eSampler, 2, vk::ShaderStageFlagBits::eFragment,
+         immutable_samplers.data()},
+        {2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eAll}};
+  };
+  const auto bindings = makeBindings(samplers);
+  const gfx::DescriptorSetLayoutKey key({}, bindings);
+  // Copies of samplers in another array, bindings in another order
+  const auto sampler_copies = samplers;
+  auto reordered = makeBindings(sampler_copies);
+  std::swap(reordered[0], reordered[2]);
+  check(sameKeys(key, gfx::DescriptorSetLayoutKey({}, reordered)),
+        "reordered descriptor set layout bindings give the same key");
+  const gfx::DescriptorSetLayoutKey push_key(
+      vk::DescriptorSetLayoutCreateFlagBits::ePushDescriptorKHR, bindings);
+  check(differentKeys(key, push_key), "descriptor set layout flags are part of the key");
+  check(differentKeys(key, gfx::DescriptorSetLayoutKey({}, makeBindings(other_samplers))),
+        "immutable samplers are part of the key");
+  // Builders look layouts up by views of their sorted bindings
+  const gfx::DescriptorSetLayoutKey::Hash hash;
+  const gfx::DescriptorSetLayoutKey::Equal equal;
+  const gfx::DescriptorSetLayoutKeyView view{{}, bindings};
+  check(hash(view) == hash(key) && equal(key, view), "key views match their owning keys");
+  const auto other_bindings = makeBindings(other_samplers);
+  check(!equal(key, gfx::DescriptorSetLayoutKeyView{{}, other_bindings}),
+        "key views compare immutable samplers");
+}
+
+static void checkPipelineLayoutKeys() {
+  auto makeKey = []() {
+    return gfx::PipelineLayoutKey{{},
+                                  {},
+                                  {{vk::ShaderStageFlagBits::eVertex, 0, 64},
+                                   {vk::ShaderStageFlagBits::eFragment, 64, 16}}};
+  };
+  const auto key = makeKey();
+  check(sameKeys(key, makeKey()), "equal pipeline layout inputs give the same key");
+  auto other_range = key;
+  other_range.push_constant_ranges.back().size = 32;
+  check(differentKeys(key, other_range), "push constant ranges are part of the key");
+  auto other_flags = key;
+  other_flags.flags = vk::PipelineLayoutCreateFlagBits::eIndependentSetsEXT;
+  check(differentKeys(key, other_flags), "pipeline layout flags are part of the key");
+}
+
+// Builders merge shader stages and sort bindings, so stage order must not create new layouts
+static void checkBuilders() {
+  auto &context = vme::Engine::get<gfx::Context>();
+  auto &shader_module_cache = context.getShaderModuleCache();
+  const auto &vertex = shader_module_cache.get("shader.vert.spv");
+  const auto &fragment = shader_module_cache.get("shader.frag.spv");
+  auto makePipelineLayoutBuilder = [&context]() {
+    gfx::PipelineLayoutBuilder builder(context.getPipelineLayoutCache(),
+                                       context.getDescriptorSetLayoutCache());
+    builder.resourceDescriptorHeap(0, context.getSampledImageDescriptorHeap().getLayout())
+        .resourceDescriptorHeap(1, context.getSamplerDescriptorHeap().getLayout());
+    return builder;
+  };
+  auto vertex_first = makePipelineLayoutBuilder();
+  vertex_first.shaderStage(vertex).shaderStage(fragment);
+  auto fragment_first = makePipelineLayoutBuilder();
+  fragment_first.shaderStage(fragment).shaderStage(vertex);
+  check(vertex_first.build() == fragment_first.build(),
+        "reordered shader stages give the same pipeline layout");
+  auto makeDescriptorSetLayoutBuilder = [&context](bool reversed) {
+    gfx::DescriptorSetLayoutBuilder builder(context.getDescriptorSetLayoutCache());
+    const std::vector<std::pair<uint32_t, vk::DescriptorType>> bindings{
+        {0, vk::DescriptorType::eStorageBuffer}, {1, vk::DescriptorType::eUniformBuffer}};
+    for (size_t i = 0; i < bindings.size(); ++i) {
+      const auto &[binding, type] = bindings[reversed ? bindings.size() - 1 - i : i];
+      builder.binding(binding, type, 1);
+    }
+    return builder;
+  };
+  const auto layout = makeDescriptorSetLayoutBuilder(false).build();
+  check(layout == makeDescriptorSetLayoutBuilder(true).build(),
+        "reordered bindings give the same descriptor set layout");
+  if (context.supportsPushDescriptors())
+    check(layout != makeDescriptorSetLayoutBuilder(false).build(
+                        vk::DescriptorSetLayoutCreateFlagBits::ePushDescriptorKHR),
+          "descriptor set layout flags give another layout");
+}
+
+// Checks that layout caches are keyed by content: equal inputs in another order share a key,
+// flags and immutable samplers don't
+int main(int argc, char *argv[]) {
+  cxxopts::Options options("LayoutKeyCheck", "Checks descriptor set and pipeline layout keys");
+  options.add_options()("g,gpu", "Also check layout builders, which needs a window and device");
+  auto result = options.parse(argc, argv);
+  try {
+    checkDescriptorSetLayoutKeys();
+    checkPipelineLayoutKeys();
+    if (result.count("gpu")) {
+      vme::Engine::init();
+      checkBuilders();
+      vme::Engine::terminate();
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (failures) {
+    spdlog::error("{} layout key checks failed", failures);
+    return 1;
+  }
+  spdlog::info("All layout key checks passed");
+  return 0;
+}
@@ -0,0 +1,35 @@
+#include "engine.hpp"
+#include "services/gfx/context.hpp"
+
+#include <cxxopts.hpp>
+#include <spdlog/spdlog.h>
+
+#include <iostream>
+
+// Compiles every pipeline recorded in pipeline database and saves resulting pipeline cache, so
+// that the first run after a driver update or on a new machine doesn't stutter
+int main(int argc, char *argv[]) {
+  cxxopts::Options options("PipelinePrewarm",
+                           "Compiles recorded pipelines into the pipeline cache of this device");
+  options.add_options()("h,help", "Print usage");
+  auto result = options.parse(argc, argv);
+  if (result.count("help")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+  try {
+    vme::Engine::init();
+    auto &context = vme::Engine::get<gfx::Context>();
+    spdlog::info("Prewarming pipelines from {}",
+                 context.getPipelineCache().getDatabase().getPath().string());
+    const auto count = context.prewarmPipelines();
+    if (!count)
+      spdlog::warn("No pipelines recorded, run the application first to record them");
+    // Pipeline cache is saved on termination
+    vme::Engine::terminate();
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,84 @@
+#include "common/job_system.hpp"
+#include "common/stream_copy.hpp"
+#include "engine.hpp"
+#include "services/gfx/context.hpp"
+
+#include <cxxopts.hpp>
+#include <spdlog/spdlog.h>
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+using CopyFunc = std::function<void(void *, const void *, size_t)>;
+
+static double measureThroughput(const CopyFunc &copy, void *dst, const void *src, size_t size,
+                                unsigned iterations) {
+  using Clock = std::chrono::steady_clock;
+  copy(dst, src, size); // warm up page tables and caches
+  auto start = Clock::now();
+  for (unsigned i = 0; i < iterations; ++i)
+    copy(dst, src, size);
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+  return static_cast<double>(size) * iterations / elapsed.count() / (1024. * 1024. * 1024.);
+}
+
+static void runBenchmarks(vme::JobSystem &job_system, const std::string &memory_name, void *dst,
+                          const void *src, size_t size, unsigned iterations) {
+  const std::pair<const char *, CopyFunc> copies[] = {
+      {"memcpy", [](void *dst, const void *src, size_t size) { std::memcpy(dst, src, size); }},
+      {"streamCopy", vme::streamCopy},
+      {"parallelStreamCopy", [&](void *dst, const void *src, size_t size) {
+         vme::parallelStreamCopy(job_system, dst, src, size);
+       }}};
+  for (const auto &[name, copy] : copies)
+    spdlog::info("{:>16} {:>20}: {:8.2f} GiB/s", memory_name, name,
+                 measureThroughput(copy, dst, src, size, iterations));
+}
+
+int main(int argc, char *argv[]) {
+  cxxopts::Options options("StreamCopyBenchmark",
+                           "Measures copy throughput into write-combined and cached memory");
+  options.add_options()("s,size", "Copy size in MiB",
+                        cxxopts::value<size_t>()->default_value("256"))(
+      "i,iterations", "Number of iterations", cxxopts::value<unsigned>()->default_value("16"))(
+      "g,gpu", "Also measure host-visible GPU memory, which needs a window and device");
+  auto result = options.parse(argc, argv);
+  const size_t size = result["size"].as<size_t>() * 1024 * 1024;
+  const unsigned iterations = result["iterations"].as<unsigned>();
+  try {
+    vme::JobSystem job_system;
+    std::vector<std::byte> src(size, std::byte{0x5a});
+    // Host memory
+    {
+      std::vector<std::byte> dst(size);
+      runBenchmarks(job_system, "Host", dst.data(), src.data(), size, iterations);
+    }
+    if (!result.count("gpu"))
+      return 0;
+    vme::Engine::init();
+    {
+      auto allocator = vme::Engine::get<gfx::Context>().getAllocator();
+      // Host-visible GPU memory: write-combined for sequential writes, cached for random access
+      for (const auto &[name, flags] :
+           {std::pair{"Write-combined", VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT},
+            std::pair{"Cached", VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT}}) {
+        auto buffer = allocator.createBufferUnique(
+            {{}, size, vk::BufferUsageFlagBits::eTransferSrc},
+            gfx::tagAllocation(
+                {static_cast<VmaAllocationCreateFlags>(flags | VMA_ALLOCATION_CREATE_MAPPED_BIT),
+                 VMA_MEMORY_USAGE_AUTO},
+                gfx::Subsystem::eTools),
+            "benchmark:destination");
+        auto dst = allocator.getAllocationInfo(buffer->getAllocation()).pMappedData;
+        runBenchmarks(job_system, name, dst, src.data(), size, iterations);
+      }
+    }
+    vme::Engine::terminate();
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+  }
+  return 0;
+}
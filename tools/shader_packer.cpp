@@ -0,0 +1,35 @@
+#include "services/gfx/shader_archive.hpp"
+
+#include <cxxopts.hpp>
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Packs compiled shaders with their reflection into an archive, which the shader module cache
+// maps at startup instead of reading and reflecting every shader on its own
+int main(int argc, char *argv[]) {
+  cxxopts::Options options("ShaderPacker", "Packs compiled shaders into a shader archive");
+  options.add_options()("h,help", "Print usage")("o,output", "Archive to write",
+                                                 cxxopts::value<std::string>())(
+      "shaders", "Compiled shaders", cxxopts::value<std::vector<std::string>>());
+  options.parse_positional({"shaders"});
+  options.positional_help("<shader.spv>...");
+  auto result = options.parse(argc, argv);
+  if (result.count("help") || !result.count("output") || !result.count("shaders")) {
+    std::cout << options.help() << std::endl;
+    return result.count("help") ? 0 : 1;
+  }
+  try {
+    const auto &shaders = result["shaders"].as<std::vector<std::string>>();
+    const std::filesystem::path output = result["output"].as<std::string>();
+    gfx::ShaderArchive::pack(output,
+                             std::vector<std::filesystem::path>(shaders.begin(), shaders.end()));
+    std::cout << "Packed " << shaders.size() << " shaders into " << output.string() << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}